@@ -0,0 +1,168 @@
+/* -*- mode: C; c-file-style: "linux" -*- */
+
+/*
+ * Watching the files xsri reads for changes.
+ *
+ * We watch the directory containing each file rather than the file
+ * itself, since editors and image programs often save by writing a
+ * new file and renaming it over the old one. Changes are collected
+ * until there have been none for the delay given to
+ * file_watch_new(), so a file written in several steps is only
+ * reported once.
+ */
+
+#include <sys/inotify.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file-watch.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+typedef struct {
+	char  *basename;
+	int    wd;
+	guint  tag;
+} WatchedFile;
+
+struct _FileWatch {
+	int            fd;
+	GSList        *files;
+	guint          delay;
+	guint          changes;
+	guint          timeout_id;
+	FileWatchFunc  func;
+	gpointer       data;
+};
+
+static gboolean
+file_watch_timeout (gpointer data)
+{
+	FileWatch *watch = data;
+	guint changes = watch->changes;
+
+	watch->changes = 0;
+	watch->timeout_id = 0;
+
+	watch->func (changes, watch->data);
+
+	return FALSE;
+}
+
+static gboolean
+file_watch_read (GIOChannel   *source,
+		 GIOCondition  condition,
+		 gpointer      data)
+{
+	FileWatch *watch = data;
+	char buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	struct inotify_event *event;
+	GSList *tmp_list;
+	ssize_t len;
+	char *p;
+
+	while ((len = read (watch->fd, buffer, sizeof (buffer))) > 0) {
+		for (p = buffer; p < buffer + len; p += sizeof (struct inotify_event) + event->len) {
+			event = (struct inotify_event *)p;
+
+			for (tmp_list = watch->files; tmp_list; tmp_list = tmp_list->next) {
+				WatchedFile *file = tmp_list->data;
+
+				/* If the queue overflowed, we don't know what changed */
+				if ((event->mask & IN_Q_OVERFLOW) ||
+				    (event->wd == file->wd && event->len &&
+				     strcmp (event->name, file->basename) == 0))
+					watch->changes |= file->tag;
+			}
+		}
+	}
+
+	if (watch->changes) {
+		if (watch->timeout_id)
+			g_source_remove (watch->timeout_id);
+		watch->timeout_id = g_timeout_add (watch->delay, file_watch_timeout, watch);
+	}
+
+	return TRUE;
+}
+
+/* Returns NULL, with errno set, if inotify isn't available. func is
+ * called from the main loop delay milliseconds after the last change.
+ */
+FileWatch *
+file_watch_new (guint          delay,
+		FileWatchFunc  func,
+		gpointer       data)
+{
+	FileWatch *watch;
+	GIOChannel *channel;
+	int fd;
+
+	fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	watch = g_new0 (FileWatch, 1);
+	watch->fd = fd;
+	watch->delay = delay;
+	watch->func = func;
+	watch->data = data;
+
+	channel = g_io_channel_unix_new (fd);
+	g_io_add_watch (channel, G_IO_IN, file_watch_read, watch);
+	g_io_channel_unref (channel);
+
+	return watch;
+}
+
+void
+file_watch_add (FileWatch  *watch,
+		const char *filename,
+		guint       tag)
+{
+	WatchedFile *file;
+	char *dirname = g_path_get_dirname (filename);
+	int wd;
+
+	/* Watching the same directory again gives the same descriptor */
+	wd = inotify_add_watch (watch->fd, dirname, WATCH_EVENTS);
+	if (wd < 0) {
+		g_warning ("Cannot watch %s: %s", dirname, g_strerror (errno));
+		g_free (dirname);
+		return;
+	}
+	g_free (dirname);
+
+	file = g_new (WatchedFile, 1);
+	file->basename = g_path_get_basename (filename);
+	file->wd = wd;
+	file->tag = tag;
+
+	watch->files = g_slist_prepend (watch->files, file);
+}
+
+/* Stop watching all files, forgetting any changes not yet reported */
+void
+file_watch_clear (FileWatch *watch)
+{
+	GSList *tmp_list;
+
+	for (tmp_list = watch->files; tmp_list; tmp_list = tmp_list->next) {
+		WatchedFile *file = tmp_list->data;
+
+		/* Fails harmlessly if another file had the same directory */
+		inotify_rm_watch (watch->fd, file->wd);
+		g_free (file->basename);
+		g_free (file);
+	}
+
+	g_slist_free (watch->files);
+	watch->files = NULL;
+
+	watch->changes = 0;
+	if (watch->timeout_id) {
+		g_source_remove (watch->timeout_id);
+		watch->timeout_id = 0;
+	}
+}
@@ -0,0 +1,21 @@
+/* -*- mode: C; c-file-style: "linux" -*- */
+
+/*
+ * Watching the files xsri reads for changes.
+ */
+
+#include <glib.h>
+
+typedef struct _FileWatch FileWatch;
+
+/* changes is the bitwise or of the tags of the files that changed */
+typedef void (*FileWatchFunc) (guint    changes,
+			       gpointer data);
+
+FileWatch *file_watch_new   (guint          delay,
+			     FileWatchFunc  func,
+			     gpointer       data);
+void       file_watch_add   (FileWatch     *watch,
+			     const char    *filename,
+			     guint          tag);
+void       file_watch_clear (FileWatch     *watch);
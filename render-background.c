@@ -20,191 +20,2170 @@
 
 #include <X11/Xatom.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h> 
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "render-background.h"
 
+/* Number of differently sized copies of an image kept around; the
+ * emblem needs one, --test needs one more for the tile.
+ */
+#define MAX_SCALED_IMAGES 4
+
+/* Number of differently blurred copies of an image kept around */
+#define MAX_BLURRED_IMAGES 2
+
+/* Protects the half, scaled and blurred caches of all images, so that renders
+ * on different threads can share them. Never held while scaling.
+ */
+static GMutex cache_lock;
+
+typedef enum {
+	SCRATCH_PIXBUF,		/* what background_render() draws from */
+	SCRATCH_ROW,		/* a row of the gradient */
+	SCRATCH_OFFSETS,	/* per column gradient offsets */
+	SCRATCH_LUT,		/* gradient colors */
+	N_SCRATCH
+} ScratchBuffer;
+
+struct _BGRenderContext {
+	gpointer   scratch[N_SCRATCH];
+	gsize      scratch_size[N_SCRATCH];
+	GdkPixbuf *pixbuf;	/* wraps scratch[SCRATCH_PIXBUF] */
+	GSList    *gcs;		/* of ContextGC */
+	gint       max_threads;	/* for blurring, 0 for one per processor */
+	BGImage   *blurred;	/* all of blurred_state, with its blur */
+	BGState    blurred_state;	/* holding references to its images */
+	gboolean   blurred_tile_only;
+};
+
+typedef struct {
+	GdkScreen *screen;
+	gint       depth;
+	GdkGC     *gc;
+} ContextGC;
+
+/* a * b / 255, correctly rounded, for a, b in [0, 255] */
+static inline guint
+mul_un8 (guint a, guint b)
+{
+	guint t = a * b + 0x80;
+
+	return (t + (t >> 8)) >> 8;
+}
+
+static BGImage *
+bg_image_alloc (gint width, gint height)
+{
+	BGImage *image = g_new0 (BGImage, 1);
+	void *pixels;
+
+	image->ref_count = 1;
+	image->width = width;
+	image->height = height;
+	image->rowstride = (width * 4 + 15) & ~15;
+
+	if (posix_memalign (&pixels, 16, (gsize)image->rowstride * MAX (height, 1)) != 0)
+		g_error ("%s: failed to allocate %dx%d image", G_STRLOC, width, height);
+	image->pixels = pixels;
+
+	return image;
+}
+
+static void
+context_drop_blurred (BGRenderContext *context)
+{
+	BGState *state = &context->blurred_state;
+	int i;
+
+	if (!context->blurred)
+		return;
+
+	bg_image_unref (context->blurred);
+	context->blurred = NULL;
+
+	bg_image_unref (state->tile_image);
+	bg_image_unref (state->emblem_image);
+	for (i = 0; i < state->n_layers; i++)
+		bg_image_unref (state->layers[i].image);
+}
+
+BGRenderContext *
+bg_render_context_new (void)
+{
+	return g_new0 (BGRenderContext, 1);
+}
+
+void
+bg_render_context_free (BGRenderContext *context)
+{
+	GSList *tmp_list;
+	int i;
+
+	if (!context)
+		return;
+
+	if (context->pixbuf)
+		g_object_unref (context->pixbuf);
+
+	for (i = 0; i < N_SCRATCH; i++)
+		free (context->scratch[i]);
+
+	context_drop_blurred (context);
+
+	for (tmp_list = context->gcs; tmp_list; tmp_list = tmp_list->next) {
+		ContextGC *context_gc = tmp_list->data;
+
+		g_object_unref (context_gc->gc);
+		g_free (context_gc);
+	}
+	g_slist_free (context->gcs);
+
+	g_free (context);
+}
+
+/* Limit the threads a render with context may blur on, counting the
+ * calling one, to max_threads; 0, the default, is one per processor.
+ */
+void
+bg_render_context_set_max_threads (BGRenderContext *context,
+				   gint             max_threads)
+{
+	context->max_threads = max_threads;
+}
+
+/* Free the scratch memory of context and the blurred background,
+ * keeping the GCs, which cost little; they are made again by the next
+ * render.
+ */
+void
+bg_render_context_trim (BGRenderContext *context)
+{
+	int i;
+
+	context_drop_blurred (context);
+
+	if (context->pixbuf) {
+		g_object_unref (context->pixbuf);
+		context->pixbuf = NULL;
+	}
+
+	for (i = 0; i < N_SCRATCH; i++) {
+		free (context->scratch[i]);
+		context->scratch[i] = NULL;
+		context->scratch_size[i] = 0;
+	}
+}
+
+/* Returns at least size bytes of 16 byte aligned memory, valid until
+ * the next call for the same buffer. The contents are undefined.
+ */
+static gpointer
+context_get_scratch (BGRenderContext *context,
+		     ScratchBuffer    which,
+		     gsize            size)
+{
+	void *data;
+
+	if (size <= context->scratch_size[which])
+		return context->scratch[which];
+
+	free (context->scratch[which]);
+
+	if (posix_memalign (&data, 16, size) != 0)
+		g_error ("%s: failed to allocate %lu bytes", G_STRLOC, (gulong)size);
+
+	context->scratch[which] = data;
+	context->scratch_size[which] = size;
+
+	return data;
+}
+
+/* A pixbuf of the given size over the context's scratch memory */
+static GdkPixbuf *
+context_get_pixbuf (BGRenderContext *context,
+		    gint             width,
+		    gint             height)
+{
+	int rowstride = (width * 3 + 15) & ~15;
+	guchar *pixels;
+
+	if (context->pixbuf &&
+	    gdk_pixbuf_get_width (context->pixbuf) == width &&
+	    gdk_pixbuf_get_height (context->pixbuf) == height)
+		return context->pixbuf;
+
+	if (context->pixbuf)
+		g_object_unref (context->pixbuf);
+
+	pixels = context_get_scratch (context, SCRATCH_PIXBUF, (gsize)rowstride * MAX (height, 1));
+	context->pixbuf = gdk_pixbuf_new_from_data (pixels, GDK_COLORSPACE_RGB, FALSE, 8,
+						    width, height, rowstride, NULL, NULL);
+
+	return context->pixbuf;
+}
+
+/* A GC for drawing to drawable; GCs can be shared between drawables
+ * of the same screen and depth.
+ */
+static GdkGC *
+context_get_gc (BGRenderContext *context,
+		GdkDrawable     *drawable)
+{
+	GdkScreen *screen = gdk_drawable_get_screen (drawable);
+	gint depth = gdk_drawable_get_depth (drawable);
+	ContextGC *context_gc;
+	GSList *tmp_list;
+
+	for (tmp_list = context->gcs; tmp_list; tmp_list = tmp_list->next) {
+		context_gc = tmp_list->data;
+		if (context_gc->screen == screen && context_gc->depth == depth)
+			return context_gc->gc;
+	}
+
+	context_gc = g_new (ContextGC, 1);
+	context_gc->screen = screen;
+	context_gc->depth = depth;
+	context_gc->gc = gdk_gc_new (drawable);
+	context->gcs = g_slist_prepend (context->gcs, context_gc);
+
+	return context_gc->gc;
+}
+
+/* The GC context keeps for drawing to drawable, for callers drawing
+ * bands of their own; it stays owned by context.
+ */
+GdkGC *
+bg_render_context_get_gc (BGRenderContext *context,
+			  GdkDrawable     *drawable)
+{
+	return context_get_gc (context, drawable);
+}
+
+/* Convert a row of straight-alpha RGB or RGBA to premultiplied RGBA,
+ * multiplying in overall_alpha on the way. Returns TRUE if every
+ * pixel of the result is opaque.
+ */
+static gboolean
+premultiply_row (guchar       *dest,
+		 const guchar *src,
+		 int           width,
+		 int           n_channels,
+		 int           overall_alpha)
+{
+	guint opaque = 0xff;
+	int i;
+
+	for (i = 0; i < width; i++) {
+		guint a = n_channels == 4 ? src[3] : 0xff;
+
+		a = mul_un8 (a, overall_alpha);
+		dest[0] = mul_un8 (src[0], a);
+		dest[1] = mul_un8 (src[1], a);
+		dest[2] = mul_un8 (src[2], a);
+		dest[3] = a;
+		opaque &= a;
+
+		src += n_channels;
+		dest += 4;
+	}
+
+	return opaque == 0xff;
+}
+
+static void
+bg_image_fill_from_pixbuf (BGImage *image, GdkPixbuf *pixbuf, gint overall_alpha)
+{
+	int n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+	int src_rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+	guchar *src = gdk_pixbuf_get_pixels (pixbuf);
+	guchar *dest = image->pixels;
+	int j;
+
+	image->opaque = TRUE;
+
+	for (j = 0; j < image->height; j++) {
+		if (!premultiply_row (dest, src, image->width, n_channels, overall_alpha))
+			image->opaque = FALSE;
+		src += src_rowstride;
+		dest += image->rowstride;
+	}
+}
+
+BGImage *
+bg_image_new_from_pixbuf (GdkPixbuf *pixbuf,
+			  gint       overall_alpha)
+{
+	BGImage *image;
+
+	g_return_val_if_fail (pixbuf != NULL, NULL);
+	g_return_val_if_fail (gdk_pixbuf_get_bits_per_sample (pixbuf) == 8, NULL);
+
+	image = bg_image_alloc (gdk_pixbuf_get_width (pixbuf),
+				gdk_pixbuf_get_height (pixbuf));
+	bg_image_fill_from_pixbuf (image, pixbuf, overall_alpha);
+
+	return image;
+}
+
+/* Convert a CAIRO_FORMAT_ARGB32 surface, which is premultiplied
+ * already, multiplying in overall_alpha.
+ */
+BGImage *
+bg_image_new_from_surface (cairo_surface_t *surface,
+			   gint             overall_alpha)
+{
+	int width = cairo_image_surface_get_width (surface);
+	int height = cairo_image_surface_get_height (surface);
+	int src_rowstride = cairo_image_surface_get_stride (surface);
+	BGImage *image;
+	guint opaque = 0xff;
+	int i, j;
+
+	g_return_val_if_fail (cairo_image_surface_get_format (surface) == CAIRO_FORMAT_ARGB32, NULL);
+
+	cairo_surface_flush (surface);
+	image = bg_image_alloc (width, height);
+
+	for (j = 0; j < height; j++) {
+		const guint32 *src = (const guint32 *)(cairo_image_surface_get_data (surface) + j * src_rowstride);
+		guchar *dest = image->pixels + j * image->rowstride;
+
+		for (i = 0; i < width; i++) {
+			dest[0] = mul_un8 ((src[i] >> 16) & 0xff, overall_alpha);
+			dest[1] = mul_un8 ((src[i] >> 8) & 0xff, overall_alpha);
+			dest[2] = mul_un8 (src[i] & 0xff, overall_alpha);
+			dest[3] = mul_un8 (src[i] >> 24, overall_alpha);
+			opaque &= dest[3];
+			dest += 4;
+		}
+	}
+
+	image->opaque = opaque == 0xff;
+
+	return image;
+}
+
+/* Bytes read from an image file at a time when streaming it */
+#define IMAGE_STREAM_CHUNK 65536
+
+typedef struct {
+	gint            width;		/* to decode at, or -1 for its own size */
+	gint            height;
+	GdkRectangle    clip;
+	gboolean        has_clip;
+	gint            overall_alpha;
+	BGImage        *image;
+	gboolean        opaque;
+	gint            rows;		/* top rows of image reported so far */
+	gboolean        revisited;	/* rows were updated out of order */
+	BGImageRowsFunc rows_func;
+	gpointer        data;
+} ImageStream;
+
+static void
+stream_size_prepared (GdkPixbufLoader *loader,
+		      gint             width,
+		      gint             height,
+		      gpointer         data)
+{
+	ImageStream *stream = data;
+
+	if (stream->width > 0)
+		gdk_pixbuf_loader_set_size (loader, stream->width, stream->height);
+}
+
+static void
+stream_area_prepared (GdkPixbufLoader *loader,
+		      gpointer         data)
+{
+	ImageStream *stream = data;
+	GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+	GdkRectangle all = { 0, 0, 0, 0 };
+
+	all.width = gdk_pixbuf_get_width (pixbuf);
+	all.height = gdk_pixbuf_get_height (pixbuf);
+
+	if (!stream->has_clip)
+		stream->clip = all;
+	else if (!gdk_rectangle_intersect (&stream->clip, &all, &stream->clip))
+		return;
+
+	/* Rows not decoded yet stay transparent */
+	stream->image = bg_image_alloc (stream->clip.width, stream->clip.height);
+	memset (stream->image->pixels, 0, (gsize)stream->image->rowstride * stream->image->height);
+}
+
+static void
+stream_area_updated (GdkPixbufLoader *loader,
+		     gint             x,
+		     gint             y,
+		     gint             width,
+		     gint             height,
+		     gpointer         data)
+{
+	ImageStream *stream = data;
+	GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+	BGImage *image = stream->image;
+	int n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+	int src_rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+	int y0, y1, j;
+
+	if (!image)
+		return;
+
+	y0 = MAX (y, stream->clip.y) - stream->clip.y;
+	y1 = MIN (y + height, stream->clip.y + stream->clip.height) - stream->clip.y;
+	if (y0 >= y1)
+		return;
+
+	for (j = y0; j < y1; j++) {
+		const guchar *src = gdk_pixbuf_get_pixels (pixbuf) +
+			(stream->clip.y + j) * src_rowstride + stream->clip.x * n_channels;
+
+		if (!premultiply_row (image->pixels + j * image->rowstride, src,
+				      image->width, n_channels, stream->overall_alpha))
+			stream->opaque = FALSE;
+	}
+
+	/* Interlaced and progressive images come in several passes
+	 * over the whole image; only the first time a row arrives is
+	 * reported now, and everything once more at the end.
+	 */
+	if (y0 != stream->rows)
+		stream->revisited = TRUE;
+
+	if (y1 > stream->rows) {
+		int start = MAX (y0, stream->rows);
+
+		stream->rows = y1;
+		if (stream->rows_func)
+			stream->rows_func (image, start, y1 - start, stream->data);
+	}
+}
+
+/* Decode filename a piece at a time, at width x height if width
+ * isn't -1, keeping only the part in clip if clip isn't NULL. The
+ * file is read in chunks and each row is converted as soon as the
+ * loader has it, so reading, decoding and converting overlap, and
+ * rows_func, if not NULL, is called with the rows of the image that
+ * have just been filled in; the rest are transparent until then, and
+ * the image isn't marked opaque before it is complete.
+ */
+BGImage *
+bg_image_new_from_file (const char     *filename,
+			gint            width,
+			gint            height,
+			GdkRectangle   *clip,
+			gint            overall_alpha,
+			BGImageRowsFunc rows_func,
+			gpointer        data,
+			GError        **error)
+{
+	ImageStream stream = { 0 };
+	GdkPixbufFormat *format;
+	GdkPixbufLoader *loader = NULL;
+	guchar *buffer;
+	gssize n;
+	int fd;
+
+	fd = open (filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+			     "%s", g_strerror (errno));
+		return NULL;
+	}
+
+	/* Some formats can only be told apart by name */
+	format = gdk_pixbuf_get_file_info (filename, NULL, NULL);
+	if (format) {
+		gchar *name = gdk_pixbuf_format_get_name (format);
+		loader = gdk_pixbuf_loader_new_with_type (name, NULL);
+		g_free (name);
+	}
+	if (!loader)
+		loader = gdk_pixbuf_loader_new ();
+
+	stream.width = width;
+	stream.height = height;
+	if (clip) {
+		stream.clip = *clip;
+		stream.has_clip = TRUE;
+	}
+	stream.overall_alpha = overall_alpha;
+	stream.opaque = TRUE;
+	stream.rows_func = rows_func;
+	stream.data = data;
+
+	g_signal_connect (loader, "size-prepared", G_CALLBACK (stream_size_prepared), &stream);
+	g_signal_connect (loader, "area-prepared", G_CALLBACK (stream_area_prepared), &stream);
+	g_signal_connect (loader, "area-updated", G_CALLBACK (stream_area_updated), &stream);
+
+	buffer = g_malloc (IMAGE_STREAM_CHUNK);
+	while ((n = read (fd, buffer, IMAGE_STREAM_CHUNK)) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0) {
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+				     "%s", g_strerror (errno));
+			gdk_pixbuf_loader_close (loader, NULL);
+			goto fail;
+		}
+
+		if (!gdk_pixbuf_loader_write (loader, buffer, n, error)) {
+			gdk_pixbuf_loader_close (loader, NULL);
+			goto fail;
+		}
+	}
+
+	if (!gdk_pixbuf_loader_close (loader, error))
+		goto fail;
+
+	if (!stream.image) {
+		g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+			     "No image data");
+		goto fail;
+	}
+
+	g_free (buffer);
+	close (fd);
+	g_object_unref (loader);
+
+	stream.image->opaque = stream.opaque;
+	if (stream.revisited && rows_func)
+		rows_func (stream.image, 0, stream.image->height, data);
+
+	return stream.image;
+
+ fail:
+	g_free (buffer);
+	close (fd);
+	g_object_unref (loader);
+	bg_image_unref (stream.image);
+
+	return NULL;
+}
+
+BGImage *
+bg_image_ref (BGImage *image)
+{
+	g_atomic_int_inc (&image->ref_count);
+
+	return image;
+}
+
+void
+bg_image_unref (BGImage *image)
+{
+	GSList *tmp_list;
+
+	if (!image || !g_atomic_int_dec_and_test (&image->ref_count))
+		return;
+
+	for (tmp_list = image->scaled; tmp_list; tmp_list = tmp_list->next)
+		bg_image_unref (tmp_list->data);
+	g_slist_free (image->scaled);
+
+	for (tmp_list = image->blurred; tmp_list; tmp_list = tmp_list->next)
+		bg_image_unref (tmp_list->data);
+	g_slist_free (image->blurred);
+
+	bg_image_unref (image->half);
+	bg_image_unref (image->normals);
+	bg_image_unref (image->period);
+
+	if (image->mapping)
+		munmap (image->mapping, image->mapping_size);
+	else
+		free (image->pixels);
+	g_free (image);
+}
+
+/* Bytes of memory used by image, including its mip levels and
+ * scaled and blurred copies.
+ */
+gsize
+bg_image_get_memory (BGImage *image)
+{
+	gsize bytes = (gsize)image->rowstride * image->height;
+	GSList *tmp_list;
+
+	for (tmp_list = image->scaled; tmp_list; tmp_list = tmp_list->next)
+		bytes += bg_image_get_memory (tmp_list->data);
+
+	for (tmp_list = image->blurred; tmp_list; tmp_list = tmp_list->next)
+		bytes += bg_image_get_memory (tmp_list->data);
+
+	if (image->half)
+		bytes += bg_image_get_memory (image->half);
+
+	if (image->normals)
+		bytes += bg_image_get_memory (image->normals);
+
+	if (image->period)
+		bytes += bg_image_get_memory (image->period);
+
+	return bytes;
+}
+
+/* Free the mip levels and the scaled, blurred and other copies of
+ * image; they are made again when next needed.
+ */
+void
+bg_image_drop_caches (BGImage *image)
+{
+	GSList *scaled, *blurred, *tmp_list;
+	BGImage *half, *normals, *period;
+
+	g_mutex_lock (&cache_lock);
+	scaled = image->scaled;
+	blurred = image->blurred;
+	half = image->half;
+	normals = image->normals;
+	period = image->period;
+	image->scaled = NULL;
+	image->blurred = NULL;
+	image->half = NULL;
+	image->normals = NULL;
+	image->period = NULL;
+	g_mutex_unlock (&cache_lock);
+
+	for (tmp_list = scaled; tmp_list; tmp_list = tmp_list->next)
+		bg_image_unref (tmp_list->data);
+	g_slist_free (scaled);
+
+	for (tmp_list = blurred; tmp_list; tmp_list = tmp_list->next)
+		bg_image_unref (tmp_list->data);
+	g_slist_free (blurred);
+
+	bg_image_unref (half);
+	bg_image_unref (normals);
+	bg_image_unref (period);
+}
+
+/* Write the pixels of image to a new file in dir, which is unlinked
+ * straight away, for bg_image_page_out(). Returns the file descriptor,
+ * or -1. This only reads image, so it can be done in another thread
+ * while image is drawn from.
+ */
+gint
+bg_image_write_page_file (BGImage    *image,
+			  const char *dir,
+			  GError    **error)
+{
+	gsize size = (gsize)image->rowstride * image->height;
+	gsize done = 0;
+	char *filename;
+	int fd, saved_errno;
+
+	filename = g_build_filename (dir, "page-XXXXXX", NULL);
+	fd = g_mkstemp_full (filename, O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		saved_errno = errno;
+		goto error;
+	}
+	unlink (filename);
+
+	while (done < size) {
+		ssize_t n = write (fd, image->pixels + done, size - done);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			saved_errno = errno;
+			goto error;
+		}
+		/* Nothing written and no error set: the disk is full */
+		if (n == 0) {
+			saved_errno = ENOSPC;
+			goto error;
+		}
+		done += n;
+	}
+
+	g_free (filename);
+
+	return fd;
+
+ error:
+	g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+		     "%s: %s", filename, g_strerror (saved_errno));
+	if (fd >= 0)
+		close (fd);
+	g_free (filename);
+
+	return -1;
+}
+
+/* Let the pixels of image be dropped from memory: they are used from
+ * then on through a read-only mapping of fd, as written by
+ * bg_image_write_page_file(), so the kernel can drop them and read them
+ * back as they are next touched. fd is closed. An image that is
+ * already mapped only has its pages dropped, and fd may be -1 for it.
+ * No other thread may be using image meanwhile.
+ */
+gboolean
+bg_image_page_out (BGImage *image,
+		   gint     fd,
+		   GError **error)
+{
+	gsize size = (gsize)image->rowstride * image->height;
+	guchar *data;
+
+	if (image->mapping) {
+		if (fd >= 0)
+			close (fd);
+		madvise (image->mapping, image->mapping_size, MADV_DONTNEED);
+		return TRUE;
+	}
+
+	data = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+			     "Cannot map a page file: %s", g_strerror (errno));
+		close (fd);
+		return FALSE;
+	}
+	close (fd);
+
+	free (image->pixels);
+	image->pixels = data;
+	image->mapping = data;
+	image->mapping_size = size;
+
+	return TRUE;
+}
+
+static gboolean
+read_raw_header (int               fd,
+		 XsriBufferHeader *header)
+{
+	return (pread (fd, header, sizeof (*header), 0) == sizeof (*header) &&
+		header->magic == XSRI_BUFFER_MAGIC &&
+		header->format == XSRI_BUFFER_PREMULTIPLIED_RGBA);
+}
+
+/* Whether filename is a raw image, as written by bg_image_save_raw() */
+gboolean
+bg_image_file_is_raw (const char *filename)
+{
+	XsriBufferHeader header;
+	gboolean result;
+	int fd;
+
+	fd = open (filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return FALSE;
+
+	result = read_raw_header (fd, &header);
+	close (fd);
+
+	return result;
+}
+
+static void
+set_raw_error (GError    **error,
+	       const char *filename,
+	       const char *message)
+{
+	g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+		     "%s: %s", filename, message);
+}
+
+/* Load a raw image file. With an overall_alpha of 255 the pixels are
+ * used in place from a private read-only mapping of the file, so
+ * nothing is decoded or copied; otherwise they are copied once to
+ * multiply in the alpha.
+ */
+BGImage *
+bg_image_new_from_raw_file (const char *filename,
+			    gint        overall_alpha,
+			    GError    **error)
+{
+	XsriBufferHeader header;
+	struct stat st;
+	guchar *data;
+	BGImage *image;
+	int fd;
+	int i, j;
+
+	fd = open (filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+			     "%s: %s", filename, g_strerror (errno));
+		return NULL;
+	}
+
+	if (!read_raw_header (fd, &header) || header.version != XSRI_BUFFER_VERSION) {
+		close (fd);
+		set_raw_error (error, filename, "Not a raw image of a known version");
+		return NULL;
+	}
+
+	if (fstat (fd, &st) < 0 ||
+	    header.width == 0 || header.height == 0 ||
+	    header.width > G_MAXINT / 4 || header.height > G_MAXINT ||
+	    header.rowstride < header.width * 4 || header.rowstride % 16 != 0 ||
+	    header.pixel_offset < sizeof (header) || header.pixel_offset % 16 != 0 ||
+	    (guint64)header.pixel_offset + (guint64)header.rowstride * header.height > (guint64)st.st_size) {
+		close (fd);
+		set_raw_error (error, filename, "Invalid raw image header");
+		return NULL;
+	}
+
+	data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (data == MAP_FAILED) {
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+			     "%s: %s", filename, g_strerror (errno));
+		return NULL;
+	}
+
+	if (overall_alpha == 255) {
+		image = g_new0 (BGImage, 1);
+		image->ref_count = 1;
+		image->width = header.width;
+		image->height = header.height;
+		image->rowstride = header.rowstride;
+		image->opaque = (header.flags & XSRI_BUFFER_OPAQUE) != 0;
+		image->pixels = data + header.pixel_offset;
+		image->mapping = data;
+		image->mapping_size = st.st_size;
+
+		return image;
+	}
+
+	image = bg_image_alloc (header.width, header.height);
+	image->opaque = FALSE;
+
+	for (j = 0; j < image->height; j++) {
+		guchar *s = data + header.pixel_offset + (gsize)j * header.rowstride;
+		guchar *d = image->pixels + (gsize)j * image->rowstride;
+
+		for (i = 0; i < image->width * 4; i++)
+			d[i] = mul_un8 (s[i], overall_alpha);
+	}
+
+	munmap (data, st.st_size);
+
+	return image;
+}
+
+/* Write image in the raw format. The file is written under a unique
+ * temporary name and renamed into place, since another process may
+ * have the old one mapped, or be writing the same file.
+ */
+gboolean
+bg_image_save_raw (BGImage    *image,
+		   const char *filename,
+		   GError    **error)
+{
+	XsriBufferHeader header;
+	char *tmp_name;
+	FILE *f = NULL;
+	int fd;
+	int j;
+
+	memset (&header, 0, sizeof (header));
+	header.magic = XSRI_BUFFER_MAGIC;
+	header.version = XSRI_BUFFER_VERSION;
+	header.format = XSRI_BUFFER_PREMULTIPLIED_RGBA;
+	header.width = image->width;
+	header.height = image->height;
+	header.rowstride = image->rowstride;
+	header.pixel_offset = (sizeof (header) + 63) & ~63;
+	header.flags = image->opaque ? XSRI_BUFFER_OPAQUE : 0;
+
+	/* Unique, so that several processes can write the same file */
+	tmp_name = g_strconcat (filename, ".XXXXXX", NULL);
+
+	fd = g_mkstemp_full (tmp_name, O_WRONLY | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+			     "%s: %s", filename, g_strerror (errno));
+		g_free (tmp_name);
+		return FALSE;
+	}
+
+	f = fdopen (fd, "wb");
+	if (!f) {
+		close (fd);
+		goto error;
+	}
+
+	if (fwrite (&header, sizeof (header), 1, f) != 1 ||
+	    fseek (f, header.pixel_offset, SEEK_SET) < 0)
+		goto error;
+
+	for (j = 0; j < image->height; j++)
+		if (fwrite (image->pixels + (gsize)j * image->rowstride, image->rowstride, 1, f) != 1)
+			goto error;
+
+	if (fclose (f) != 0) {
+		f = NULL;
+		goto error;
+	}
+	f = NULL;
+
+	if (rename (tmp_name, filename) < 0)
+		goto error;
+
+	g_free (tmp_name);
+
+	return TRUE;
+
+ error:
+	g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+		     "%s: %s", filename, g_strerror (errno));
+	if (f)
+		fclose (f);
+	unlink (tmp_name);
+	g_free (tmp_name);
+
+	return FALSE;
+}
+
+/* One output row of a 2x2 box filter; src0 and src1 are the two
+ * source rows, which may be the same row at the bottom of an odd
+ * height image.
+ */
+static void
+downsample_row (guchar       *dest,
+		const guchar *src0,
+		const guchar *src1,
+		int           src_width,
+		int           dest_width)
+{
+	int i = 0;
+	int c;
+
+#ifdef __SSE2__
+	{
+		const __m128i zero = _mm_setzero_si128 ();
+		const __m128i two = _mm_set1_epi16 (2);
+
+		/* Two output pixels from four source pixels of each row */
+		for (; 2 * i + 4 <= src_width && i + 2 <= dest_width; i += 2) {
+			__m128i a = _mm_loadu_si128 ((const __m128i *)(src0 + 8 * i));
+			__m128i b = _mm_loadu_si128 ((const __m128i *)(src1 + 8 * i));
+			__m128i lo = _mm_add_epi16 (_mm_unpacklo_epi8 (a, zero),
+						    _mm_unpacklo_epi8 (b, zero));
+			__m128i hi = _mm_add_epi16 (_mm_unpackhi_epi8 (a, zero),
+						    _mm_unpackhi_epi8 (b, zero));
+			__m128i sum = _mm_add_epi16 (_mm_unpacklo_epi64 (lo, hi),
+						     _mm_unpackhi_epi64 (lo, hi));
+
+			sum = _mm_srli_epi16 (_mm_add_epi16 (sum, two), 2);
+			_mm_storel_epi64 ((__m128i *)(dest + 4 * i),
+					  _mm_packus_epi16 (sum, sum));
+		}
+	}
+#endif
+
+	for (; i < dest_width; i++) {
+		int x0 = 2 * i;
+		int x1 = MIN (x0 + 1, src_width - 1);
+
+		for (c = 0; c < 4; c++)
+			dest[4 * i + c] = (src0[4 * x0 + c] + src0[4 * x1 + c] +
+					   src1[4 * x0 + c] + src1[4 * x1 + c] + 2) >> 2;
+	}
+}
+
+/* Returns the next level of the mip pyramid for image, building it
+ * the first time it is needed.
+ */
+static BGImage *
+bg_image_get_half (BGImage *image)
+{
+	BGImage *half;
+	int j;
+
+	g_mutex_lock (&cache_lock);
+	half = image->half;
+	g_mutex_unlock (&cache_lock);
+
+	if (half)
+		return half;
+
+	half = bg_image_alloc ((image->width + 1) / 2, (image->height + 1) / 2);
+	half->opaque = image->opaque;
+
+	for (j = 0; j < half->height; j++) {
+		guchar *src0 = image->pixels + 2 * j * image->rowstride;
+		guchar *src1 = 2 * j + 1 < image->height ? src0 + image->rowstride : src0;
+
+		downsample_row (half->pixels + j * half->rowstride, src0, src1,
+				image->width, half->width);
+	}
+
+	/* Another thread may have got there first */
+	g_mutex_lock (&cache_lock);
+	if (image->half) {
+		bg_image_unref (half);
+		half = image->half;
+	} else {
+		image->half = half;
+	}
+	g_mutex_unlock (&cache_lock);
+
+	return half;
+}
+
+/* dest = src0 + (src1 - src0) * weight / 256 for n bytes */
+static void
+lerp_row (guchar       *dest,
+	  const guchar *src0,
+	  const guchar *src1,
+	  int           n,
+	  guint         weight)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	{
+		const __m128i zero = _mm_setzero_si128 ();
+		const __m128i w1 = _mm_set1_epi16 (weight);
+		const __m128i w0 = _mm_set1_epi16 (256 - weight);
+		const __m128i half = _mm_set1_epi16 (128);
+
+		/* The sum of the two products is at most 255 * 256, so
+		 * it fits in unsigned 16 bit lanes.
+		 */
+		for (; i + 16 <= n; i += 16) {
+			__m128i a = _mm_loadu_si128 ((const __m128i *)(src0 + i));
+			__m128i b = _mm_loadu_si128 ((const __m128i *)(src1 + i));
+			__m128i lo = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpacklo_epi8 (a, zero), w0),
+						    _mm_mullo_epi16 (_mm_unpacklo_epi8 (b, zero), w1));
+			__m128i hi = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpackhi_epi8 (a, zero), w0),
+						    _mm_mullo_epi16 (_mm_unpackhi_epi8 (b, zero), w1));
+
+			lo = _mm_srli_epi16 (_mm_add_epi16 (lo, half), 8);
+			hi = _mm_srli_epi16 (_mm_add_epi16 (hi, half), 8);
+			_mm_storeu_si128 ((__m128i *)(dest + i), _mm_packus_epi16 (lo, hi));
+		}
+	}
+#endif
+
+	for (; i < n; i++)
+		dest[i] = (src0[i] * (256 - weight) + src1[i] * weight + 128) >> 8;
+}
+
+/* Map destination pixel centers to a source coordinate in 24.8 fixed
+ * point, clamped to the source.
+ */
+static void
+compute_offsets (int *offsets, int dest_size, int src_size)
+{
+	int i;
+
+	for (i = 0; i < dest_size; i++) {
+		gint64 pos = (((gint64)(2 * i + 1) * src_size * 256) / (2 * dest_size)) - 128;
+
+		offsets[i] = CLAMP (pos, 0, (src_size - 1) * 256);
+	}
+}
+
+static void
+bilinear_scale (BGImage *dest, BGImage *src)
+{
+	int *x_offsets = g_new (int, dest->width);
+	int *y_offsets = g_new (int, dest->height);
+	guchar *row = g_malloc (src->rowstride);
+	int i, j, c;
+
+	compute_offsets (x_offsets, dest->width, src->width);
+	compute_offsets (y_offsets, dest->height, src->height);
+
+	for (j = 0; j < dest->height; j++) {
+		int y0 = y_offsets[j] >> 8;
+		int y1 = MIN (y0 + 1, src->height - 1);
+		guchar *d = dest->pixels + j * dest->rowstride;
+
+		lerp_row (row,
+			  src->pixels + y0 * src->rowstride,
+			  src->pixels + y1 * src->rowstride,
+			  src->width * 4, y_offsets[j] & 0xff);
+
+		for (i = 0; i < dest->width; i++) {
+			int x0 = x_offsets[i] >> 8;
+			int x1 = MIN (x0 + 1, src->width - 1);
+			guint w1 = x_offsets[i] & 0xff;
+			guint w0 = 256 - w1;
+
+			for (c = 0; c < 4; c++)
+				d[c] = (row[4 * x0 + c] * w0 + row[4 * x1 + c] * w1 + 128) >> 8;
+			d += 4;
+		}
+	}
+
+	g_free (row);
+	g_free (y_offsets);
+	g_free (x_offsets);
+}
+
+/* Returns a reference to a copy of image at the given size, or to
+ * image itself if it is already that size. We go down the mip
+ * pyramid to the smallest level that is still at least the requested
+ * size, then finish with a bilinear step, so we never reduce by more
+ * than a factor of two with the bilinear filter. Copies are cached on
+ * image, most recently used first.
+ */
+static BGImage *
+bg_image_get_scaled (BGImage *image, gint width, gint height)
+{
+	GSList *tmp_list;
+	BGImage *level;
+	BGImage *scaled;
+
+	if (width == image->width && height == image->height)
+		return bg_image_ref (image);
+
+	g_mutex_lock (&cache_lock);
+	for (tmp_list = image->scaled; tmp_list; tmp_list = tmp_list->next) {
+		scaled = tmp_list->data;
+
+		if (scaled->width == width && scaled->height == height) {
+			image->scaled = g_slist_remove_link (image->scaled, tmp_list);
+			image->scaled = g_slist_concat (tmp_list, image->scaled);
+			bg_image_ref (scaled);
+			g_mutex_unlock (&cache_lock);
+
+			return scaled;
+		}
+	}
+	g_mutex_unlock (&cache_lock);
+
+	level = image;
+	while (level->width > 1 && level->height > 1 &&
+	       (level->width + 1) / 2 >= width && (level->height + 1) / 2 >= height)
+		level = bg_image_get_half (level);
+
+	if (level->width == width && level->height == height)
+		return bg_image_ref (level);
+
+	scaled = bg_image_alloc (width, height);
+	scaled->opaque = image->opaque;
+	bilinear_scale (scaled, level);
+
+	g_mutex_lock (&cache_lock);
+
+	/* Another thread may have made the same copy meanwhile */
+	for (tmp_list = image->scaled; tmp_list; tmp_list = tmp_list->next) {
+		BGImage *other = tmp_list->data;
+
+		if (other->width == width && other->height == height) {
+			bg_image_unref (scaled);
+			scaled = bg_image_ref (other);
+			g_mutex_unlock (&cache_lock);
+
+			return scaled;
+		}
+	}
+
+	image->scaled = g_slist_prepend (image->scaled, bg_image_ref (scaled));
+
+	tmp_list = g_slist_nth (image->scaled, MAX_SCALED_IMAGES - 1);
+	if (tmp_list && tmp_list->next) {
+		bg_image_unref (tmp_list->next->data);
+		image->scaled = g_slist_delete_link (image->scaled, tmp_list->next);
+	}
+
+	g_mutex_unlock (&cache_lock);
+
+	return scaled;
+}
+
+/* Blurs are three passes of a box filter in each direction, which is
+ * close to a gaussian with a standard deviation of about the radius.
+ * Each box is a running sum, adding the pixel entering the window and
+ * subtracting the one leaving it, so the cost doesn't depend on the
+ * radius. Premultiplied pixels can be averaged directly.
+ */
+#define BLUR_PASSES 3
+
+/* Rows or columns per thread below which it isn't worth another one */
+#define BLUR_BAND_SIZE 64
+
+/* Bands of one run_blur_bands() call still being worked on */
+typedef struct {
+	GThreadFunc func;
+	GMutex      lock;
+	GCond       cond;
+	int         pending;
+} BlurRun;
+
+typedef struct {
+	BGImage  *src;
+	BGImage  *tmp;
+	BGImage  *dest;
+	int       radius;
+	gboolean  wrap;
+	int       start;	/* rows for the horizontal passes, */
+	int       end;		/* columns for the vertical ones */
+	BlurRun  *run;
+} BlurBand;
+
+/* Which of n pixels to use for position i, repeating them outside
+ * [0, n) if wrap, otherwise repeating the one at the edge.
+ */
+static inline int
+blur_index (int i, int n, gboolean wrap)
+{
+	if (i >= 0 && i < n)
+		return i;
+
+	if (wrap) {
+		i %= n;
+		return i < 0 ? i + n : i;
+	}
+
+	return i < 0 ? 0 : n - 1;
+}
+
+#ifdef __SSE2__
+static inline __m128i
+blur_load (const guchar *p)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	__m128i v = _mm_cvtsi32_si128 (*(const guint32 *)p);
+
+	return _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (v, zero), zero);
+}
+
+static inline void
+blur_store (guchar *p, __m128i sum, __m128 scale)
+{
+	__m128i v = _mm_cvttps_epi32 (_mm_add_ps (_mm_mul_ps (_mm_cvtepi32_ps (sum), scale),
+						  _mm_set1_ps (0.5f)));
+
+	v = _mm_packs_epi32 (v, v);
+	*(guint32 *)p = _mm_cvtsi128_si32 (_mm_packus_epi16 (v, v));
+}
+#endif
+
+/* One pass over a line of n pixels; dest and src must not overlap */
+static void
+box_blur_line (guchar       *dest,
+	       const guchar *src,
+	       int           n,
+	       int           radius,
+	       gboolean      wrap)
+{
+	float scale = 1.f / (2 * radius + 1);
+	int i;
+
+#ifdef __SSE2__
+	__m128 scale4 = _mm_set1_ps (scale);
+	__m128i sum = _mm_setzero_si128 ();
+
+	for (i = -radius; i <= radius; i++)
+		sum = _mm_add_epi32 (sum, blur_load (src + 4 * blur_index (i, n, wrap)));
+
+	for (i = 0; i < n; i++) {
+		blur_store (dest + 4 * i, sum, scale4);
+		sum = _mm_add_epi32 (sum, blur_load (src + 4 * blur_index (i + radius + 1, n, wrap)));
+		sum = _mm_sub_epi32 (sum, blur_load (src + 4 * blur_index (i - radius, n, wrap)));
+	}
+#else
+	int sum[4] = { 0, 0, 0, 0 };
+	int c;
+
+	for (i = -radius; i <= radius; i++)
+		for (c = 0; c < 4; c++)
+			sum[c] += src[4 * blur_index (i, n, wrap) + c];
+
+	for (i = 0; i < n; i++) {
+		const guchar *in = src + 4 * blur_index (i + radius + 1, n, wrap);
+		const guchar *out = src + 4 * blur_index (i - radius, n, wrap);
+
+		for (c = 0; c < 4; c++) {
+			dest[4 * i + c] = (int)(sum[c] * scale + 0.5f);
+			sum[c] += in[c] - out[c];
+		}
+	}
+#endif
+}
+
+/* One pass down columns start to end. This keeps a running sum for
+ * each column and walks the rows, so memory is read a row at a time.
+ */
+static void
+box_blur_columns (BGImage *dest,
+		  BGImage *src,
+		  int      start,
+		  int      end,
+		  int      radius,
+		  gboolean wrap,
+		  gint32  *sums)
+{
+	float scale = 1.f / (2 * radius + 1);
+	int n = src->height;
+	int i, j, c;
+
+	memset (sums, 0, sizeof (gint32) * 4 * (end - start));
+
+	for (j = -radius; j <= radius; j++) {
+		const guchar *s = src->pixels + blur_index (j, n, wrap) * src->rowstride;
+
+		for (i = start; i < end; i++)
+			for (c = 0; c < 4; c++)
+				sums[4 * (i - start) + c] += s[4 * i + c];
+	}
+
+	for (j = 0; j < n; j++) {
+		guchar *d = dest->pixels + j * dest->rowstride;
+		const guchar *in = src->pixels + blur_index (j + radius + 1, n, wrap) * src->rowstride;
+		const guchar *out = src->pixels + blur_index (j - radius, n, wrap) * src->rowstride;
+		gint32 *sum = sums;
+
+		i = start;
+
+#ifdef __SSE2__
+		{
+			__m128 scale4 = _mm_set1_ps (scale);
+
+			for (; i < end; i++) {
+				__m128i v = _mm_loadu_si128 ((__m128i *)sum);
+
+				blur_store (d + 4 * i, v, scale4);
+				v = _mm_add_epi32 (v, blur_load (in + 4 * i));
+				v = _mm_sub_epi32 (v, blur_load (out + 4 * i));
+				_mm_storeu_si128 ((__m128i *)sum, v);
+				sum += 4;
+			}
+		}
+#endif
+
+		for (; i < end; i++) {
+			for (c = 0; c < 4; c++) {
+				d[4 * i + c] = (int)(sum[c] * scale + 0.5f);
+				sum[c] += in[4 * i + c] - out[4 * i + c];
+			}
+			sum += 4;
+		}
+	}
+}
+
+/* All the horizontal passes for rows start to end, from src into tmp */
+static gpointer
+blur_rows_band (gpointer data)
+{
+	BlurBand *band = data;
+	int width = band->src->width;
+	guchar *line0 = g_malloc (4 * width);
+	guchar *line1 = g_malloc (4 * width);
+	int j;
+
+	for (j = band->start; j < band->end; j++) {
+		box_blur_line (line0, band->src->pixels + j * band->src->rowstride,
+			       width, band->radius, band->wrap);
+		box_blur_line (line1, line0, width, band->radius, band->wrap);
+		box_blur_line (band->tmp->pixels + j * band->tmp->rowstride, line1,
+			       width, band->radius, band->wrap);
+	}
+
+	g_free (line1);
+	g_free (line0);
+
+	return NULL;
+}
+
+/* All the vertical passes for columns start to end, from tmp into
+ * dest, using both as scratch; other bands only touch other columns.
+ */
+static gpointer
+blur_columns_band (gpointer data)
+{
+	BlurBand *band = data;
+	gint32 *sums = g_new (gint32, 4 * (band->end - band->start));
+
+	box_blur_columns (band->dest, band->tmp, band->start, band->end,
+			  band->radius, band->wrap, sums);
+	box_blur_columns (band->tmp, band->dest, band->start, band->end,
+			  band->radius, band->wrap, sums);
+	box_blur_columns (band->dest, band->tmp, band->start, band->end,
+			  band->radius, band->wrap, sums);
+
+	g_free (sums);
+
+	return NULL;
+}
+
+/* Called in a thread of the blur pool */
+static void
+run_pooled_band (gpointer data,
+		 gpointer user_data)
+{
+	BlurBand *band = data;
+	BlurRun *run = band->run;
+
+	run->func (band);
+
+	g_mutex_lock (&run->lock);
+	if (--run->pending == 0)
+		g_cond_signal (&run->cond);
+	g_mutex_unlock (&run->lock);
+}
+
+/* The threads blurs are spread over, one fewer than the processors,
+ * since the thread asking for a blur does a band itself. They are
+ * kept for the next blur rather than started for each one.
+ */
+static GThreadPool *
+get_blur_pool (void)
+{
+	static GThreadPool *pool = NULL;
+
+	if (g_once_init_enter (&pool)) {
+		int n_threads = CLAMP (sysconf (_SC_NPROCESSORS_ONLN) - 1, 1, 63);
+
+		g_once_init_leave (&pool, g_thread_pool_new (run_pooled_band, NULL,
+							    n_threads, FALSE, NULL));
+	}
+
+	return pool;
+}
+
+/* Split lines 0 to n_lines among up to n_bands bands and run func on
+ * each, the first on this thread and the rest in the blur pool.
+ */
+static void
+run_blur_bands (BlurBand *bands,
+		int       n_bands,
+		int       n_lines,
+		GThreadFunc func)
+{
+	BlurRun run;
+	int i;
+
+	n_bands = CLAMP (n_lines / BLUR_BAND_SIZE, 1, n_bands);
+
+	for (i = 0; i < n_bands; i++) {
+		bands[i].start = (gint64)n_lines * i / n_bands;
+		bands[i].end = (gint64)n_lines * (i + 1) / n_bands;
+		bands[i].run = &run;
+	}
+
+	if (n_bands == 1) {
+		func (&bands[0]);
+		return;
+	}
+
+	run.func = func;
+	run.pending = n_bands - 1;
+	g_mutex_init (&run.lock);
+	g_cond_init (&run.cond);
+
+	for (i = 1; i < n_bands; i++)
+		g_thread_pool_push (get_blur_pool (), &bands[i], NULL);
+
+	func (&bands[0]);
+
+	g_mutex_lock (&run.lock);
+	while (run.pending > 0)
+		g_cond_wait (&run.cond, &run.lock);
+	g_mutex_unlock (&run.lock);
+
+	g_mutex_clear (&run.lock);
+	g_cond_clear (&run.cond);
+}
+
+/* Returns a new copy of image blurred by radius. Pixels outside the
+ * image are taken from the opposite edge if wrap, as for a tile, and
+ * otherwise from the nearest edge. The work is split among as many
+ * threads as context allows.
+ */
+static BGImage *
+blur_image (BGRenderContext *context, BGImage *image, int radius, gboolean wrap)
+{
+	BGImage *tmp = bg_image_alloc (image->width, image->height);
+	BGImage *dest = bg_image_alloc (image->width, image->height);
+	int n_bands = CLAMP (sysconf (_SC_NPROCESSORS_ONLN), 1, 64);
+	BlurBand *bands;
+	int i;
+
+	if (context->max_threads > 0)
+		n_bands = MIN (n_bands, context->max_threads);
+	bands = g_new (BlurBand, n_bands);
+
+	dest->opaque = image->opaque;
+
+	for (i = 0; i < n_bands; i++) {
+		bands[i].src = image;
+		bands[i].tmp = tmp;
+		bands[i].dest = dest;
+		bands[i].radius = radius;
+		bands[i].wrap = wrap;
+	}
+
+	run_blur_bands (bands, n_bands, image->height, blur_rows_band);
+	run_blur_bands (bands, n_bands, image->width, blur_columns_band);
+
+	g_free (bands);
+	bg_image_unref (tmp);
+
+	return dest;
+}
+
+/* Returns a reference to image blurred by radius, as blur_image()
+ * does. Copies are cached on image, most recently used first.
+ */
+static BGImage *
+bg_image_get_blurred (BGRenderContext *context, BGImage *image, gint radius, gboolean wrap)
+{
+	gint key = 2 * radius + (wrap ? 1 : 0);
+	GSList *tmp_list;
+	BGImage *blurred;
+
+	g_mutex_lock (&cache_lock);
+	for (tmp_list = image->blurred; tmp_list; tmp_list = tmp_list->next) {
+		blurred = tmp_list->data;
+
+		if (blurred->blur_key == key) {
+			image->blurred = g_slist_remove_link (image->blurred, tmp_list);
+			image->blurred = g_slist_concat (tmp_list, image->blurred);
+			bg_image_ref (blurred);
+			g_mutex_unlock (&cache_lock);
+
+			return blurred;
+		}
+	}
+	g_mutex_unlock (&cache_lock);
+
+	blurred = blur_image (context, image, radius, wrap);
+	blurred->blur_key = key;
+
+	g_mutex_lock (&cache_lock);
+
+	/* Another thread may have made the same copy meanwhile */
+	for (tmp_list = image->blurred; tmp_list; tmp_list = tmp_list->next) {
+		BGImage *other = tmp_list->data;
+
+		if (other->blur_key == key) {
+			bg_image_unref (blurred);
+			blurred = bg_image_ref (other);
+			g_mutex_unlock (&cache_lock);
+
+			return blurred;
+		}
+	}
+
+	image->blurred = g_slist_prepend (image->blurred, bg_image_ref (blurred));
+
+	tmp_list = g_slist_nth (image->blurred, MAX_BLURRED_IMAGES - 1);
+	if (tmp_list && tmp_list->next) {
+		bg_image_unref (tmp_list->next->data);
+		image->blurred = g_slist_delete_link (image->blurred, tmp_list->next);
+	}
+
+	g_mutex_unlock (&cache_lock);
+
+	return blurred;
+}
+
+/* Returns a reference to image as it is drawn: at width by height,
+ * then blurred by radius if that isn't 0.
+ */
+static BGImage *
+get_layer_image (BGRenderContext *context,
+		 BGImage         *image,
+		 gint             width,
+		 gint             height,
+		 gint             radius,
+		 gboolean         wrap)
+{
+	BGImage *scaled = bg_image_get_scaled (image, width, height);
+	BGImage *blurred;
+
+	if (radius <= 0)
+		return scaled;
+
+	blurred = bg_image_get_blurred (context, scaled, radius, wrap);
+	bg_image_unref (scaled);
+
+	return blurred;
+}
+
+/* Size of the tile of state after rotation, and of the period it
+ * repeats with after tile_mode is applied.
+ */
 static void
-fill_gradient (GdkPixbuf *pixbuf,
-	       GdkColor  *c1,
-	       GdkColor  *c2,
-	       int        vertical,
-	       int        gradient_width,
-	       int        gradient_height,
-	       int        pixbuf_x,
-	       int        pixbuf_y)
+get_tile_period_size (BGState *state,
+		      int     *tile_width,
+		      int     *tile_height,
+		      int     *period_width,
+		      int     *period_height)
+{
+	gboolean turned = state->tile_rotation % 180 != 0;
+
+	*tile_width = turned ? state->tile_height : state->tile_width;
+	*tile_height = turned ? state->tile_width : state->tile_height;
+	*period_width = *tile_width;
+	*period_height = *tile_height;
+
+	if (state->tile_mode == BG_TILE_MIRROR || state->tile_mode == BG_TILE_MIRROR_X)
+		*period_width *= 2;
+	if (state->tile_mode == BG_TILE_MIRROR || state->tile_mode == BG_TILE_MIRROR_Y ||
+	    state->tile_mode == BG_TILE_BRICK)
+		*period_height *= 2;
+}
+
+/* Lay out copies of tile, rotated clockwise by rotation degrees, as
+ * one period of state's tile mode.
+ */
+static BGImage *
+build_tile_period (BGState *state,
+		   BGImage *tile)
 {
+	int rotation = state->tile_rotation;
+	gboolean mirror_x = state->tile_mode == BG_TILE_MIRROR || state->tile_mode == BG_TILE_MIRROR_X;
+	gboolean mirror_y = state->tile_mode == BG_TILE_MIRROR || state->tile_mode == BG_TILE_MIRROR_Y;
+	gboolean brick = state->tile_mode == BG_TILE_BRICK;
+	int w, h, period_width, period_height;
+	BGImage *period;
 	int i, j;
-	int dr, dg, db;
-	int gs1;
-	int vc = (!vertical || (c1 == c2));
+
+	get_tile_period_size (state, &w, &h, &period_width, &period_height);
+	period = bg_image_alloc (period_width, period_height);
+	period->opaque = tile->opaque;
+
+	for (j = 0; j < period_height; j++) {
+		guint32 *dest = (guint32 *)(period->pixels + j * period->rowstride);
+		int y = j % h;
+
+		if (mirror_y && j >= h)
+			y = h - 1 - y;
+
+		for (i = 0; i < period_width; i++) {
+			int x = i % w;
+			int sx, sy;
+
+			/* Every other row of bricks is moved along half a tile */
+			if (brick && j >= h)
+				x = (i + w / 2) % w;
+			if (mirror_x && i >= w)
+				x = w - 1 - x;
+
+			switch (rotation) {
+			case 90:
+				sx = y;
+				sy = tile->height - 1 - x;
+				break;
+			case 180:
+				sx = tile->width - 1 - x;
+				sy = tile->height - 1 - y;
+				break;
+			case 270:
+				sx = tile->width - 1 - y;
+				sy = x;
+				break;
+			default:
+				sx = x;
+				sy = y;
+				break;
+			}
+
+			dest[i] = *(guint32 *)(tile->pixels + sy * tile->rowstride + 4 * sx);
+		}
+	}
+
+	return period;
+}
+
+/* Returns a reference to the repeating unit of state's tile as it is
+ * drawn: scaled, then turned and laid out for the tile mode once and
+ * kept with the scaled image, then blurred, wrapping around at the
+ * edges of the whole period rather than of each tile.
+ */
+static BGImage *
+get_tile_period (BGRenderContext *context,
+		 BGState         *state)
+{
+	BGImage *scaled = bg_image_get_scaled (state->tile_image, state->tile_width, state->tile_height);
+	BGImage *period = NULL;
+	BGImage *blurred;
+	int key = state->tile_mode * 360 + state->tile_rotation;
+
+	if (key == 0) {
+		period = scaled;
+	} else {
+		g_mutex_lock (&cache_lock);
+		if (scaled->period && scaled->period_key == key)
+			period = bg_image_ref (scaled->period);
+		g_mutex_unlock (&cache_lock);
+
+		if (!period) {
+			period = build_tile_period (state, scaled);
+
+			g_mutex_lock (&cache_lock);
+			bg_image_unref (scaled->period);
+			scaled->period = bg_image_ref (period);
+			scaled->period_key = key;
+			g_mutex_unlock (&cache_lock);
+		}
+
+		bg_image_unref (scaled);
+	}
+
+	if (state->tile_blur <= 0)
+		return period;
+
+	blurred = bg_image_get_blurred (context, period, state->tile_blur, TRUE);
+	bg_image_unref (period);
+
+	return blurred;
+}
+
+/* Gradients are evaluated through a table of colors, indexed by
+ * offset along the gradient for linear ones and by the square of the
+ * distance from the center for radial ones, so that there is no square
+ * root per pixel. Both are the sum of a term depending only on the
+ * column and one depending only on the row; the column terms are
+ * computed once per fill, leaving an add, a clamp and a lookup per
+ * pixel. Offsets are in 1/256ths of a table entry.
+ */
+#define LINEAR_LUT_SIZE 4096
+#define RADIAL_LUT_SIZE 65536
+#define GRADIENT_SHIFT  8
+
+static void
+fill_solid (GdkPixbuf *pixbuf,
+	    GdkColor  *color)
+{
 	int w = gdk_pixbuf_get_width (pixbuf);
 	int h = gdk_pixbuf_get_height (pixbuf);
-	guchar *b, *row;
-	guchar *d = gdk_pixbuf_get_pixels (pixbuf);
 	int rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+	guchar *pixels = gdk_pixbuf_get_pixels (pixbuf);
+	guchar *b = pixels;
+	int i, j;
 
-#define R1 c1->red
-#define G1 c1->green
-#define B1 c1->blue
-#define R2 c2->red
-#define G2 c2->green
-#define B2 c2->blue
-
-	dr = R2 - R1;
-	dg = G2 - G1;
-	db = B2 - B1;
-
-	gs1 = (vertical) ? gradient_height-1 : gradient_width-1;
-
-	row = g_new (unsigned char, rowstride);
-
-	if (vc) {
-		b = row;
-		for (j = 0; j < w; j++) {
-			*b++ = (R1 + ((j + pixbuf_x) * dr) / gs1) >> 8;
-			*b++ = (G1 + ((j + pixbuf_x) * dg) / gs1) >> 8;
-			*b++ = (B1 + ((j + pixbuf_x) * db) / gs1) >> 8;
-		}
-	}
-
-	for (i = 0; i < h; i++) {
-		if (!vc) {
-			unsigned char cr, cg, cb;
-			cr = (R1 + ((i + pixbuf_y) * dr) / gs1) >> 8;
-			cg = (G1 + ((i + pixbuf_y) * dg) / gs1) >> 8;
-			cb = (B1 + ((i + pixbuf_y) * db) / gs1) >> 8;
-			b = row;
-			for (j = 0; j < w; j++) {
-				*b++ = cr;
-				*b++ = cg;
-				*b++ = cb;
-			}
+	for (i = 0; i < w; i++) {
+		*b++ = color->red >> 8;
+		*b++ = color->green >> 8;
+		*b++ = color->blue >> 8;
+	}
+
+	for (j = 1; j < h; j++)
+		memcpy (pixels + j * rowstride, pixels, w * 3);
+}
+
+/* The stops of state's gradient; two for the --color/--color2 form */
+static int
+get_gradient_stops (BGState         *state,
+		    BGGradientStop **stops,
+		    BGGradientStop  *two_stops)
+{
+	if (state->n_stops >= 2) {
+		*stops = state->stops;
+		return state->n_stops;
+	}
+
+	two_stops[0].color = state->bgColor1;
+	two_stops[0].offset = 0.0;
+	two_stops[1].color = state->bgColor2;
+	two_stops[1].offset = 1.0;
+	*stops = two_stops;
+
+	return 2;
+}
+
+/* Fill lut with the colors of the gradient, 0x00RRGGBB, at offsets
+ * i / (size - 1), or the square root of that if radial.
+ */
+static void
+make_gradient_lut (guint32        *lut,
+		   int             size,
+		   gboolean        radial,
+		   BGGradientStop *stops,
+		   int             n_stops)
+{
+	int stop = 0;
+	int i;
+
+	for (i = 0; i < size; i++) {
+		double t = (double)i / (size - 1);
+		BGGradientStop *s0, *s1;
+		double f;
+		guint r, g, b;
+
+		if (radial)
+			t = sqrt (t);
+
+		while (stop < n_stops - 1 && stops[stop + 1].offset <= t)
+			stop++;
+
+		s0 = &stops[stop];
+		s1 = &stops[MIN (stop + 1, n_stops - 1)];
+
+		if (t <= s0->offset || s1->offset <= s0->offset)
+			f = t <= s0->offset ? 0.0 : 1.0;
+		else
+			f = MIN ((t - s0->offset) / (s1->offset - s0->offset), 1.0);
+
+		r = (s0->color.red + f * (s1->color.red - s0->color.red)) + 0.5;
+		g = (s0->color.green + f * (s1->color.green - s0->color.green)) + 0.5;
+		b = (s0->color.blue + f * (s1->color.blue - s0->color.blue)) + 0.5;
+
+		lut[i] = ((r >> 8) << 16) | ((g >> 8) << 8) | (b >> 8);
+	}
+}
+
+/* dest[i] = lut[CLAMP ((offsets[i] + base) >> GRADIENT_SHIFT, 0, max_index)],
+ * as packed RGB
+ */
+static void
+gradient_row (guchar        *dest,
+	      const gint32  *offsets,
+	      gint32         base,
+	      const guint32 *lut,
+	      gint32         max_index,
+	      int            n)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	{
+		__m128i vbase = _mm_set1_epi32 (base);
+		__m128i vmax = _mm_set1_epi32 (max_index);
+		__m128i zero = _mm_setzero_si128 ();
+		gint32 index[4] __attribute__ ((aligned (16)));
+
+		for (; i + 4 <= n; i += 4) {
+			__m128i v = _mm_loadu_si128 ((const __m128i *)(offsets + i));
+			__m128i over;
+
+			v = _mm_srai_epi32 (_mm_add_epi32 (v, vbase), GRADIENT_SHIFT);
+			v = _mm_and_si128 (v, _mm_cmpgt_epi32 (v, zero));
+			over = _mm_cmpgt_epi32 (v, vmax);
+			v = _mm_or_si128 (_mm_and_si128 (over, vmax), _mm_andnot_si128 (over, v));
+			_mm_store_si128 ((__m128i *)index, v);
+
+			dest[0] = lut[index[0]] >> 16;
+			dest[1] = lut[index[0]] >> 8;
+			dest[2] = lut[index[0]];
+			dest[3] = lut[index[1]] >> 16;
+			dest[4] = lut[index[1]] >> 8;
+			dest[5] = lut[index[1]];
+			dest[6] = lut[index[2]] >> 16;
+			dest[7] = lut[index[2]] >> 8;
+			dest[8] = lut[index[2]];
+			dest[9] = lut[index[3]] >> 16;
+			dest[10] = lut[index[3]] >> 8;
+			dest[11] = lut[index[3]];
+			dest += 12;
 		}
-		memcpy (d, row, w * 3);
-		d += rowstride;
 	}
+#endif
 
-#undef R1
-#undef G1
-#undef B1
-#undef R2
-#undef G2
-#undef B2
+	for (; i < n; i++) {
+		gint32 index = (offsets[i] + base) >> GRADIENT_SHIFT;
+		guint32 color = lut[CLAMP (index, 0, max_index)];
 
-	g_free (row);
+		*dest++ = color >> 16;
+		*dest++ = color >> 8;
+		*dest++ = color;
+	}
+}
+
+/* Fill pixbuf with the part of state's gradient starting at pixbuf_x,
+ * pixbuf_y. The gradient covers state->width x state->height, with
+ * the first and last stops at its edges, or for linear gradients at
+ * the corners on the gradient line, as in CSS.
+ */
+static void
+fill_gradient (BGRenderContext *context,
+	       GdkPixbuf       *pixbuf,
+	       BGState         *state,
+	       int              pixbuf_x,
+	       int              pixbuf_y)
+{
+	BGGradientStop two_stops[2];
+	BGGradientStop *stops;
+	int n_stops;
+	int w = gdk_pixbuf_get_width (pixbuf);
+	int h = gdk_pixbuf_get_height (pixbuf);
+	guchar *pixels = gdk_pixbuf_get_pixels (pixbuf);
+	int rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+	gboolean radial = state->gradient_type != BG_GRADIENT_LINEAR;
+	int lut_size = radial ? RADIAL_LUT_SIZE : LINEAR_LUT_SIZE;
+	double scale = (double)(lut_size - 1) * (1 << GRADIENT_SHIFT);
+	double cx = (state->width - 1) / 2.;
+	double cy = (state->height - 1) / 2.;
+	guint32 *lut;
+	gint32 *offsets;
+	int i, j;
+
+	n_stops = get_gradient_stops (state, &stops, two_stops);
+
+	lut = context_get_scratch (context, SCRATCH_LUT, lut_size * sizeof (guint32));
+	make_gradient_lut (lut, lut_size, radial, stops, n_stops);
+
+	offsets = context_get_scratch (context, SCRATCH_OFFSETS, MAX (w, 1) * sizeof (gint32));
+
+	if (radial) {
+		double rx, ry;
+
+		if (state->gradient_type == BG_GRADIENT_CIRCLE) {
+			rx = ry = sqrt (cx * cx + cy * cy);
+		} else {
+			rx = cx * G_SQRT2;
+			ry = cy * G_SQRT2;
+		}
+		rx = MAX (rx, 0.5);
+		ry = MAX (ry, 0.5);
+
+		for (i = 0; i < w; i++) {
+			double dx = (pixbuf_x + i - cx) / rx;
+			offsets[i] = dx * dx * scale + 0.5;
+		}
+
+		for (j = 0; j < h; j++) {
+			double dy = (pixbuf_y + j - cy) / ry;
+			
+			gradient_row (pixels + j * rowstride, offsets, dy * dy * scale + 0.5,
+				      lut, lut_size - 1, w);
+		}
+	} else {
+		double angle = state->angle * G_PI / 180.;
+		double sin_a = sin (angle);
+		double cos_a = -cos (angle);
+		double length, row_start, row_step;
+		gboolean rows_equal;
+
+		/* Snap the common cases, so that rows or columns come
+		 * out exactly the same
+		 */
+		if (fabs (sin_a) < 1e-9)
+			sin_a = 0;
+		if (fabs (cos_a) < 1e-9)
+			cos_a = 0;
+
+		length = fabs ((state->width - 1) * sin_a) + fabs ((state->height - 1) * cos_a);
+		length = MAX (length, 1.0);
+
+		for (i = 0; i < w; i++)
+			offsets[i] = floor ((pixbuf_x + i - cx) * sin_a / length * scale + 0.5);
+
+		rows_equal = cos_a == 0;
+		row_step = cos_a / length * scale;
+		row_start = (0.5 + (pixbuf_y - cy) * cos_a / length) * scale + (1 << (GRADIENT_SHIFT - 1));
+
+		for (j = 0; j < h; j++) {
+			if (rows_equal && j > 0) {
+				memcpy (pixels + j * rowstride, pixels, w * 3);
+				continue;
+			}
+
+			gradient_row (pixels + j * rowstride, offsets, floor (row_start + j * row_step),
+				      lut, lut_size - 1, w);
+		}
+	}
 }
 
 #define RMAX  (3*1024)
 #define RMAX2 (RMAX*RMAX) 
 
-static guchar
-shade_pixel (guchar pixel, double shade)
-{
-  if (shade > 0)
-    {
-      int tmp = shade * pixel * sqrt(3);
-      return MIN (tmp, 255);
-    }
-  else
-    return 0;
+/* Normals are packed in 32 bits, x and y as signed 11 bit numbers
+ * and z as an unsigned 10 bit one, each scaled by NORMAL_SCALE.
+ */
+#define NORMAL_SCALE 1023
+#define PACK_NORMAL(x, y, z) (((guint32)(x) & 0x7ff) | (((guint32)(y) & 0x7ff) << 11) | ((guint32)(z) << 22))
+#define NORMAL_X(n) (((gint32)((n) << 21)) >> 21)
+#define NORMAL_Y(n) (((gint32)((n) << 10)) >> 21)
+#define NORMAL_Z(n) ((gint32)((n) >> 22))
+
+/* Shading is in fixed point, 1 << SHADE_SHIFT leaving a pixel as it is */
+#define SHADE_SHIFT 20
+
+/* The surface normals of boss, seen as a height map with its gray
+ * level, as composited onto white, for the height, and its slopes
+ * multiplied by depth. The result is a BGImage of packed normals,
+ * flat around the edges.
+ */
+static BGImage *
+compute_normals (BGImage *boss, double depth)
+{
+  int boss_width = boss->width;
+  int boss_height = boss->height;
+  BGImage *normals = bg_image_alloc (boss_width, boss_height);
+  gushort *boss_gray = g_new (gushort, boss_width * MAX (boss_height, 1));
+  int i,j;
+
+  for (j=0; j<boss_height; j++)
+    {
+      guchar *pixels = boss->pixels + j * boss->rowstride;
+      gushort *line = boss_gray + boss_width * j;
+
+      for (i=0; i<boss_width; i++)
+        {
+          line[i] = pixels[0] + pixels[1] + pixels[2] + 3 * (0xff - pixels[3]);
+	  pixels += 4;    
+	}
+    }
+
+  for (j=0; j<boss_height; j++)
+    {
+      guint32 *n = (guint32 *)(normals->pixels + j * normals->rowstride);
+
+      for (i=0; i<boss_width; i++)
+	{
+	  /* Up to 765 * 100 for the deepest emboss, whose square
+	   * doesn't fit in an int
+	   */
+	  gint64 dx, dy, dz, t;
+
+	  if (i == 0 || j == 0 || i == boss_width - 1 || j == boss_height - 1)
+	    {
+	      n[i] = PACK_NORMAL (0, 0, NORMAL_SCALE);
+	      continue;
+	    }
+
+	  dx = depth * (*(boss_gray + boss_width * j +       i + 1) -
+			*(boss_gray + boss_width * j +       i - 1));
+	  dy = depth * (*(boss_gray + boss_width * (j - 1) + i) -
+			*(boss_gray + boss_width * (j + 1) + i));
+	  t = dx*dx + dy*dy;
+
+	  if (t > RMAX2)
+	    {
+	      double sqrt_t = sqrt(t);
+
+	      dz = 0;
+	      dx = RMAX * dx / sqrt_t;
+	      dy = RMAX * dy / sqrt_t;
+	    }
+	  else
+	    {
+	      dz = sqrt (RMAX2 - t);
+	    }
+
+	  n[i] = PACK_NORMAL (dx * NORMAL_SCALE / RMAX,
+			      dy * NORMAL_SCALE / RMAX,
+			      dz * NORMAL_SCALE / RMAX);
+	}
+    }
+
+  g_free (boss_gray);
+
+  return normals;
+}
+
+/* The normal map of boss at depth, computed the first time it is
+ * needed and kept with the image, so that embossing again, with the
+ * same or a different light, only has to shade.
+ */
+static BGImage *
+get_normals (BGImage *boss, double depth)
+{
+  BGImage *normals = NULL;
+
+  g_mutex_lock (&cache_lock);
+  if (boss->normals && boss->normals_depth == depth)
+    normals = bg_image_ref (boss->normals);
+  g_mutex_unlock (&cache_lock);
+
+  if (normals)
+    return normals;
+
+  normals = compute_normals (boss, depth);
+
+  g_mutex_lock (&cache_lock);
+  bg_image_unref (boss->normals);
+  boss->normals = bg_image_ref (normals);
+  boss->normals_depth = depth;
+  g_mutex_unlock (&cache_lock);
+
+  return normals;
 }
 
+/* Shade the part of image under boss, at x_offset, y_offset in it,
+ * as lit from light_angle degrees clockwise from up, light_elevation
+ * degrees above the screen. Flat parts are left as they are.
+ */
 static void
-emboss (GdkPixbuf *image, GdkPixbuf *boss, int x_offset, int y_offset)
+emboss (GdkPixbuf *image, BGImage *boss, int x_offset, int y_offset,
+	double light_angle, double light_elevation, double depth)
 {
   int image_width = gdk_pixbuf_get_width (image);
   int image_height = gdk_pixbuf_get_height (image);
-  int boss_width = gdk_pixbuf_get_width (boss);
-  int boss_height = gdk_pixbuf_get_height (boss);
+  int rowstride = gdk_pixbuf_get_rowstride (image);
+  BGImage *normals = get_normals (boss, depth);
+  double scale = (double)(1 << SHADE_SHIFT) / NORMAL_SCALE;
+  double slope = tan (light_elevation * G_PI / 180);
+  gint64 cx = scale * sin (light_angle * G_PI / 180) / slope;
+  gint64 cy = scale * cos (light_angle * G_PI / 180) / slope;
+  gint64 cz = scale;
+  int i0 = MAX (0, -x_offset);
+  int i1 = MIN (boss->width, image_width - x_offset);
   int i,j;
 
-  /* Average the three channels of the boss image */
-  
-  gushort *boss_gray = g_new (gushort, boss_width * boss_height);
-
-  for (j=0; j<boss_height; j++)
+  for (j=MAX (0, -y_offset); j<boss->height && j + y_offset < image_height; j++)
     {
-      guchar *pixels = gdk_pixbuf_get_pixels (boss) + j * gdk_pixbuf_get_rowstride (boss);
-      gushort *line = boss_gray + boss_width * j;
-
-      for (i=0; i<boss_width; i++)
-        {
-          line[i] = pixels[0] + pixels[1] + pixels[2];
-	  pixels += 3;    
-	}
-    }
+      guint32 *n = (guint32 *)(normals->pixels + j * normals->rowstride);
+      guchar *p = gdk_pixbuf_get_pixels (image) + (j + y_offset) * rowstride + 3 * (x_offset + i0);
 
-  for (j=1; j<boss_height - 1; j++)
-    {
-      if (j + y_offset >= 0 && j + y_offset < image_height)
+      for (i=i0; i<i1; i++)
 	{
-	  guchar *p = gdk_pixbuf_get_pixels (image) + (j + y_offset) * gdk_pixbuf_get_rowstride (image) + 3 * x_offset;
-      
-	  for (i=1; i<boss_width - 1; i++)
+	  gint64 shade = NORMAL_X (n[i]) * cx + NORMAL_Y (n[i]) * cy + NORMAL_Z (n[i]) * cz;
+
+	  if (shade > 0)
 	    {
-	      double shade;
-	      
-	      if (i + x_offset >= 0 && i + x_offset < image_width)
-		{
-		  int dx = (*(boss_gray + boss_width * j +       i + 1) -
-			    *(boss_gray + boss_width * j +       i - 1));
-		  int dy = (*(boss_gray + boss_width * (j - 1) + i) -
-			    *(boss_gray + boss_width * (j + 1) + i));
-		  int dz;
-		  
-		  int t = dx*dx + dy*dy;
-
-		  if (t > RMAX2)
-		    {
-		      double sqrt_t = sqrt(t);
-		      
-		      dz = 0;
-		      dx = RMAX * dx / sqrt_t;
-		      dy = RMAX * dy / sqrt_t;
-		    }
-		  else
-		    {
-		      dz = sqrt (RMAX2 - t);
-		    }
-	      
-		  shade = (double)(dz - dx + dy) / (RMAX * sqrt(3));
-		  
-		  *(p) = shade_pixel (*p, shade);
-		  *(p+1) = shade_pixel (*(p+1), shade);
-		  *(p+2) = shade_pixel (*(p+2), shade);
-		}
-	      p += 3;
+	      p[0] = MIN ((p[0] * shade + (1 << (SHADE_SHIFT - 1))) >> SHADE_SHIFT, 255);
+	      p[1] = MIN ((p[1] * shade + (1 << (SHADE_SHIFT - 1))) >> SHADE_SHIFT, 255);
+	      p[2] = MIN ((p[2] * shade + (1 << (SHADE_SHIFT - 1))) >> SHADE_SHIFT, 255);
 	    }
-
+	  else
+	    {
+	      p[0] = p[1] = p[2] = 0;
+	    }
+	  p += 3;
 	}
     }
 
-  g_free (boss_gray);
+  bg_image_unref (normals);
 }
 
-/* Create a persistant pixmap. We create a separate display
- * and set the closedown mode on it to RetainPermanent
+/* Create a persistant pixmap for the root window of screen. We create
+ * a separate display and set the closedown mode on it to
+ * RetainPermanent
  */
 GdkPixmap *
-make_root_pixmap (gint width, gint height)
+make_root_pixmap (GdkScreen *screen, gint width, gint height)
 {
+	GdkDisplay *gdk_display = gdk_screen_get_display (screen);
+	int screen_num = gdk_screen_get_number (screen);
 	Pixmap result;
 	Display *display;
+	GdkPixmap *pixmap;
 
-	gdk_flush ();
+	gdk_display_flush (gdk_display);
 
-	display = XOpenDisplay (gdk_get_display ());
+	display = XOpenDisplay (gdk_display_get_name (gdk_display));
 	XSetCloseDownMode (display, RetainPermanent);
 
 	result = XCreatePixmap (display,
-				DefaultRootWindow (display),
+				RootWindow (display, screen_num),
 				width, height,
-				DefaultDepthOfScreen (DefaultScreenOfDisplay (GDK_DISPLAY())));
+				DefaultDepth (display, screen_num));
 	XCloseDisplay (display);
 
-	return gdk_pixmap_foreign_new (result);
+	pixmap = gdk_pixmap_foreign_new_for_display (gdk_display, result);
+	gdk_drawable_set_colormap (pixmap, gdk_screen_get_system_colormap (screen));
+
+	return pixmap;
 }
 
 void
@@ -213,15 +2192,18 @@ dispose_root_pixmap (GdkPixmap *pixmap)
 	g_object_unref (pixmap);
 }
 
-/* Set the root pixmap, and properties pointing to it. We
+/* Set the root pixmap of screen, and properties pointing to it. We
  * do this atomically with XGrabServer to make sure that
  * we won't leak the pixmap if somebody else it setting
  * it at the same time. (This assumes that they follow the
  * same conventions we do
  */
 void 
-set_root_pixmap (GdkPixmap *pixmap)
+set_root_pixmap (GdkScreen *screen, GdkPixmap *pixmap)
 {
+	GdkDisplay *gdk_display = gdk_screen_get_display (screen);
+	Display *xdisplay = GDK_DISPLAY_XDISPLAY (gdk_display);
+	Window root = get_screen_root_xwindow (screen);
 	Atom type;
 	gulong nitems, bytes_after;
 	gint format;
@@ -229,16 +2211,16 @@ set_root_pixmap (GdkPixmap *pixmap)
 	Pixmap pixmap_id;
 	int result;
 
-	XGrabServer (GDK_DISPLAY());
+	XGrabServer (xdisplay);
 
-	result = XGetWindowProperty (GDK_DISPLAY(), get_root_xwindow(),
-				     gdk_x11_get_xatom_by_name("ESETROOT_PMAP_ID"),
+	result = XGetWindowProperty (xdisplay, root,
+				     gdk_x11_get_xatom_by_name_for_display (gdk_display, "ESETROOT_PMAP_ID"),
 				     0L, 1L, False, XA_PIXMAP,
 				     &type, &format, &nitems, &bytes_after,
 				     &data_esetroot);
 
 	if (result == Success && type == XA_PIXMAP && format == 32 && nitems == 1) {
-		XKillClient(GDK_DISPLAY(), *(Pixmap*)data_esetroot);
+		XKillClient(xdisplay, *(Pixmap*)data_esetroot);
 	}
 
 	if (data_esetroot != NULL) {
@@ -248,28 +2230,237 @@ set_root_pixmap (GdkPixmap *pixmap)
 	if (pixmap != NULL) {
 		pixmap_id = GDK_WINDOW_XWINDOW (pixmap);
 
-		XChangeProperty (GDK_DISPLAY(), get_root_xwindow(),
-				 gdk_x11_get_xatom_by_name("ESETROOT_PMAP_ID"), 
+		XChangeProperty (xdisplay, root,
+				 gdk_x11_get_xatom_by_name_for_display (gdk_display, "ESETROOT_PMAP_ID"), 
 				 XA_PIXMAP, 32, PropModeReplace,
 				 (guchar *) &pixmap_id, 1);
-		XChangeProperty (GDK_DISPLAY(), get_root_xwindow(),
-				 gdk_x11_get_xatom_by_name("_XROOTPMAP_ID"), 
+		XChangeProperty (xdisplay, root,
+				 gdk_x11_get_xatom_by_name_for_display (gdk_display, "_XROOTPMAP_ID"), 
 				 XA_PIXMAP, 32, PropModeReplace,
 				 (guchar *) &pixmap_id, 1);
 
-		XSetWindowBackgroundPixmap (GDK_DISPLAY(), get_root_xwindow(), 
+		XSetWindowBackgroundPixmap (xdisplay, root, 
 					    pixmap_id);
 	} else {
-		XDeleteProperty (GDK_DISPLAY (), get_root_xwindow (),
-				 gdk_x11_get_xatom_by_name("ESETROOT_PMAP_ID"));
-		XDeleteProperty (GDK_DISPLAY(), get_root_xwindow(),
-				 gdk_x11_get_xatom_by_name("_XROOTPMAP_ID"));
+		XDeleteProperty (xdisplay, root,
+				 gdk_x11_get_xatom_by_name_for_display (gdk_display, "ESETROOT_PMAP_ID"));
+		XDeleteProperty (xdisplay, root,
+				 gdk_x11_get_xatom_by_name_for_display (gdk_display, "_XROOTPMAP_ID"));
+	}
+
+	XClearWindow (xdisplay, root);
+	XUngrabServer (xdisplay);
+
+	XFlush(xdisplay);
+}
+
+/* Read back the background of screen, as set by set_root_pixmap() or
+ * by other programs following the same conventions, repeated to the
+ * size of the screen. Without a root pixmap, what the root window
+ * shows is returned instead. Returns NULL on failure.
+ */
+GdkPixbuf *
+get_root_pixbuf (GdkScreen *screen)
+{
+	GdkDisplay *gdk_display = gdk_screen_get_display (screen);
+	Display *xdisplay = GDK_DISPLAY_XDISPLAY (gdk_display);
+	Window root = get_screen_root_xwindow (screen);
+	GdkColormap *colormap = gdk_screen_get_system_colormap (screen);
+	int width = gdk_screen_get_width (screen);
+	int height = gdk_screen_get_height (screen);
+	GdkPixbuf *pixbuf = NULL;
+	Atom type;
+	gulong nitems, bytes_after;
+	gint format;
+	guchar *data = NULL;
+
+	if (XGetWindowProperty (xdisplay, root,
+				gdk_x11_get_xatom_by_name_for_display (gdk_display, "_XROOTPMAP_ID"),
+				0L, 1L, False, XA_PIXMAP,
+				&type, &format, &nitems, &bytes_after,
+				&data) == Success &&
+	    type == XA_PIXMAP && format == 32 && nitems == 1) {
+		Pixmap xpixmap = *(Pixmap *)data;
+		Window root_return;
+		int x, y;
+		unsigned int pixmap_width, pixmap_height, border, depth;
+
+		gdk_error_trap_push ();
+
+		if (XGetGeometry (xdisplay, xpixmap, &root_return, &x, &y,
+				  &pixmap_width, &pixmap_height, &border, &depth)) {
+			GdkPixmap *pixmap = gdk_pixmap_foreign_new_for_display (gdk_display, xpixmap);
+			GdkPixbuf *tile = NULL;
+
+			if (pixmap) {
+				tile = gdk_pixbuf_get_from_drawable (NULL, pixmap, colormap, 0, 0, 0, 0,
+								     pixmap_width, pixmap_height);
+				g_object_unref (pixmap);
+			}
+
+			if (tile) {
+				pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+
+				for (y = 0; y < height; y += pixmap_height)
+					for (x = 0; x < width; x += pixmap_width)
+						gdk_pixbuf_copy_area (tile, 0, 0,
+								      MIN ((int)pixmap_width, width - x),
+								      MIN ((int)pixmap_height, height - y),
+								      pixbuf, x, y);
+
+				g_object_unref (tile);
+			}
+		}
+
+		gdk_flush ();
+		gdk_error_trap_pop ();
+	}
+
+	if (data)
+		XFree (data);
+
+	if (!pixbuf)
+		pixbuf = gdk_pixbuf_get_from_drawable (NULL, get_screen_root_gdk_window (screen), colormap,
+						       0, 0, 0, 0, width, height);
+
+	return pixbuf;
+}
+
+static gboolean
+write_buffer (const char *name, GdkPixmap *pixmap, GdkPixbuf *pixbuf)
+{
+	XsriBufferHeader header;
+	int width = gdk_pixbuf_get_width (pixbuf);
+	int height = gdk_pixbuf_get_height (pixbuf);
+	int rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+	guchar *src = gdk_pixbuf_get_pixels (pixbuf);
+	gsize size;
+	guchar *data;
+	int fd;
+	int i, j;
+
+	header.magic = XSRI_BUFFER_MAGIC;
+	header.version = XSRI_BUFFER_VERSION;
+	header.format = XSRI_BUFFER_XRGB32;
+	header.width = width;
+	header.height = height;
+	header.rowstride = width * 4;
+	header.pixel_offset = (sizeof (header) + 63) & ~63;
+	header.flags = XSRI_BUFFER_OPAQUE;
+	header.pixmap = GDK_WINDOW_XWINDOW (pixmap);
+
+	size = header.pixel_offset + (gsize)header.rowstride * height;
+
+	fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return FALSE;
+
+	if (ftruncate (fd, size) < 0 ||
+	    (data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close (fd);
+		shm_unlink (name);
+		return FALSE;
+	}
+	close (fd);
+
+	memcpy (data, &header, sizeof (header));
+
+	for (j = 0; j < height; j++) {
+		guint32 *d = (guint32 *)(data + header.pixel_offset + j * header.rowstride);
+		guchar *s = src + j * rowstride;
+
+		for (i = 0; i < width; i++) {
+			d[i] = 0xff000000 | (s[0] << 16) | (s[1] << 8) | s[2];
+			s += 3;
+		}
+	}
+
+	munmap (data, size);
+
+	return TRUE;
+}
+
+/* Publish pixbuf, which should be what was drawn into pixmap, just
+ * passed to set_root_pixmap() for screen, for other clients; see
+ * render-background.h for the format.
+ */
+void
+set_root_buffer (GdkScreen *screen, GdkPixmap *pixmap, GdkPixbuf *pixbuf)
+{
+	GdkDisplay *gdk_display = gdk_screen_get_display (screen);
+	Display *xdisplay = GDK_DISPLAY_XDISPLAY (gdk_display);
+	Window root = get_screen_root_xwindow (screen);
+	Atom property = gdk_x11_get_xatom_by_name_for_display (gdk_display, "_XSRI_BACKGROUND_SHM");
+	Atom type;
+	gulong nitems, bytes_after;
+	gint format;
+	guchar *old_name = NULL;
+	char *name;
+
+	name = g_strdup_printf ("/xsri-%lu-%lx-%lu-%" G_GINT64_MODIFIER "x",
+				(gulong)getuid (), (gulong)root,
+				(gulong)getpid (), g_get_real_time ());
+
+	if (!write_buffer (name, pixmap, pixbuf)) {
+		g_warning ("Cannot create shared memory object %s: %s", name, g_strerror (errno));
+		g_free (name);
+		return;
+	}
+
+	XGrabServer (xdisplay);
+
+	if (XGetWindowProperty (xdisplay, root, property,
+				0L, 256L, False, XA_STRING,
+				&type, &format, &nitems, &bytes_after,
+				&old_name) == Success && old_name) {
+		if (type == XA_STRING && format == 8 &&
+		    strncmp ((char *)old_name, "/xsri-", 6) == 0 &&
+		    strcmp ((char *)old_name, name) != 0)
+			shm_unlink ((char *)old_name);
+		XFree (old_name);
+	}
+
+	XChangeProperty (xdisplay, root, property,
+			 XA_STRING, 8, PropModeReplace,
+			 (guchar *)name, strlen (name));
+
+	XUngrabServer (xdisplay);
+	XFlush (xdisplay);
+
+	g_free (name);
+}
+
+/* Withdraw the buffer published for screen, for when the background
+ * is going to be set without one.
+ */
+void
+unset_root_buffer (GdkScreen *screen)
+{
+	GdkDisplay *gdk_display = gdk_screen_get_display (screen);
+	Display *xdisplay = GDK_DISPLAY_XDISPLAY (gdk_display);
+	Window root = get_screen_root_xwindow (screen);
+	Atom property = gdk_x11_get_xatom_by_name_for_display (gdk_display, "_XSRI_BACKGROUND_SHM");
+	Atom type;
+	gulong nitems, bytes_after;
+	gint format;
+	guchar *old_name = NULL;
+
+	XGrabServer (xdisplay);
+
+	if (XGetWindowProperty (xdisplay, root, property,
+				0L, 256L, False, XA_STRING,
+				&type, &format, &nitems, &bytes_after,
+				&old_name) == Success && old_name) {
+		if (type == XA_STRING && format == 8 &&
+		    strncmp ((char *)old_name, "/xsri-", 6) == 0)
+			shm_unlink ((char *)old_name);
+		XFree (old_name);
 	}
 
-	XClearWindow (GDK_DISPLAY (), get_root_xwindow ());
-	XUngrabServer (GDK_DISPLAY());
+	XDeleteProperty (xdisplay, root, property);
 
-	XFlush(GDK_DISPLAY());
+	XUngrabServer (xdisplay);
+	XFlush (xdisplay);
 }
 
 gulong 
@@ -299,20 +2490,46 @@ xpixel_to_color (gulong pixel, GdkColor *color)
 	color->blue = xcolor.blue;
 }
 
+/* dest = src + dest * (1 - src_alpha), src premultiplied RGBA,
+ * dest packed RGB.
+ */
+static void
+composite_row (guchar       *dest,
+	       const guchar *src,
+	       int           width)
+{
+	int i;
+
+	for (i = 0; i < width; i++) {
+		guint inv_a = 0xff - src[3];
+
+		dest[0] = src[0] + mul_un8 (dest[0], inv_a);
+		dest[1] = src[1] + mul_un8 (dest[1], inv_a);
+		dest[2] = src[2] + mul_un8 (dest[2], inv_a);
+
+		src += 4;
+		dest += 3;
+	}
+}
+
 static void 
 composite (GdkPixbuf       *dest,
 	   int              dest_x,
 	   int              dest_y,
-	   GdkPixbuf       *src,
+	   BGImage         *src,
 	   int              at_x,
 	   int              at_y,
 	   int              at_width,
-	   int              at_height,
-	   int              overall_alpha)
+	   int              at_height)
 {
 	GdkRectangle emblem_rect;
 	GdkRectangle pixbuf_rect;
 	GdkRectangle dest_rect;
+	BGImage *scaled;
+	int dest_rowstride = gdk_pixbuf_get_rowstride (dest);
+	guchar *d;
+	guchar *s;
+	int j;
 	
 	emblem_rect.x = at_x;
 	emblem_rect.y = at_y;
@@ -324,14 +2541,136 @@ composite (GdkPixbuf       *dest,
 	pixbuf_rect.width = gdk_pixbuf_get_width (dest);
 	pixbuf_rect.height = gdk_pixbuf_get_height (dest);
 	
-	gdk_rectangle_intersect (&emblem_rect, &pixbuf_rect, &dest_rect);
-	
-	gdk_pixbuf_composite (src, dest,
-			      dest_rect.x - dest_x, dest_rect.y - dest_y, dest_rect.width, dest_rect.height,
-			      at_x - dest_x, at_y - dest_y,
-			      (double)at_width / (gdk_pixbuf_get_width (src)),
-			      (double)at_height / (gdk_pixbuf_get_height (src)),
-			      GDK_INTERP_BILINEAR, overall_alpha);
+	if (!gdk_rectangle_intersect (&emblem_rect, &pixbuf_rect, &dest_rect))
+		return;
+
+	scaled = bg_image_get_scaled (src, at_width, at_height);
+
+	d = gdk_pixbuf_get_pixels (dest) +
+		(dest_rect.y - dest_y) * dest_rowstride + (dest_rect.x - dest_x) * 3;
+	s = scaled->pixels +
+		(dest_rect.y - at_y) * scaled->rowstride + (dest_rect.x - at_x) * 4;
+
+	for (j = 0; j < dest_rect.height; j++) {
+		composite_row (d, s, dest_rect.width);
+		d += dest_rowstride;
+		s += scaled->rowstride;
+	}
+
+	bg_image_unref (scaled);
+}
+
+static void
+get_layer_rect (BGLayer      *layer,
+		GdkRectangle *rect)
+{
+	rect->x = layer->x;
+	rect->y = layer->y;
+	rect->width = layer->width;
+	rect->height = layer->height;
+}
+
+static gboolean
+layer_is_opaque (BGLayer *layer)
+{
+	return layer->image->opaque && !layer->emboss;
+}
+
+static gboolean
+rect_contains (GdkRectangle *outer,
+	       GdkRectangle *inner)
+{
+	return (inner->x >= outer->x && inner->y >= outer->y &&
+		inner->x + inner->width <= outer->x + outer->width &&
+		inner->y + inner->height <= outer->y + outer->height);
+}
+
+/* The cell of the layer index holding coordinate v of a screen
+ * dimension size; outside the screen, the nearest one.
+ */
+static int
+layer_cell (int v, int size)
+{
+	return CLAMP ((gint64)v * BG_LAYER_GRID / MAX (size, 1), 0, BG_LAYER_GRID - 1);
+}
+
+void
+background_index_layers (BGState *state)
+{
+	int i, cx, cy;
+
+	memset (state->layer_cells, 0, sizeof (state->layer_cells));
+
+	for (i = 0; i < state->n_layers; i++) {
+		BGLayer *layer = &state->layers[i];
+
+		if (!layer->image || layer->width <= 0 || layer->height <= 0)
+			continue;
+
+		for (cy = layer_cell (layer->y, state->height);
+		     cy <= layer_cell (layer->y + layer->height - 1, state->height); cy++)
+			for (cx = layer_cell (layer->x, state->width);
+			     cx <= layer_cell (layer->x + layer->width - 1, state->width); cx++)
+				state->layer_cells[cy * BG_LAYER_GRID + cx] |= 1u << i;
+	}
+}
+
+/* The layers to draw for area, as a mask: those the index puts near
+ * it that really intersect it, less those hidden there by an opaque
+ * layer above. Sets *covered if an opaque layer covers all of area.
+ */
+static guint32
+get_visible_layers (BGState      *state,
+		    GdkRectangle *area,
+		    gboolean     *covered)
+{
+	guint32 candidates = 0;
+	guint32 visible = 0;
+	GdkRectangle rect, part, above;
+	int cx, cy, i, j;
+
+	*covered = FALSE;
+
+	if (state->n_layers == 0 || area->width <= 0 || area->height <= 0)
+		return 0;
+
+	for (cy = layer_cell (area->y, state->height);
+	     cy <= layer_cell (area->y + area->height - 1, state->height); cy++)
+		for (cx = layer_cell (area->x, state->width);
+		     cx <= layer_cell (area->x + area->width - 1, state->width); cx++)
+			candidates |= state->layer_cells[cy * BG_LAYER_GRID + cx];
+
+	/* From the top, so the opaque layers above each one are known */
+	for (i = state->n_layers - 1; i >= 0; i--) {
+		BGLayer *layer = &state->layers[i];
+		gboolean hidden = FALSE;
+
+		if (!(candidates & (1u << i)))
+			continue;
+
+		get_layer_rect (layer, &rect);
+		if (!gdk_rectangle_intersect (&rect, area, &part))
+			continue;
+
+		for (j = i + 1; j < state->n_layers && !hidden; j++) {
+			if ((visible & (1u << j)) && layer_is_opaque (&state->layers[j])) {
+				get_layer_rect (&state->layers[j], &above);
+				hidden = rect_contains (&above, &part);
+			}
+		}
+
+		if (hidden)
+			continue;
+
+		visible |= 1u << i;
+
+		if (layer_is_opaque (layer) && rect_contains (&rect, area)) {
+			*covered = TRUE;
+			break;
+		}
+	}
+
+	return visible;
 }
 
 static void
@@ -343,18 +2682,23 @@ get_visibility (BGState     *state,
 		gint         height,
 		gboolean    *see_colors,
 		gboolean    *see_tiles,
-		gboolean    *see_emblem)
+		gboolean    *see_emblem,
+		guint32     *see_layers)
 {
+	GdkRectangle area;
+	gboolean covered;
+
 	*see_colors = TRUE;
-	*see_tiles = state->tile_pixbuf != NULL;
-	*see_emblem = !tile_only && state->emblem_pixbuf != NULL;
+	*see_tiles = state->tile_image != NULL;
+	*see_emblem = !tile_only && state->emblem_image != NULL;
+	*see_layers = 0;
 
-	if (*see_tiles && !gdk_pixbuf_get_has_alpha (state->tile_pixbuf) && state->tile_alpha == 255)
+	if (*see_tiles && state->tile_image->opaque)
 		*see_colors = FALSE;
 
 	if (*see_emblem) {
-		if (!gdk_pixbuf_get_has_alpha (state->emblem_pixbuf) &&
-		    state->emblem_alpha == 255 &&
+		if (state->emblem_image->opaque &&
+		    !state->emboss &&
 		    x >= state->emblem_x &&
 		    x + width <= state->emblem_x + state->emblem_width &&
 		    y >= state->emblem_y &&
@@ -370,6 +2714,39 @@ get_visibility (BGState     *state,
 			*see_emblem = FALSE;
 		}
 	}
+
+	if (tile_only)
+		return;
+
+	area.x = x;
+	area.y = y;
+	area.width = width;
+	area.height = height;
+
+	*see_layers = get_visible_layers (state, &area, &covered);
+
+	if (covered) {
+		*see_colors = FALSE;
+		*see_tiles = FALSE;
+		*see_emblem = FALSE;
+	} else if (*see_emblem) {
+		GdkRectangle emblem_rect, rect;
+		int i;
+
+		emblem_rect.x = state->emblem_x;
+		emblem_rect.y = state->emblem_y;
+		emblem_rect.width = state->emblem_width;
+		emblem_rect.height = state->emblem_height;
+		gdk_rectangle_intersect (&emblem_rect, &area, &emblem_rect);
+
+		for (i = 0; i < state->n_layers && *see_emblem; i++) {
+			if ((*see_layers & (1u << i)) && layer_is_opaque (&state->layers[i])) {
+				get_layer_rect (&state->layers[i], &rect);
+				if (rect_contains (&rect, &emblem_rect))
+					*see_emblem = FALSE;
+			}
+		}
+	}
 }
 
 static int
@@ -396,28 +2773,36 @@ lcm (int a, int b)
 
 }
 
+/* The size of the smallest piece of state that repeats to fill the
+ * screen, when shown on a screen with visual, which decides whether
+ * colors are dithered. Returns FALSE if nothing smaller than the
+ * screen repeats. This doesn't call GDK, so works in any thread.
+ */
 gboolean
-background_get_tile_size (BGState *state,
-			  int     *width_return,
-			  int     *height_return)
+background_get_tile_size (BGState   *state,
+			  GdkVisual *visual,
+			  int       *width_return,
+			  int       *height_return)
 {
 	gboolean see_colors, see_tiles, see_emblem;
+	guint32 see_layers;
 	gint width;
 	gint height;
 	
-	get_visibility (state, FALSE, 0, 0, state->width, state->height, &see_colors, &see_tiles, &see_emblem);
+	get_visibility (state, FALSE, 0, 0, state->width, state->height,
+			&see_colors, &see_tiles, &see_emblem, &see_layers);
 
-	if (!see_colors && !see_tiles)
+	/* Blurring stops at the edges of the screen, so the result
+	 * doesn't repeat even if the layers do
+	 */
+	if ((!see_colors && !see_tiles) || state->blur > 0)
 		return FALSE;
 
 	width = 1;
 	height = 1;
 
 	if (see_colors) {
-		GdkVisual *visual;
 		gboolean dithered;
-		
-		visual = gdk_visual_get_system ();
 
 		if ((visual->type == GDK_VISUAL_TRUE_COLOR ||
 		     visual->type == GDK_VISUAL_DIRECT_COLOR) &&
@@ -430,19 +2815,37 @@ background_get_tile_size (BGState *state,
 		width = dithered ? 128 : 1;
 		height = dithered ? 128 : 1;
 
+		/* A linear gradient along one axis repeats along the
+		 * other; anything else covers the whole screen.
+		 */
 		if (state->grad) {
-			if (state->vertical) {
+			double angle = fmod (state->angle, 180.);
+
+			if (angle < 0)
+				angle += 180.;
+			
+			if (state->gradient_type != BG_GRADIENT_LINEAR) {
+				width = state->width;
+				height = state->height;
+			} else if (angle == 0.) {
 				height = state->height;
+			} else if (angle == 90.) {
+				width = state->width;
 			} else {
 				width = state->width;
+				height = state->height;
 			}
 		}
 	}
 
-	if (see_tiles && state->tile_pixbuf) {
-		width = MIN (lcm (width, state->tile_width),
+	if (see_tiles && state->tile_image) {
+		int tile_width, tile_height, period_width, period_height;
+
+		get_tile_period_size (state, &tile_width, &tile_height,
+				      &period_width, &period_height);
+		width = MIN (lcm (width, period_width),
 			     state->width);
-		height = MIN (lcm (height, state->tile_height),
+		height = MIN (lcm (height, period_height),
 			      state->height);
 	}
 
@@ -457,89 +2860,316 @@ background_get_tile_size (BGState *state,
 	return TRUE;
 }
 
+/* Draw image, shown at x, y, width by height on the screen, onto
+ * pixbuf, which covers the part of the screen starting at pixbuf_x,
+ * pixbuf_y. Embossing uses the light of state.
+ */
+static void
+render_overlay (BGRenderContext *context,
+		BGState         *state,
+		GdkPixbuf       *pixbuf,
+		gint             pixbuf_x,
+		gint             pixbuf_y,
+		BGImage         *image,
+		gint             x,
+		gint             y,
+		gint             width,
+		gint             height,
+		gboolean         embossed,
+		gint             blur)
+{
+	BGImage *scaled = get_layer_image (context, image, width, height, blur, FALSE);
+
+	if (embossed)
+		emboss (pixbuf, scaled, x - pixbuf_x, y - pixbuf_y,
+			state->light_angle, state->light_elevation, state->emboss_depth);
+	else
+		composite (pixbuf, pixbuf_x, pixbuf_y, scaled, x, y, width, height);
+
+	bg_image_unref (scaled);
+}
+
+/* Draw the emblem of state onto pixbuf, which covers the part of the
+ * screen starting at x, y.
+ */
 void
-background_render (BGState     *state,
-		   GdkDrawable *drawable,
-		   gboolean     tile_only,
-		   gint         x, 
-		   gint         y,
-		   gint         width,
-		   gint         height)
+background_render_emblem (BGRenderContext *context,
+			  BGState         *state,
+			  GdkPixbuf       *pixbuf,
+			  gint             x,
+			  gint             y)
 {
-	GdkGC *gc;
-	
-	gboolean see_colors, see_tiles, see_emblem;
-	GdkPixbuf *pixbuf;
+	render_overlay (context, state, pixbuf, x, y, state->emblem_image,
+			state->emblem_x, state->emblem_y, state->emblem_width, state->emblem_height,
+			state->emboss, state->emblem_blur);
+}
 
-	get_visibility (state, tile_only, x, y, width, height, &see_colors, &see_tiles, &see_emblem);
+/* Draw the layers of the part of state at x, y into all of pixbuf */
+static void
+render_layers (BGRenderContext *context,
+	       BGState         *state,
+	       GdkPixbuf       *pixbuf,
+	       gboolean         tile_only,
+	       gint             x,
+	       gint             y)
+{
+	gboolean see_colors, see_tiles, see_emblem;
+	guint32 see_layers;
+	int width = gdk_pixbuf_get_width (pixbuf);
+	int height = gdk_pixbuf_get_height (pixbuf);
+	int i;
 
-	pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+	get_visibility (state, tile_only, x, y, width, height,
+			&see_colors, &see_tiles, &see_emblem, &see_layers);
 
 	if (see_colors) {
 		if (state->grad)
-			fill_gradient (pixbuf, &state->bgColor1, &state->bgColor2, state->vertical,
-				       state->width, state->height, x, y);
+			fill_gradient (context, pixbuf, state, x, y);
 		else
-			fill_gradient (pixbuf, &state->bgColor1, &state->bgColor1, FALSE,
-				       state->width, state->height, x, y);
+			fill_solid (pixbuf, &state->bgColor1);
 	}
 
 	if (see_tiles) {
+		BGImage *tile = get_tile_period (context, state);
 		int xoff, yoff;
 
-		int xoff_start = x - x % state->tile_width;
-		int yoff_start = y - y % state->tile_height;
+		int xoff_start = x - x % tile->width;
+		int yoff_start = y - y % tile->height;
 
-		for (yoff = yoff_start; yoff < height; yoff += state->tile_height)
-			for (xoff = xoff_start; xoff < width; xoff += state->tile_width) {
-				composite (pixbuf, x, y, state->tile_pixbuf,
-					   xoff, yoff, state->tile_width, state->tile_height,
-					   state->tile_alpha);
+		for (yoff = yoff_start; yoff < y + height; yoff += tile->height)
+			for (xoff = xoff_start; xoff < x + width; xoff += tile->width) {
+				composite (pixbuf, x, y, tile,
+					   xoff, yoff, tile->width, tile->height);
 			}
+
+		bg_image_unref (tile);
 	}
 
-	if (see_emblem) {
-		if (state->emboss) {
-			GdkPixbuf *boss;
-			int image_width = gdk_pixbuf_get_width (state->emblem_pixbuf);
-			int image_height = gdk_pixbuf_get_height (state->emblem_pixbuf);
+	if (see_emblem)
+		background_render_emblem (context, state, pixbuf, x, y);
 
-			if (image_width == state->emblem_width &&
-			    image_height == state->emblem_height &&
-			    !gdk_pixbuf_get_has_alpha (state->emblem_pixbuf)) {
-				boss = g_object_ref (state->emblem_pixbuf);
-			} else {
-				boss = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8,
-						       state->emblem_width, state->emblem_height);
-				
-				gdk_pixbuf_composite_color (state->emblem_pixbuf, boss,
-							    0, 0, state->emblem_width, state->emblem_height,
-							    0, 0,
-							    (double)state->emblem_width / image_width,
-							    (double)state->emblem_height / image_height,
-							    GDK_INTERP_BILINEAR,
-							    255, 0, 0, 16,
-							    0xffffff, 0xffffff);
-			}
+	for (i = 0; i < state->n_layers; i++) {
+		BGLayer *layer = &state->layers[i];
 
-			emboss (pixbuf, boss, state->emblem_x - x, state->emblem_y - y);
-			g_object_unref (boss);
-		} else {
-			composite (pixbuf, x, y, state->emblem_pixbuf,
-				   state->emblem_x, state->emblem_y, state->emblem_width, state->emblem_height,
-				   state->emblem_alpha);
+		if (see_layers & (1u << i))
+			render_overlay (context, state, pixbuf, x, y, layer->image,
+					layer->x, layer->y, layer->width, layer->height,
+					layer->emboss, layer->blur);
+	}
+}
+
+/* The layers of state from x0, y0 to x1, y1, blurred by state->blur */
+static BGImage *
+render_blurred (BGRenderContext *context,
+		BGState         *state,
+		gboolean         tile_only,
+		gint             x0,
+		gint             y0,
+		gint             x1,
+		gint             y1)
+{
+	GdkPixbuf *layers;
+	BGImage *image;
+	BGImage *blurred;
+
+	layers = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, x1 - x0, y1 - y0);
+	render_layers (context, state, layers, tile_only, x0, y0);
+
+	image = bg_image_new_from_pixbuf (layers, 255);
+	g_object_unref (layers);
+	blurred = blur_image (context, image, state->blur, FALSE);
+	bg_image_unref (image);
+
+	return blurred;
+}
+
+/* Returns a reference to the whole of state, blurred. The last one is
+ * kept with context, so that rendering the screen a band at a time
+ * only renders and blurs it once. A state that compares different
+ * only in its padding is just rendered again.
+ */
+static BGImage *
+context_get_blurred (BGRenderContext *context,
+		     BGState         *state,
+		     gboolean         tile_only)
+{
+	BGState *cached = &context->blurred_state;
+	int i;
+
+	if (context->blurred && context->blurred_tile_only == tile_only &&
+	    memcmp (cached, state, sizeof (BGState)) == 0)
+		return bg_image_ref (context->blurred);
+
+	context_drop_blurred (context);
+
+	context->blurred = render_blurred (context, state, tile_only,
+					   0, 0, state->width, state->height);
+	context->blurred_tile_only = tile_only;
+
+	/* The images are held, so their addresses can't be reused
+	 * for others while they are compared
+	 */
+	*cached = *state;
+	if (cached->tile_image)
+		bg_image_ref (cached->tile_image);
+	if (cached->emblem_image)
+		bg_image_ref (cached->emblem_image);
+	for (i = 0; i < cached->n_layers; i++)
+		bg_image_ref (cached->layers[i].image);
+
+	return bg_image_ref (context->blurred);
+}
+
+/* Render the part of state at x, y into all of pixbuf. With a blur of
+ * the whole background, the part is taken from the whole screen,
+ * rendered and blurred once for the context; a part reaching outside
+ * the screen has the layers drawn with a margin around it, as far as
+ * the blur reaches, limited to the screen.
+ */
+static void
+render_to_pixbuf (BGRenderContext *context,
+		  BGState         *state,
+		  GdkPixbuf       *pixbuf,
+		  gboolean         tile_only,
+		  gint             x,
+		  gint             y)
+{
+	int width = gdk_pixbuf_get_width (pixbuf);
+	int height = gdk_pixbuf_get_height (pixbuf);
+	int rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+	int margin, x0, y0, x1, y1;
+	BGImage *blurred;
+	int i, j;
+
+	if (state->blur <= 0) {
+		render_layers (context, state, pixbuf, tile_only, x, y);
+		return;
+	}
+
+	if (x >= 0 && y >= 0 && x + width <= state->width && y + height <= state->height) {
+		x0 = y0 = 0;
+		blurred = context_get_blurred (context, state, tile_only);
+	} else {
+		margin = BLUR_PASSES * state->blur;
+		x0 = MAX (x - margin, MIN (x, 0));
+		y0 = MAX (y - margin, MIN (y, 0));
+		x1 = MIN (x + width + margin, MAX (x + width, state->width));
+		y1 = MIN (y + height + margin, MAX (y + height, state->height));
+		blurred = render_blurred (context, state, tile_only, x0, y0, x1, y1);
+	}
+
+	for (j = 0; j < height; j++) {
+		guchar *d = gdk_pixbuf_get_pixels (pixbuf) + j * rowstride;
+		guchar *s = blurred->pixels + (y - y0 + j) * blurred->rowstride + 4 * (x - x0);
+
+		for (i = 0; i < width; i++) {
+			d[0] = s[0];
+			d[1] = s[1];
+			d[2] = s[2];
+			d += 3;
+			s += 4;
 		}
 	}
-								     
-								      
+
+	bg_image_unref (blurred);
+}
+
+/* Render the part of state at x, y into all of pixbuf, an RGB pixbuf
+ * without alpha; it may be a sub-pixbuf of a bigger one.
+ */
+void
+background_render_to_pixbuf (BGRenderContext *context,
+			     BGState         *state,
+			     GdkPixbuf       *pixbuf,
+			     gboolean         tile_only,
+			     gint             x,
+			     gint             y)
+{
+	BGRenderContext *tmp_context = NULL;
+
+	if (!context)
+		context = tmp_context = bg_render_context_new ();
+
+	render_to_pixbuf (context, state, pixbuf, tile_only, x, y);
+
+	bg_render_context_free (tmp_context);
+}
+
+/* Does all of the work of background_render() except sending the
+ * result to the X server, so it may be called from a thread other
+ * than the GDK one, and from several threads at once for states
+ * sharing images, as long as each has its own context. The result is
+ * a new pixbuf owned by the caller.
+ */
+GdkPixbuf *
+background_render_pixbuf (BGRenderContext *context,
+			  BGState         *state,
+			  gboolean         tile_only,
+			  gint             x, 
+			  gint             y,
+			  gint             width,
+			  gint             height)
+{
+	GdkPixbuf *pixbuf;
+
+	pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+	background_render_to_pixbuf (context, state, pixbuf, tile_only, x, y);
+
+	return pixbuf;
+}
+
+/* Draw the result of background_render_pixbuf() for x, y into the
+ * top left corner of drawable.
+ */
+void
+background_draw_pixbuf (BGRenderContext *context,
+			GdkPixbuf       *pixbuf,
+			GdkDrawable     *drawable,
+			gint             x,
+			gint             y)
+{
+	GdkGC *gc;
 	
-	gc = gdk_gc_new (drawable);
+	if (context)
+		gc = context_get_gc (context, drawable);
+	else
+		gc = gdk_gc_new (drawable);
+
 	gdk_pixbuf_render_to_drawable (pixbuf, drawable, gc,
-				       0, 0, 0, 0, width, height,
+				       0, 0, 0, 0,
+				       gdk_pixbuf_get_width (pixbuf), gdk_pixbuf_get_height (pixbuf),
 				       GDK_RGB_DITHER_MAX, x, y);
-	g_object_unref (gc);
 
-	g_object_unref (pixbuf);
+	if (!context)
+		g_object_unref (gc);
+}
+
+/* Render the part of state at x, y into the top left corner of
+ * drawable. With a context, the intermediate pixbuf and the GC are
+ * kept for the next call.
+ */
+void
+background_render (BGRenderContext *context,
+		   BGState         *state,
+		   GdkDrawable     *drawable,
+		   gboolean         tile_only,
+		   gint             x, 
+		   gint             y,
+		   gint             width,
+		   gint             height)
+{
+	GdkPixbuf *pixbuf;
+
+	if (!context) {
+		pixbuf = background_render_pixbuf (NULL, state, tile_only, x, y, width, height);
+		background_draw_pixbuf (NULL, pixbuf, drawable, x, y);
+		g_object_unref (pixbuf);
+		return;
+	}
+
+	pixbuf = context_get_pixbuf (context, width, height);
+	render_to_pixbuf (context, state, pixbuf, tile_only, x, y);
+	background_draw_pixbuf (context, pixbuf, drawable, x, y);
 }
 
 /* We abstract the functionality of getting the root window since xscreensaver
@@ -547,68 +3177,86 @@ background_render (BGState     *state,
  * own fake root window.
  */
 Window
-get_root_xwindow (void)
+get_screen_root_xwindow (GdkScreen *screen)
 {
-	static Window root_window = None;
+	Window root_window;
+	Display *xdisplay = GDK_SCREEN_XDISPLAY (screen);
+	Window root_return, parent;
+	Window *children;
+	Atom type;
+	unsigned int n_children;
+	unsigned int i;
 
-	if (root_window == None) {
-		Window root_return, parent;
-		Window *children;
-		Atom type;
-		unsigned int n_children;
-		unsigned int i;
+	root_window = (Window)g_object_get_data (G_OBJECT (screen), "xsri-root-xwindow");
+	if (root_window != None)
+		return root_window;
 		
-		root_window = GDK_ROOT_WINDOW ();
+	root_window = GDK_WINDOW_XWINDOW (gdk_screen_get_root_window (screen));
 
-		XQueryTree (GDK_DISPLAY (), GDK_ROOT_WINDOW (),
-			    &root_return, &parent, &children, &n_children);
+	XQueryTree (xdisplay, root_window,
+		    &root_return, &parent, &children, &n_children);
 
-		gdk_error_trap_push ();
+	gdk_error_trap_push ();
 
-		for (i = 0; i < n_children; i++) {
-			Window *data;
-			int format;
-			unsigned long n_items, bytes_after;
+	for (i = 0; i < n_children; i++) {
+		Window *data;
+		int format;
+		unsigned long n_items, bytes_after;
 			
-			if (XGetWindowProperty (GDK_DISPLAY (), children[i],
-						gdk_x11_get_xatom_by_name ("__SWM_VROOT"),
-						0, 1, False, XA_WINDOW,
-						&type, &format, &n_items, &bytes_after, (guchar **)&data) == Success) {
-				if (type != None) {
-					if (format == 32 && n_items == 1 && bytes_after == 0) {
-						XFree (data);
-						root_window = *data;
-						break;
-					} else {
-						XFree (data);
-					}
+		if (XGetWindowProperty (xdisplay, children[i],
+					gdk_x11_get_xatom_by_name_for_display (gdk_screen_get_display (screen),
+									       "__SWM_VROOT"),
+					0, 1, False, XA_WINDOW,
+					&type, &format, &n_items, &bytes_after, (guchar **)&data) == Success) {
+			if (type != None) {
+				if (format == 32 && n_items == 1 && bytes_after == 0) {
+					root_window = *data;
+					XFree (data);
+					break;
+				} else {
+					XFree (data);
 				}
 			}
-						
-					    
 		}
+	}
 		
-		gdk_error_trap_pop ();
+	gdk_error_trap_pop ();
 
-		XFree (children);
-	}
+	XFree (children);
+
+	g_object_set_data (G_OBJECT (screen), "xsri-root-xwindow", (gpointer)root_window);
 
 	return root_window;
 }
 
 GdkWindow *
-get_root_gdk_window (void)
+get_screen_root_gdk_window (GdkScreen *screen)
 {
-	static GdkWindow *root_window = NULL;
+	GdkWindow *root_window;
 
+	root_window = g_object_get_data (G_OBJECT (screen), "xsri-root-window");
 	if (!root_window) {
-		Window root_xwindow = get_root_xwindow ();
+		GdkDisplay *display = gdk_screen_get_display (screen);
+		Window root_xwindow = get_screen_root_xwindow (screen);
 
-		root_window = gdk_window_lookup (root_xwindow);
+		root_window = gdk_window_lookup_for_display (display, root_xwindow);
 		if (!root_window)
-			root_window = gdk_window_foreign_new (root_xwindow);
+			root_window = gdk_window_foreign_new_for_display (display, root_xwindow);
+
+		g_object_set_data (G_OBJECT (screen), "xsri-root-window", root_window);
 	}
 
 	return root_window;
 }
 
+Window
+get_root_xwindow (void)
+{
+	return get_screen_root_xwindow (gdk_screen_get_default ());
+}
+
+GdkWindow *
+get_root_gdk_window (void)
+{
+	return get_screen_root_gdk_window (gdk_screen_get_default ());
+}
@@ -18,29 +18,184 @@
 #include <gdk/gdk.h>
 
 typedef struct _BGState BGState;
+typedef struct _BGImage BGImage;
 
+/* Scratch memory and GCs kept between renders, so that rendering
+ * again, as --run and --test do, doesn't allocate and fault in fresh
+ * screen-sized buffers each time. A context may only be used by one
+ * thread at a time. The render functions also accept NULL, in which
+ * case everything is allocated for that call.
+ */
+typedef struct _BGRenderContext BGRenderContext;
+
+/* An image converted once at load time into the form the compositor
+ * works in: premultiplied RGBA, 8 bits per channel, with each row
+ * starting on a 16 byte boundary and the overall alpha already
+ * multiplied in.
+ */
+struct _BGImage {
+	gint       width;
+	gint       height;
+	gint       rowstride;
+	gboolean   opaque;		/* every pixel has alpha 255 */
+	guchar    *pixels;
+
+	/*< private >*/
+	gint       ref_count;
+	BGImage   *half;		/* next level of the mip pyramid */
+	GSList    *scaled;
+	GSList    *blurred;
+	gint       blur_key;		/* how this was blurred, if it is in a blurred list */
+	BGImage   *normals;		/* packed surface normals, for embossing */
+	gdouble    normals_depth;
+	BGImage   *period;		/* laid out as a tile, see BGTileMode */
+	gint       period_key;
+	gpointer   mapping;		/* if pixels point into a mapped file */
+	gsize      mapping_size;
+};
+
+typedef enum {
+	BG_GRADIENT_LINEAR,
+	BG_GRADIENT_CIRCLE,		/* reaching the farthest corner */
+	BG_GRADIENT_ELLIPSE		/* with the screen's proportions */
+} BGGradientType;
+
+#define BG_MAX_GRADIENT_STOPS 16
+
+typedef struct {
+	GdkColor   color;
+	gdouble    offset;		/* 0.0 to 1.0, not decreasing */
+} BGGradientStop;
+
+/* How copies of the tile are laid out to repeat: as they are, every
+ * other one mirrored across, down or both, or with every other row
+ * moved along by half a tile.
+ */
+typedef enum {
+	BG_TILE_REPEAT,
+	BG_TILE_MIRROR,
+	BG_TILE_MIRROR_X,
+	BG_TILE_MIRROR_Y,
+	BG_TILE_BRICK
+} BGTileMode;
+
+#define BG_MAX_LAYERS 32
+#define BG_LAYER_GRID 8
+
+/* An image drawn over the emblem, placed and scaled like it */
+typedef struct {
+	BGImage   *image;
+	gint       x;
+	gint       y;
+	gint       width;
+	gint       height;
+	gboolean   emboss;
+	gint       blur;
+} BGLayer;
+
+/* If grad is set, the background is a gradient through stops, or from
+ * bgColor1 to bgColor2 if there are fewer than two stops; otherwise it
+ * is bgColor1. Linear gradients run in the direction of angle, in
+ * degrees clockwise from up; radial ones from the center of the screen
+ * outwards.
+ *
+ * The tile is scaled to tile_width by tile_height, then turned
+ * clockwise by tile_rotation, a multiple of 90 degrees, and repeated
+ * as tile_mode says.
+ *
+ * The blur radii are in screen pixels, 0 for none: the tile and the
+ * emblem are blurred on their own at the size they are drawn at, the
+ * tile wrapping around the edges of its period; blur applies to the
+ * finished background.
+ *
+ * Embossing lights the emblem and layers from light_angle degrees
+ * clockwise from up, light_elevation degrees above the screen; 315
+ * and about 35.26 give the classic look. emboss_depth multiplies the
+ * slopes, 1 being the usual.
+ *
+ * The layers are drawn over the emblem, bottom first. layer_cells
+ * divides the screen into BG_LAYER_GRID by BG_LAYER_GRID cells, each
+ * a mask of the layers touching it, so that drawing part of the screen
+ * only looks at the layers there; background_index_layers() sets it.
+ */
 struct _BGState {
 	gint       width;
 	gint       height;
 	GdkColor   bgColor1, bgColor2;
 	gboolean   grad;
 	gboolean   emboss;
+	gdouble    light_angle;
+	gdouble    light_elevation;
+	gdouble    emboss_depth;
 	gboolean   vertical;
-	GdkPixbuf *tile_pixbuf;
-	gint       tile_alpha;
+	gint       tile_blur;
+	gint       emblem_blur;
+	gint       blur;
+	BGGradientType gradient_type;
+	gdouble    angle;
+	gint       n_stops;
+	BGGradientStop stops[BG_MAX_GRADIENT_STOPS];
+	BGImage   *tile_image;
 	gint       tile_width;
 	gint       tile_height;
-	GdkPixbuf *emblem_pixbuf;
-	gint       emblem_alpha;
+	BGTileMode tile_mode;
+	gint       tile_rotation;
+	BGImage   *emblem_image;
 	gint       emblem_x;
 	gint       emblem_y;
 	gint       emblem_width;
 	gint       emblem_height;
+	gint       n_layers;
+	BGLayer    layers[BG_MAX_LAYERS];
+	guint32    layer_cells[BG_LAYER_GRID * BG_LAYER_GRID];
 };
 
-GdkPixmap *make_root_pixmap (gint width, gint height);
+/* Besides the pixmap in _XROOTPMAP_ID, --set publishes the rendered
+ * background in a POSIX shared memory object, so that clients can
+ * mmap() it instead of fetching the pixmap with XGetImage(). The
+ * _XSRI_BACKGROUND_SHM property (type STRING) on the root window holds
+ * the name to pass to shm_open(). The object starts with an
+ * XsriBufferHeader; the pixels follow at pixel_offset, rowstride
+ * bytes per row, each pixel a native endian 32 bit word 0xffRRGGBB
+ * (CAIRO_FORMAT_RGB24). As with the root pixmap, the image is tiled
+ * if it is smaller than the screen. A new object is created each time
+ * the background is set and the previous one unlinked, so an existing
+ * mapping stays valid; watch the property to find out about changes.
+ * The header's pixmap is the XID of the pixmap the buffer shows; if it
+ * isn't the one in _XROOTPMAP_ID, someone else has set the background
+ * since and the buffer is out of date. xsri --run, which doesn't keep
+ * a buffer, deletes the property.
+ *
+ * The same header starts the raw image files written by --convert,
+ * which are mapped straight into a BGImage: the format is then
+ * XSRI_BUFFER_PREMULTIPLIED_RGBA, bytes R, G, B, A per pixel, with
+ * rowstride and pixel_offset multiples of 16.
+ */
+#define XSRI_BUFFER_MAGIC   0x49525358	/* "XSRI" */
+#define XSRI_BUFFER_VERSION 1
+#define XSRI_BUFFER_XRGB32  1
+#define XSRI_BUFFER_PREMULTIPLIED_RGBA 2
+
+#define XSRI_BUFFER_OPAQUE  (1 << 0)	/* flags: every pixel has alpha 255 */
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	guint32 format;
+	guint32 width;
+	guint32 height;
+	guint32 rowstride;
+	guint32 pixel_offset;
+	guint32 flags;
+	guint32 pixmap;		/* XID of the root pixmap, 0 in raw files */
+} XsriBufferHeader;
+
+GdkPixmap *make_root_pixmap (GdkScreen *screen, gint width, gint height);
 void       dispose_root_pixmap (GdkPixmap *pixmap);
-void       set_root_pixmap (GdkPixmap *pixmap);
+void       set_root_pixmap (GdkScreen *screen, GdkPixmap *pixmap);
+void       set_root_buffer (GdkScreen *screen, GdkPixmap *pixmap, GdkPixbuf *pixbuf);
+void       unset_root_buffer (GdkScreen *screen);
+GdkPixbuf *get_root_pixbuf (GdkScreen *screen);
 
 void render_to_drawable (GdkPixbuf *pixbuf,
 			 GdkDrawable *drawable, GdkGC *gc,
@@ -50,19 +205,95 @@ void render_to_drawable (GdkPixbuf *pixbuf,
 			 GdkRgbDither dither,
 			 int x_dither, int y_dither);
 
+BGImage *bg_image_new_from_pixbuf (GdkPixbuf *pixbuf,
+				    gint       overall_alpha);
+BGImage *bg_image_new_from_surface (cairo_surface_t *surface,
+				    gint             overall_alpha);
+BGImage *bg_image_ref             (BGImage   *image);
+void     bg_image_unref           (BGImage   *image);
+gsize    bg_image_get_memory      (BGImage   *image);
+void     bg_image_drop_caches     (BGImage   *image);
+gint     bg_image_write_page_file (BGImage    *image,
+				   const char *dir,
+				   GError    **error);
+gboolean bg_image_page_out        (BGImage    *image,
+				   gint        fd,
+				   GError    **error);
+
+/* Called as rows y to y + height - 1 of an image being decoded by
+ * bg_image_new_from_file() are filled in.
+ */
+typedef void (*BGImageRowsFunc) (BGImage *image,
+				 gint     y,
+				 gint     height,
+				 gpointer data);
+
+BGImage *bg_image_new_from_file (const char     *filename,
+				 gint            width,
+				 gint            height,
+				 GdkRectangle   *clip,
+				 gint            overall_alpha,
+				 BGImageRowsFunc rows_func,
+				 gpointer        data,
+				 GError        **error);
+
+gboolean bg_image_file_is_raw       (const char *filename);
+BGImage *bg_image_new_from_raw_file (const char *filename,
+				      gint        overall_alpha,
+				      GError    **error);
+gboolean bg_image_save_raw          (BGImage    *image,
+				      const char *filename,
+				      GError    **error);
+
 gulong xpixel_from_color (GdkColor *color);
 void   xpixel_to_color (gulong pixel, GdkColor *color);
 
-void     background_render        (BGState     *state,
-				   GdkDrawable *drawable,
-				   gboolean     tile_only,
-				   gint         x,
-				   gint         y,
-				   gint         width,
-				   gint         height);
+BGRenderContext *bg_render_context_new  (void);
+void             bg_render_context_free (BGRenderContext *context);
+void             bg_render_context_trim (BGRenderContext *context);
+void             bg_render_context_set_max_threads (BGRenderContext *context,
+						    gint             max_threads);
+GdkGC           *bg_render_context_get_gc (BGRenderContext *context,
+					   GdkDrawable     *drawable);
+
+void     background_render_to_pixbuf (BGRenderContext *context,
+				      BGState         *state,
+				      GdkPixbuf       *pixbuf,
+				      gboolean         tile_only,
+				      gint             x,
+				      gint             y);
+GdkPixbuf *background_render_pixbuf (BGRenderContext *context,
+				     BGState         *state,
+				     gboolean         tile_only,
+				     gint             x,
+				     gint             y,
+				     gint             width,
+				     gint             height);
+void     background_render_emblem (BGRenderContext *context,
+				   BGState         *state,
+				   GdkPixbuf       *pixbuf,
+				   gint             x,
+				   gint             y);
+void     background_draw_pixbuf   (BGRenderContext *context,
+				   GdkPixbuf       *pixbuf,
+				   GdkDrawable     *drawable,
+				   gint             x,
+				   gint             y);
+void     background_render        (BGRenderContext *context,
+				   BGState         *state,
+				   GdkDrawable     *drawable,
+				   gboolean         tile_only,
+				   gint             x,
+				   gint             y,
+				   gint             width,
+				   gint             height);
 gboolean background_get_tile_size (BGState     *state,
+				   GdkVisual   *visual,
 				   int         *width_return,
 				   int         *height_return);
+void     background_index_layers  (BGState     *state);
 
 GdkWindow *get_root_gdk_window (void);
 Window     get_root_xwindow    (void);
+GdkWindow *get_screen_root_gdk_window (GdkScreen *screen);
+Window     get_screen_root_xwindow    (GdkScreen *screen);
@@ -0,0 +1,95 @@
+/* compare-images: check that two images are the same within a tolerance
+ *
+ * Usage: compare-images MAX MEAN EXPECTED ACTUAL
+ *
+ * Fails if any channel of any pixel differs by more than MAX, or the
+ * differences average more than MEAN, which is what lets the dithering
+ * of a 16 bit screen through while still catching a shifted gradient.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+static GdkPixbuf *
+load (const char *filename)
+{
+        GError *error = NULL;
+        GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file (filename, &error);
+
+        if (!pixbuf) {
+                fprintf (stderr, "compare-images: Cannot load %s: %s\n", filename, error->message);
+                g_error_free (error);
+                exit (2);
+        }
+
+        return pixbuf;
+}
+
+int
+main (int argc, char **argv)
+{
+        GdkPixbuf *expected, *actual;
+        int width, height, i, j, c;
+        int max_allowed, max_diff = 0;
+        double mean_allowed, mean_diff;
+        guint64 total = 0;
+        int worst_x = 0, worst_y = 0;
+
+        if (argc != 5) {
+                fprintf (stderr, "Usage: compare-images MAX MEAN EXPECTED ACTUAL\n");
+                return 2;
+        }
+
+#if !GLIB_CHECK_VERSION (2, 36, 0)
+        g_type_init ();
+#endif
+
+        max_allowed = atoi (argv[1]);
+        mean_allowed = g_ascii_strtod (argv[2], NULL);
+        expected = load (argv[3]);
+        actual = load (argv[4]);
+
+        width = gdk_pixbuf_get_width (expected);
+        height = gdk_pixbuf_get_height (expected);
+
+        if (gdk_pixbuf_get_width (actual) != width || gdk_pixbuf_get_height (actual) != height) {
+                fprintf (stderr, "compare-images: %s is %dx%d, expected %dx%d\n", argv[4],
+                         gdk_pixbuf_get_width (actual), gdk_pixbuf_get_height (actual),
+                         width, height);
+                return 1;
+        }
+
+        for (j = 0; j < height; j++) {
+                const guchar *e = gdk_pixbuf_get_pixels (expected) + j * gdk_pixbuf_get_rowstride (expected);
+                const guchar *a = gdk_pixbuf_get_pixels (actual) + j * gdk_pixbuf_get_rowstride (actual);
+
+                for (i = 0; i < width; i++) {
+                        for (c = 0; c < 3; c++) {
+                                int diff = abs (e[c] - a[c]);
+
+                                total += diff;
+                                if (diff > max_diff) {
+                                        max_diff = diff;
+                                        worst_x = i;
+                                        worst_y = j;
+                                }
+                        }
+
+                        e += gdk_pixbuf_get_n_channels (expected);
+                        a += gdk_pixbuf_get_n_channels (actual);
+                }
+        }
+
+        mean_diff = (double)total / (3. * width * height);
+
+        if (max_diff > max_allowed || mean_diff > mean_allowed) {
+                fprintf (stderr, "compare-images: %s differs from %s by up to %d (at %d,%d), "
+                         "%.2f on average; allowed %d, %.2f\n",
+                         argv[4], argv[3], max_diff, worst_x, worst_y, mean_diff,
+                         max_allowed, mean_allowed);
+                return 1;
+        }
+
+        return 0;
+}
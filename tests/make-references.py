@@ -0,0 +1,469 @@
+#!/usr/bin/env python3
+#
+# Writes the input images in images/ and, for each line of cases, the
+# reference image in reference/ that run-tests.sh compares against.
+#
+# The references are worked out here, not by running xsri, so that a
+# change to the renderer can't quietly change what it is checked
+# against. Gradients, premultiplying, compositing, scaling and
+# embossing follow the arithmetic of render-background.c, and the
+# emblem is placed as position_emblem() in xsri.c places it; if those
+# are meant to change, change them here too, or bless what xsri draws
+# with XSRI_BLESS=1 make check.
+#
+# Only the options used in cases are understood.
+
+import math
+import os
+import re
+import struct
+import sys
+import zlib
+
+WIDTH = 320
+HEIGHT = 240
+
+LINEAR_LUT_SIZE = 4096
+GRADIENT_SHIFT = 8
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+
+def write_png(filename, width, height, rows, alpha):
+    channels = 4 if alpha else 3
+    raw = b"".join(b"\0" + bytes(row) for row in rows)
+    assert all(len(row) == width * channels for row in rows)
+
+    def chunk(kind, data):
+        return (struct.pack(">I", len(data)) + kind + data +
+                struct.pack(">I", zlib.crc32(kind + data) & 0xffffffff))
+
+    header = struct.pack(">IIBBBBB", width, height, 8, 6 if alpha else 2, 0, 0, 0)
+    with open(filename, "wb") as f:
+        f.write(b"\x89PNG\r\n\x1a\n")
+        f.write(chunk(b"IHDR", header))
+        f.write(chunk(b"IDAT", zlib.compress(raw, 9)))
+        f.write(chunk(b"IEND", b""))
+
+
+# Inputs. The tile is opaque and different in each corner, so that
+# every way of mirroring it shows; the emblem has a soft edge, to check
+# compositing as well as placement. The boss has hard edges from black
+# to transparent, the steepest slopes there can be, for embossing.
+
+TILE_WIDTH, TILE_HEIGHT = 40, 30
+EMBLEM_WIDTH, EMBLEM_HEIGHT = 64, 48
+BOSS_SIZE = 48
+
+
+def tile_pixel(x, y):
+    return (x * 255 // (TILE_WIDTH - 1),
+            y * 255 // (TILE_HEIGHT - 1),
+            255 if (x < 10 and y < 10) else 64)
+
+
+def emblem_pixel(x, y):
+    dx = (x - (EMBLEM_WIDTH - 1) / 2) / (EMBLEM_WIDTH / 2)
+    dy = (y - (EMBLEM_HEIGHT - 1) / 2) / (EMBLEM_HEIGHT / 2)
+    r = math.sqrt(dx * dx + dy * dy)
+    alpha = int(max(0.0, min(1.0, (1.0 - r) * 4)) * 255 + 0.5)
+    return (255, 255 - x * 2, y * 5, alpha)
+
+
+def boss_pixel(x, y):
+    r = math.hypot(x - (BOSS_SIZE - 1) / 2, y - (BOSS_SIZE - 1) / 2)
+    return (0, 0, 0, 255) if 8 <= r <= 18 else (0, 0, 0, 0)
+
+
+EMBLEMS = {
+    "images/emblem.png": (EMBLEM_WIDTH, EMBLEM_HEIGHT, emblem_pixel),
+    "images/boss.png": (BOSS_SIZE, BOSS_SIZE, boss_pixel),
+}
+
+
+def make_inputs():
+    write_png(os.path.join(here, "images", "tile.png"), TILE_WIDTH, TILE_HEIGHT,
+              [[c for x in range(TILE_WIDTH) for c in tile_pixel(x, y)]
+               for y in range(TILE_HEIGHT)], False)
+    for filename, (width, height, pixel) in EMBLEMS.items():
+        write_png(os.path.join(here, filename), width, height,
+                  [[c for x in range(width) for c in pixel(x, y)]
+                   for y in range(height)], True)
+
+
+# The model
+
+def parse_color(spec):
+    if len(spec) != 7 or spec[0] != "#":
+        sys.exit("cannot parse color: %s" % spec)
+    # As gdk_color_parse(), #rrggbb is 0xrrrr, 0xgggg, 0xbbbb
+    return tuple(int(spec[i:i + 2], 16) * 257 for i in (1, 3, 5))
+
+
+def gradient(color1, color2, angle):
+    lut = []
+    for i in range(LINEAR_LUT_SIZE):
+        t = i / (LINEAR_LUT_SIZE - 1)
+        lut.append(tuple((int(c1 + t * (c2 - c1) + 0.5) >> 8)
+                         for c1, c2 in zip(color1, color2)))
+
+    scale = (LINEAR_LUT_SIZE - 1) * (1 << GRADIENT_SHIFT)
+    cx = (WIDTH - 1) / 2
+    cy = (HEIGHT - 1) / 2
+    a = angle * math.pi / 180
+    sin_a = math.sin(a)
+    cos_a = -math.cos(a)
+    if abs(sin_a) < 1e-9:
+        sin_a = 0
+    if abs(cos_a) < 1e-9:
+        cos_a = 0
+    length = max(abs((WIDTH - 1) * sin_a) + abs((HEIGHT - 1) * cos_a), 1.0)
+
+    offsets = [math.floor((x - cx) * sin_a / length * scale + 0.5) for x in range(WIDTH)]
+    row_step = cos_a / length * scale
+    row_start = (0.5 - cy * cos_a / length) * scale + (1 << (GRADIENT_SHIFT - 1))
+
+    pixels = []
+    for y in range(HEIGHT):
+        base = math.floor(row_start + y * row_step)
+        pixels.append([lut[max(0, min((o + base) >> GRADIENT_SHIFT, LINEAR_LUT_SIZE - 1))]
+                       for o in offsets])
+    return pixels
+
+
+def mirror_index(i, size, mirror):
+    i %= 2 * size if mirror else size
+    return 2 * size - 1 - i if i >= size else i
+
+
+def cdiv(a, b):
+    """Integer division as in C, rounding towards zero"""
+    q = abs(a) // abs(b)
+    return q if (a >= 0) == (b >= 0) else -q
+
+
+def mul_un8(a, b):
+    t = a * b + 0x80
+    return (t + (t >> 8)) >> 8
+
+
+def premultiply(pixel, overall_alpha):
+    r, g, b, a = pixel if len(pixel) == 4 else pixel + (255,)
+    a = mul_un8(a, overall_alpha)
+    return (mul_un8(r, a), mul_un8(g, a), mul_un8(b, a), a)
+
+
+def composite(dest, src):
+    inv_a = 255 - src[3]
+    return tuple(s + mul_un8(d, inv_a) for s, d in zip(src, dest))
+
+
+# Scaling, as bg_image_get_scaled(): halve while the result is still at
+# least the size wanted, then a bilinear step. Images are lists of rows
+# of premultiplied RGBA tuples.
+
+def half(image):
+    height, width = len(image), len(image[0])
+    result = []
+    for j in range((height + 1) // 2):
+        row0 = image[2 * j]
+        row1 = image[2 * j + 1] if 2 * j + 1 < height else row0
+        row = []
+        for i in range((width + 1) // 2):
+            x0 = 2 * i
+            x1 = min(x0 + 1, width - 1)
+            row.append(tuple((row0[x0][c] + row0[x1][c] + row1[x0][c] + row1[x1][c] + 2) >> 2
+                             for c in range(4)))
+        result.append(row)
+    return result
+
+
+def offsets(dest_size, src_size):
+    return [max(0, min(((2 * i + 1) * src_size * 256) // (2 * dest_size) - 128,
+                       (src_size - 1) * 256))
+            for i in range(dest_size)]
+
+
+def scaled(image, width, height):
+    while (len(image[0]) > 1 and len(image) > 1 and
+           (len(image[0]) + 1) // 2 >= width and (len(image) + 1) // 2 >= height):
+        image = half(image)
+    if len(image[0]) == width and len(image) == height:
+        return image
+
+    src_width, src_height = len(image[0]), len(image)
+    x_offsets = offsets(width, src_width)
+    result = []
+    for y in offsets(height, src_height):
+        y0 = y >> 8
+        y1 = min(y0 + 1, src_height - 1)
+        weight = y & 0xff
+        row = [tuple((a * (256 - weight) + b * weight + 128) >> 8 for a, b in zip(p0, p1))
+               for p0, p1 in zip(image[y0], image[y1])]
+        out = []
+        for x in x_offsets:
+            x0 = x >> 8
+            x1 = min(x0 + 1, src_width - 1)
+            w1 = x & 0xff
+            out.append(tuple((a * (256 - w1) + b * w1 + 128) >> 8 for a, b in zip(row[x0], row[x1])))
+        result.append(out)
+    return result
+
+
+# Embossing, as compute_normals() and emboss()
+
+RMAX = 3 * 1024
+NORMAL_SCALE = 1023
+SHADE_SHIFT = 20
+
+
+def emboss(pixels, boss, x_offset, y_offset, light_angle, light_elevation, depth):
+    height, width = len(boss), len(boss[0])
+    gray = [[p[0] + p[1] + p[2] + 3 * (255 - p[3]) for p in row] for row in boss]
+
+    scale = (1 << SHADE_SHIFT) / NORMAL_SCALE
+    slope = math.tan(light_elevation * math.pi / 180)
+    cx = int(scale * math.sin(light_angle * math.pi / 180) / slope)
+    cy = int(scale * math.cos(light_angle * math.pi / 180) / slope)
+    cz = int(scale)
+
+    for j in range(height):
+        for i in range(width):
+            if i == 0 or j == 0 or i == width - 1 or j == height - 1:
+                nx, ny, nz = 0, 0, NORMAL_SCALE
+            else:
+                dx = int(depth * (gray[j][i + 1] - gray[j][i - 1]))
+                dy = int(depth * (gray[j - 1][i] - gray[j + 1][i]))
+                t = dx * dx + dy * dy
+                if t > RMAX * RMAX:
+                    sqrt_t = math.sqrt(t)
+                    dz = 0
+                    dx = int(RMAX * dx / sqrt_t)
+                    dy = int(RMAX * dy / sqrt_t)
+                else:
+                    dz = int(math.sqrt(RMAX * RMAX - t))
+                nx = cdiv(dx * NORMAL_SCALE, RMAX)
+                ny = cdiv(dy * NORMAL_SCALE, RMAX)
+                nz = cdiv(dz * NORMAL_SCALE, RMAX)
+
+            x, y = x_offset + i, y_offset + j
+            if not (0 <= x < WIDTH and 0 <= y < HEIGHT):
+                continue
+            shade = nx * cx + ny * cy + nz * cz
+            if shade > 0:
+                pixels[y][x] = tuple(min((c * shade + (1 << (SHADE_SHIFT - 1))) >> SHADE_SHIFT, 255)
+                                     for c in pixels[y][x])
+            else:
+                pixels[y][x] = (0, 0, 0)
+
+
+# Placement, as position_emblem() in xsri.c
+
+def parse_geometry(spec):
+    """As XParseGeometry(): (width, height, x, y, x_negative, y_negative),
+    with None for what isn't given"""
+    m = re.match(r"^=?(?:(\d+)[xX](\d+))?(?:([+-])(-?\d+)([+-])(-?\d+))?$", spec)
+    if not m:
+        sys.exit("cannot parse geometry: %s" % spec)
+    width, height, xs, x, ys, y = m.groups()
+    return (width and int(width), height and int(height),
+            x and (int(x) if xs == "+" else -int(x)),
+            y and (int(y) if ys == "+" else -int(y)),
+            xs == "-", ys == "-")
+
+
+def position_emblem(image_width, image_height, geometry, center_x, center_y, avoid):
+    gw, gh, gx, gy, x_negative, y_negative = (parse_geometry(geometry) if geometry
+                                              else (None,) * 6)
+    width = gw if gw is not None else image_width
+    height = gh if gh is not None else image_height
+
+    if center_x:
+        x, gravity_x = cdiv(WIDTH - width, 2), 0
+    elif gx is not None:
+        x, gravity_x = (WIDTH - width + gx, 1) if x_negative else (gx, -1)
+    else:
+        x, gravity_x = 0, -1
+
+    if center_y:
+        y, gravity_y = cdiv(HEIGHT - height, 2), 0
+    elif gy is not None:
+        y, gravity_y = (HEIGHT - height + gy, 1) if y_negative else (gy, -1)
+    else:
+        y, gravity_y = 0, -1
+
+    if not avoid:
+        return x, y, width, height
+
+    if width * image_height > image_width * height:
+        new_width = cdiv(height * image_width, image_height)
+        if gravity_x == 0:
+            x += cdiv(width - new_width, 2)
+        elif gravity_x == 1:
+            x += width - new_width
+        width = new_width
+    elif width * image_height < image_width * height:
+        new_height = cdiv(width * image_height, image_width)
+        if gravity_y == 0:
+            y += cdiv(height - new_height, 2)
+        elif gravity_y == 1:
+            y += height - new_height
+        height = new_height
+
+    avoid_width, avoid_height, avoid_x, avoid_y, ax_negative, ay_negative = parse_geometry(avoid)
+    if avoid_x is None:
+        avoid_x = cdiv(WIDTH - avoid_width, 2)
+    elif ax_negative:
+        avoid_x = WIDTH - avoid_width + avoid_x
+    if avoid_y is None:
+        avoid_y = cdiv(HEIGHT - avoid_height, 2)
+    elif ay_negative:
+        avoid_y = HEIGHT - avoid_height + avoid_y
+
+    if gravity_x == 1 or (gravity_x == 0 and x + cdiv(width, 2) > avoid_x + avoid_width):
+        tmp_x = WIDTH - width - x
+        avoid_x = WIDTH - avoid_width - avoid_x
+    else:
+        tmp_x = x
+    if gravity_y == 1 or (gravity_y == 0 and y + cdiv(height, 2) > avoid_y + avoid_height):
+        tmp_y = HEIGHT - height - y
+        avoid_y = HEIGHT - avoid_height - avoid_y
+    else:
+        tmp_y = y
+
+    if (tmp_x + width < avoid_x or tmp_x >= avoid_x + avoid_width or
+            tmp_y + height < avoid_y or tmp_y >= avoid_y + avoid_height):
+        return x, y, width, height
+
+    x_space = 2 * (avoid_x - (tmp_x + cdiv(width, 2))) if gravity_x == 0 else avoid_x - tmp_x
+    # Sic: width, as position_emblem() has it
+    y_space = 2 * (avoid_y - (tmp_y + cdiv(width, 2))) if gravity_y == 0 else avoid_y - tmp_y
+    if x_space <= 0 and y_space <= 0:
+        sys.exit("make-references.py: the emblem can't be kept clear of --avoid=%s" % avoid)
+
+    if x_space * image_height > y_space * image_width:
+        new_width = x_space
+        new_height = cdiv(image_height * x_space, image_width)
+    else:
+        new_height = y_space
+        new_width = cdiv(image_width * y_space, image_height)
+
+    if gravity_x == 0:
+        x += cdiv(width - new_width, 2)
+    elif gravity_x == 1:
+        x += width - new_width
+    if gravity_y == 0:
+        y += cdiv(height - new_height, 2)
+    elif gravity_y == 1:
+        y += height - new_height
+
+    return x, y, new_width, new_height
+
+
+def render(options):
+    color1 = (0, 0, 0)
+    color2 = None
+    angle = 180
+    tile = None
+    tile_mode = "repeat"
+    tile_alpha = 255
+    emblem = None
+    emblem_alpha = 255
+    geometry = avoid = None
+    center_x = center_y = False
+    embossed = False
+    emboss_depth = 1.0
+
+    for option in options:
+        name, _, value = option.partition("=")
+        if name == "--color":
+            color1 = parse_color(value)
+        elif name == "--color2":
+            color2 = parse_color(value)
+        elif name == "--vgradient":
+            angle = 180
+        elif name == "--hgradient":
+            angle = 90
+        elif name == "--angle":
+            angle = float(value)
+        elif name == "--tile":
+            tile = value
+        elif name == "--tile-mode":
+            tile_mode = value
+        elif name == "--tile-alpha":
+            tile_alpha = int(value)
+        elif name == "--emblem":
+            emblem = value
+        elif name == "--emblem-alpha":
+            emblem_alpha = int(value)
+        elif name == "--geometry":
+            geometry = value
+        elif name == "--avoid":
+            avoid = value
+        elif name == "--center-x":
+            center_x = True
+        elif name == "--center-y":
+            center_y = True
+        elif name == "--emboss":
+            embossed = True
+        elif name == "--emboss-depth":
+            emboss_depth = float(value)
+        elif name in ("--set", "--run"):
+            pass
+        else:
+            sys.exit("make-references.py doesn't know %s" % option)
+
+    if color2:
+        pixels = gradient(color1, color2, angle)
+    else:
+        solid = tuple(c >> 8 for c in color1)
+        pixels = [[solid] * WIDTH for y in range(HEIGHT)]
+
+    if tile:
+        if tile != "images/tile.png" or tile_mode not in ("repeat", "mirror"):
+            sys.exit("make-references.py can't draw --tile=%s --tile-mode=%s" % (tile, tile_mode))
+        mirror = tile_mode == "mirror"
+        for y in range(HEIGHT):
+            for x in range(WIDTH):
+                src = premultiply(tile_pixel(mirror_index(x, TILE_WIDTH, mirror),
+                                             mirror_index(y, TILE_HEIGHT, mirror)), tile_alpha)
+                pixels[y][x] = composite(pixels[y][x], src)
+
+    if emblem:
+        if emblem not in EMBLEMS:
+            sys.exit("make-references.py can't draw --emblem=%s" % emblem)
+        width, height, pixel = EMBLEMS[emblem]
+        # --emblem-alpha doesn't apply to an embossed emblem
+        alpha = 255 if embossed else emblem_alpha
+        image = [[premultiply(pixel(x, y), alpha) for x in range(width)]
+                 for y in range(height)]
+        ex, ey, ew, eh = position_emblem(width, height, geometry,
+                                         center_x, center_y, avoid)
+        image = scaled(image, ew, eh)
+        if embossed:
+            emboss(pixels, image, ex, ey, 315, math.asin(1 / math.sqrt(3)) * 180 / math.pi,
+                   emboss_depth)
+        else:
+            for y in range(max(ey, 0), min(ey + eh, HEIGHT)):
+                for x in range(max(ex, 0), min(ex + ew, WIDTH)):
+                    pixels[y][x] = composite(pixels[y][x], image[y - ey][x - ex])
+
+    return pixels
+
+
+def main():
+    make_inputs()
+
+    with open(os.path.join(here, "cases")) as f:
+        for line in f:
+            fields = line.split()
+            if not fields or fields[0].startswith("#"):
+                continue
+            name, options = fields[0], fields[2:]
+            pixels = render(options)
+            write_png(os.path.join(here, "reference", name + ".png"), WIDTH, HEIGHT,
+                      [[c for p in row for c in p] for row in pixels], False)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,198 @@
+#!/bin/sh
+#
+# Golden image tests, run by make check. For each screen depth an
+# Xvfb server is started, each line of cases is set as its background
+# with xsri --set, or shown by xsri --run until it has been read back,
+# and the background is read back with --dump-root and compared with
+# the reference image, within a tolerance for the depth. The render
+# time xsri reports with --debug has to be within the budget the case
+# gives.
+#
+# With XSRI_BLESS=1, what xsri draws at 24 bits is copied over the
+# references instead, and the budgets in cases are set to three times
+# the slowest time measured; look at the result before committing it.
+
+srcdir=${srcdir:-.}
+XSRI=${XSRI:-./xsri}
+COMPARE=${COMPARE:-./compare-images}
+XVFB=${XVFB:-Xvfb}
+SIZE=320x240
+
+# Depth, then the largest and average difference allowed per channel
+MATRIX="24:3:0.5 16:16:4.0"
+
+tests=`cd "$srcdir/tests" && pwd`
+XSRI=`cd \`dirname "$XSRI"\` && pwd`/`basename "$XSRI"`
+COMPARE=`cd \`dirname "$COMPARE"\` && pwd`/`basename "$COMPARE"`
+
+if ! command -v "$XVFB" >/dev/null 2>&1; then
+    echo "$XVFB not found, skipping"
+    exit 77
+fi
+
+tmpdir=`mktemp -d "${TMPDIR:-/tmp}/xsri-check.XXXXXX"` || exit 1
+xvfb_pid=
+
+cleanup () {
+    if [ -n "$xvfb_pid" ]; then
+        kill $xvfb_pid 2>/dev/null
+        wait $xvfb_pid 2>/dev/null
+    fi
+    rm -rf "$tmpdir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Keep any ~/.xsrirc or cache of the user out of it
+HOME=$tmpdir
+XDG_CACHE_HOME=$tmpdir/cache
+export HOME XDG_CACHE_HOME
+
+start_xvfb () {
+    display=99
+    while [ -e /tmp/.X$display-lock ]; do
+        display=`expr $display + 1`
+    done
+
+    "$XVFB" :$display -screen 0 ${SIZE}x$1 -nolisten tcp >"$tmpdir/xvfb.log" 2>&1 &
+    xvfb_pid=$!
+
+    tries=0
+    while [ ! -e /tmp/.X11-unix/X$display ]; do
+        if ! kill -0 $xvfb_pid 2>/dev/null || [ $tries -ge 100 ]; then
+            echo "Cannot start $XVFB at depth $1:"
+            cat "$tmpdir/xvfb.log"
+            exit 1
+        fi
+        sleep 0.1
+        tries=`expr $tries + 1`
+    done
+
+    DISPLAY=:$display
+    export DISPLAY
+}
+
+stop_xvfb () {
+    kill $xvfb_pid
+    wait $xvfb_pid 2>/dev/null
+    xvfb_pid=
+}
+
+# Run xsri with the options of a case, leaving the background shown
+run_case () {
+    case " $* " in
+    *" --run "*)
+        (cd "$tests" && exec "$XSRI" --debug "$@") </dev/null >"$log" 2>&1 &
+        run_pid=$!
+
+        # Up once the first render has been reported and shown
+        tries=0
+        until grep -q 'endered [0-9]*x[0-9]* in' "$log"; do
+            if ! kill -0 $run_pid 2>/dev/null || [ $tries -ge 100 ]; then
+                kill $run_pid 2>/dev/null
+                wait $run_pid 2>/dev/null
+                return 1
+            fi
+            sleep 0.1
+            tries=`expr $tries + 1`
+        done
+        sleep 0.5
+        ;;
+    *)
+        run_pid=
+        (cd "$tests" && "$XSRI" --set --debug "$@") </dev/null >"$log" 2>&1
+        ;;
+    esac
+}
+
+# Stop xsri --run once what it showed has been read back
+end_case () {
+    if [ -n "$run_pid" ]; then
+        kill $run_pid
+        wait $run_pid 2>/dev/null
+    fi
+}
+
+failed=0
+timings=$tmpdir/timings
+: >"$timings"
+set -f
+
+for entry in $MATRIX; do
+    depth=`echo $entry | cut -d: -f1`
+    max=`echo $entry | cut -d: -f2`
+    mean=`echo $entry | cut -d: -f3`
+
+    start_xvfb $depth
+
+    while read name budget options; do
+        case "$name" in
+        ""|\#*) continue ;;
+        esac
+
+        out=$tmpdir/$name-$depth.png
+        log=$tmpdir/$name-$depth.log
+
+        if ! run_case $options ||
+           ! "$XSRI" --dump-root="$out" </dev/null >"$tmpdir/dump.log" 2>&1; then
+            end_case
+            echo "FAIL: $name at $depth bits: xsri failed"
+            cat "$log" "$tmpdir/dump.log"
+            failed=1
+            continue
+        fi
+        end_case
+
+        ms=`sed -n 's/.*endered [0-9]*x[0-9]* in \([0-9.]*\) ms$/\1/p' "$log" | head -n 1`
+
+        if [ "$XSRI_BLESS" = 1 ]; then
+            echo "$name ${ms:-0}" >>"$timings"
+            if [ $depth = 24 ]; then
+                cp "$out" "$tests/reference/$name.png"
+                echo "BLESS: $name"
+            fi
+            continue
+        fi
+
+        ok=1
+        if [ -z "$ms" ]; then
+            echo "FAIL: $name at $depth bits: no render time in the --debug output"
+            cat "$log"
+            ok=0
+        elif awk "BEGIN { exit !($ms > $budget) }"; then
+            echo "FAIL: $name at $depth bits: rendered in $ms ms, budget $budget ms"
+            ok=0
+        fi
+
+        if ! "$COMPARE" $max $mean "$tests/reference/$name.png" "$out"; then
+            echo "FAIL: $name at $depth bits: differs from reference/$name.png"
+            ok=0
+        fi
+
+        if [ $ok = 1 ]; then
+            echo "PASS: $name at $depth bits, $ms ms"
+        else
+            failed=1
+        fi
+    done < "$tests/cases"
+
+    stop_xvfb
+done
+
+if [ "$XSRI_BLESS" = 1 ]; then
+    awk 'FILENAME == ARGV[1] { if ($2 > slowest[$1]) slowest[$1] = $2; next }
+         /^[^#]/ && NF >= 3 && ($1 in slowest) {
+             budget = int (slowest[$1] * 3 + 0.999)
+             if (budget < 2)
+                 budget = 2
+             line = sprintf ("%-15s %-7d", $1, budget)
+             for (i = 3; i <= NF; i++)
+                 line = line " " $i
+             print line
+             next
+         }
+         { print }' "$timings" "$tests/cases" >"$tmpdir/cases" &&
+    cp "$tmpdir/cases" "$tests/cases"
+fi
+
+exit $failed
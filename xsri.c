@@ -1,17 +1,43 @@
 /* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
 
+#include <errno.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/Xatom.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+
+/* Not defined by older C libraries, or without _GNU_SOURCE */
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+#endif
 
 #include <gtk/gtk.h>
 #include <gdk/gdkx.h>
+#include <pango/pangocairo.h>
 #include <popt.h>
 #include <stdarg.h>
 
 #include "config.h"
 
+#ifdef HAVE_XRES
+#include <X11/extensions/XRes.h>
+#endif
+
+#include "file-watch.h"
 #include "render-background.h"
 
 typedef enum {
@@ -31,8 +57,20 @@ static const char *color2 = NULL;
 static const char *geometry = NULL;
 static const char *tile_file = NULL;
 static const char *emblem_file = NULL;
+static const char *text = NULL;
+static const char *text_font = NULL;
+static const char *text_color = NULL;
+#define DEFAULT_TEXT_FONT "Sans 24"
 static int emboss = FALSE;
+static const char *light_angle = NULL;
+static const char *light_elevation = NULL;
+static const char *emboss_depth = NULL;
 static int vertical = TRUE;
+static const char *stops = NULL;
+static const char *angle = NULL;
+static const char *radial = NULL;
+static const char *schedule = NULL;
+static int schedule_interval = 300;
 static int center_x = FALSE;
 static int center_y = FALSE;
 static const char *scale_width = NULL;
@@ -43,6 +81,34 @@ static int debug = FALSE;
 static int dummy = FALSE;
 static int tile_alpha = 255;
 static int emblem_alpha = 255;
+static int tile_blur = 0;
+static const char *tile_mode = NULL;
+static int tile_rotate = 0;
+static int tile_scale = 100;
+static int emblem_blur = 0;
+static int blur = 0;
+static const char *slideshow = NULL;
+static int slideshow_interval = 300;
+static int watch = FALSE;
+static const char *batch = NULL;
+static const char *output = NULL;
+static const char *output_display = NULL;
+static const char *size = NULL;
+static int all_screens = FALSE;
+static const char *convert = NULL;
+static const char *dump_root = NULL;
+static int max_server_memory = 0;
+static int max_cpu = 0;
+static int max_upload_rate = 0;
+static int idle_trim = 30;
+static const char *layer_arg = NULL;
+
+/* The --layer options so far, one per line */
+static const char *layers = NULL;
+
+enum {
+        OPTION_LAYER = 1
+};
 
 static const struct poptOption options_table[] = {
         { "version", 0, POPT_ARG_NONE, &want_my_version, 0,
@@ -55,16 +121,50 @@ static const struct poptOption options_table[] = {
           "use a horizontal gradient" },
         { "vgradient", 0, POPT_ARG_VAL, &vertical, TRUE,
           "use a vertical gradient (default)" },
+        { "stops", 0, POPT_ARG_STRING, &stops, 0,
+          "gradient through several colors, each optionally at a percentage of the way", "COLOR[@PERCENT],..." },
+        { "angle", 0, POPT_ARG_STRING, &angle, 0,
+          "direction of the gradient, clockwise from up (vertical is 180)", "DEGREES" },
+        { "radial", 0, POPT_ARG_STRING, &radial, 0,
+          "radial gradient from the center of the screen", "circle|ellipse" },
+        { "schedule", 0, POPT_ARG_STRING, &schedule, 0,
+          "change the colors through the day, blending between the given times", "HH:MM=COLOR[/COLOR2],..." },
+        { "schedule-interval", 0, POPT_ARG_INT, &schedule_interval, 0,
+          "with --run, seconds between checks of the --schedule colors (default 300)", "SECONDS" },
         { "tile", 0, POPT_ARG_STRING, &tile_file, 0,
           "image file to tile across screen", "FILE" },
         { "tile-alpha", 0, POPT_ARG_INT, &tile_alpha, 0,
           "alpha value for tile image", "0-255" },
+        { "tile-blur", 0, POPT_ARG_INT, &tile_blur, 0,
+          "blur the tile image by this many pixels", "RADIUS" },
+        { "tile-mode", 0, POPT_ARG_STRING, &tile_mode, 0,
+          "how copies of the tile are laid out (default repeat)", "repeat|mirror|mirror-x|mirror-y|offset-brick" },
+        { "tile-rotate", 0, POPT_ARG_INT, &tile_rotate, 0,
+          "turn the tile clockwise by this many degrees", "0|90|180|270" },
+        { "tile-scale", 0, POPT_ARG_INT, &tile_scale, 0,
+          "scale the tile to this percentage of its size (default 100)", "PERCENT" },
         { "emblem", 0, POPT_ARG_STRING, &emblem_file, 0,
           "image file to place on top of the gradient and tile", "FILE" },
+        { "text", 0, POPT_ARG_STRING, &text, 0,
+          "text to show in place of the emblem image; %h is the host name, %u the user name", "TEXT" },
+        { "text-font", 0, POPT_ARG_STRING, &text_font, 0,
+          "font for --text (default \"" DEFAULT_TEXT_FONT "\")", "FONT" },
+        { "text-color", 0, POPT_ARG_STRING, &text_color, 0,
+          "color for --text (default white)", "COLOR" },
         { "emblem-alpha", 0, POPT_ARG_INT, &emblem_alpha, 0,
           "alpha value for emblem image", "0-255" },
         { "emboss", 0, POPT_ARG_NONE, &emboss, 0,
           "emboss emblem" },
+        { "light-angle", 0, POPT_ARG_STRING, &light_angle, 0,
+          "with --emboss, where the light comes from, clockwise from up (default 315)", "DEGREES" },
+        { "light-elevation", 0, POPT_ARG_STRING, &light_elevation, 0,
+          "with --emboss, how high the light is above the screen (default 35.26)", "DEGREES" },
+        { "emboss-depth", 0, POPT_ARG_STRING, &emboss_depth, 0,
+          "with --emboss, how deep the embossing looks (default 1)", "FACTOR" },
+        { "emblem-blur", 0, POPT_ARG_INT, &emblem_blur, 0,
+          "blur the emblem image by this many pixels", "RADIUS" },
+        { "blur", 0, POPT_ARG_INT, &blur, 0,
+          "blur the whole background by this many pixels", "RADIUS" },
         { "geometry", 0, POPT_ARG_STRING, &geometry, 0,
           "location and/or size of emblem", "WIDTHxHEIGHT+X+Y" },
         { "center-x", 0, POPT_ARG_NONE, &center_x, 0,
@@ -79,6 +179,36 @@ static const struct poptOption options_table[] = {
           "rectangle to avoid. Emblem is shrunk to achieve this", "WIDTHxHEIGHT+X+Y" },
         { "keep-aspect", 0, POPT_ARG_NONE, &keep_aspect, 0,
           "shrink width or height of emblem to maintain aspect ratio" },
+        { "layer", 0, POPT_ARG_STRING, &layer_arg, OPTION_LAYER,
+          "another image over the emblem, given by emblem options; may be repeated", "OPTIONS" },
+        { "slideshow", 0, POPT_ARG_STRING, &slideshow, 0,
+          "with --run, show the images in a directory or list file in turn as the emblem", "DIR|FILE" },
+        { "interval", 0, POPT_ARG_INT, &slideshow_interval, 0,
+          "seconds between slideshow images (default 300)", "SECONDS" },
+        { "watch", 0, POPT_ARG_NONE, &watch, 0,
+          "with --run, update the background when the images or rc files change" },
+        { "batch", 0, POPT_ARG_STRING, &batch, 0,
+          "render the backgrounds described by the lines of a file, in parallel", "FILE" },
+        { "output", 0, POPT_ARG_STRING, &output, 0,
+          "write the background to an image file instead of setting it", "FILE" },
+        { "output-display", 0, POPT_ARG_STRING, &output_display, 0,
+          "in a --batch file, set the background of this display", "DISPLAY" },
+        { "size", 0, POPT_ARG_STRING, &size, 0,
+          "size of the background for --output (default: the screen size)", "WIDTHxHEIGHT" },
+        { "all-screens", 0, POPT_ARG_NONE, &all_screens, 0,
+          "with --set, set the background of every screen of the display" },
+        { "convert", 0, POPT_ARG_STRING, &convert, 0,
+          "convert the image given as the argument to a raw image, which loads without decoding", "FILE" },
+        { "max-server-memory", 0, POPT_ARG_INT, &max_server_memory, 0,
+          "how much memory the background may take on the X server (default: no limit)", "KB" },
+        { "max-cpu", 0, POPT_ARG_INT, &max_cpu, 0,
+          "with --run, how much of a CPU rendering in the background may use (default: no limit)", "PERCENT" },
+        { "max-upload-rate", 0, POPT_ARG_INT, &max_upload_rate, 0,
+          "with --run, how fast backgrounds rendered again may be sent to the X server (default: no limit)", "KB/S" },
+        { "idle-trim", 0, POPT_ARG_INT, &idle_trim, 0,
+          "with --run, release decoded images and scratch memory after this long without rendering (default 30, 0 for never)", "SECONDS" },
+        { "dump-root", 0, POPT_ARG_STRING, &dump_root, 0,
+          "write the background currently set on the screen to an image file", "FILE" },
         { "set", 0, POPT_ARG_VAL, &run_mode, RUN_MODE_SET,
           "set the desktop background image" },
         { "run", 0, POPT_ARG_VAL, &run_mode, RUN_MODE_RUN,
@@ -105,322 +235,4354 @@ debugmsg (char *format, ...)
         }
 }
 
+/* The render contexts of all threads, so their scratch memory can be
+ * freed when idle
+ */
+static GMutex render_contexts_lock;
+static GSList *render_contexts = NULL;
+
+static void
+free_render_context (gpointer data)
+{
+        g_mutex_lock (&render_contexts_lock);
+        render_contexts = g_slist_remove (render_contexts, data);
+        g_mutex_unlock (&render_contexts_lock);
+
+        bg_render_context_free (data);
+}
+
+static GPrivate render_context = G_PRIVATE_INIT (free_render_context);
+
+/* Each thread that renders keeps its scratch buffers from one render
+ * to the next.
+ */
+static BGRenderContext *
+get_render_context (void)
+{
+        BGRenderContext *context = g_private_get (&render_context);
+
+        if (!context) {
+                context = bg_render_context_new ();
+                g_private_set (&render_context, context);
+
+                g_mutex_lock (&render_contexts_lock);
+                render_contexts = g_slist_prepend (render_contexts, context);
+                g_mutex_unlock (&render_contexts_lock);
+        }
+
+        return context;
+}
+
+/* Free the scratch memory of every thread's render context; no thread
+ * may be rendering.
+ */
 static void
-load_images (void)
+trim_render_contexts (void)
+{
+        GSList *tmp_list;
+
+        g_mutex_lock (&render_contexts_lock);
+        for (tmp_list = render_contexts; tmp_list; tmp_list = tmp_list->next)
+                bg_render_context_trim (tmp_list->data);
+        g_mutex_unlock (&render_contexts_lock);
+}
+
+/* Decode filename, at width x height if width isn't -1, keeping only
+ * the part in clip if clip isn't NULL. Raw images are always loaded
+ * whole, at their own size. Other images are streamed, calling
+ * rows_func, if not NULL, as their rows are decoded.
+ */
+static BGImage *
+decode_image (const char     *filename,
+              const char     *what,
+              int             alpha,
+              int             width,
+              int             height,
+              GdkRectangle   *clip,
+              BGImageRowsFunc rows_func,
+              gpointer        data)
 {
         GError *error = NULL;
-        
-        if (tile_file) {
-                bg_state.tile_pixbuf = gdk_pixbuf_new_from_file (tile_file, &error);
-                if (!bg_state.tile_pixbuf) {
-                        fprintf (stderr, "%s: Cannot load tile image: %s: %s\n",
-                                 appname, tile_file, error->message);
-                
+        BGImage *image;
+
+        if (bg_image_file_is_raw (filename)) {
+                image = bg_image_new_from_raw_file (filename, alpha, &error);
+                if (!image) {
+                        fprintf (stderr, "%s: Cannot load %s image: %s\n",
+                                 appname, what, error->message);
                         g_error_free (error);
-                } else {
-                        bg_state.tile_width = gdk_pixbuf_get_width (bg_state.tile_pixbuf);
-                        bg_state.tile_height = gdk_pixbuf_get_height (bg_state.tile_pixbuf);
                 }
-        } else
-                bg_state.tile_pixbuf = NULL;
 
-        if (tile_alpha < 0 || tile_alpha > 255) {
-                fprintf (stderr, "%s: Invalid alpha value %d\n", appname, tile_alpha);
-                exit (1);
+                return image;
         }
 
-        bg_state.tile_alpha = tile_alpha;
-        
-        if (emblem_file) {
-                bg_state.emblem_pixbuf = gdk_pixbuf_new_from_file (emblem_file, &error);
-                if (!bg_state.emblem_pixbuf) {
-                        fprintf (stderr, "%s: Cannot load emblem image: %s: %s\n",
-                                 appname, emblem_file, error->message);
-                        g_error_free (error);
-                }
-        } else
-                bg_state.emblem_pixbuf = NULL;
-        
-        if (emblem_alpha < 0 || emblem_alpha > 255) {
-                fprintf (stderr, "%s: Invalid emblem alpha value %d\n", appname, emblem_alpha);
-                exit (1);
+        image = bg_image_new_from_file (filename, width, height, clip, alpha,
+                                        rows_func, data, &error);
+        if (!image) {
+                fprintf (stderr, "%s: Cannot load %s image: %s: %s\n",
+                         appname, what, filename, error->message);
+                g_error_free (error);
         }
 
-        bg_state.emblem_alpha = emblem_alpha;
-        
-        bg_state.emboss = emboss;
+        return image;
 }
 
-static void
-parse_colors (void)
+/* Images are decoded once per file, alpha value, size and clip, and
+ * shared between all the configurations that use them. The keys
+ * start with the filename followed by a newline.
+ */
+static GHashTable *image_cache = NULL;
+
+static BGImage *
+load_image (const char   *filename,
+            const char   *what,
+            int           alpha,
+            int           width,
+            int           height,
+            GdkRectangle *clip)
 {
-        bg_state.vertical = vertical;
-        
-        if (color) {
-                if (!gdk_color_parse (color, &bg_state.bgColor1))
-                        fprintf (stderr, "%s: Cannot parse_color: %s\n", appname, color);
-        }
-        if (color2) {
-                if (!gdk_color_parse (color2, &bg_state.bgColor2))
-                        fprintf (stderr, "%s: Cannot parse_color: %s\n", appname, color);
-                else
-                        bg_state.grad = TRUE;
-        }
+        char *key;
+        BGImage *image;
 
-        /* The following code tries to coerce colors to solid colors when close, but
-         * there is some inaccuracy somewhere along the way, and it actually doesnt
-         * quite work.
-         */
-#if 0        
-        if (!bg_state.grad) {
-                GdkColor tmp_color;
-                gint diff;
-                
-                gulong pixel = xpixel_from_color (&bg_state.bgColor1);
-                xpixel_to_color (pixel, &tmp_color);
+        if (clip)
+                key = g_strdup_printf ("%s\n%d %dx%d %dx%d+%d+%d", filename, alpha, width, height,
+                                       clip->width, clip->height, clip->x, clip->y);
+        else
+                key = g_strdup_printf ("%s\n%d %dx%d", filename, alpha, width, height);
 
-                diff = 0;
-                diff = MAX (diff, abs (tmp_color.red - bg_state.bgColor1.red));
-                diff = MAX (diff, abs (tmp_color.green - bg_state.bgColor1.green));
-                diff = MAX (diff, abs (tmp_color.blue - bg_state.bgColor1.blue));
+        if (!image_cache)
+                image_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, (GDestroyNotify)bg_image_unref);
 
-                if (diff < 8 * 0x101)
-                        bg_state.bgColor1 = tmp_color;
+        image = g_hash_table_lookup (image_cache, key);
+        if (image) {
+                g_free (key);
+        } else {
+                image = decode_image (filename, what, alpha, width, height, clip, NULL, NULL);
+                if (!image) {
+                        g_free (key);
+                        return NULL;
+                }
+                g_hash_table_insert (image_cache, key, image);
         }
-#endif
+
+        return bg_image_ref (image);
+}
+
+static gboolean
+image_key_matches (gpointer key,
+                   gpointer value,
+                   gpointer data)
+{
+        size_t len = strlen (data);
+
+        return strncmp (key, data, len) == 0 && ((char *)key)[len] == '\n';
 }
 
+/* Drop filename from the cache, so that it is decoded again when
+ * next loaded.
+ */
 static void
-position_emblem (void)
+forget_image (const char *filename)
 {
-        /* See README for a description of the algorithm
-         */
-        int width, height;
-        int x, y;
-        int gravity_x, gravity_y;
-        int screen_width = gdk_screen_width ();
-        int screen_height = gdk_screen_height ();
-        int image_width = gdk_pixbuf_get_width (bg_state.emblem_pixbuf);
-        int image_height = gdk_pixbuf_get_height (bg_state.emblem_pixbuf);
-        int geometry_flags = 0;
-        int geometry_x = 0;
-        int geometry_y = 0;
-        unsigned int geometry_width = 0;
-        unsigned int geometry_height = 0;
+        if (image_cache && filename)
+                g_hash_table_foreach_remove (image_cache, image_key_matches, (gpointer)filename);
+}
 
-        if (geometry) {
-                geometry_flags = XParseGeometry (geometry, &geometry_x, &geometry_y,
-                                                 &geometry_width, &geometry_height);
+/* In --run mode an animated emblem is kept as a GdkPixbufAnimation;
+ * bg_state.emblem_image then holds its first frame, which is what
+ * gets positioned and what --set or --test would show.
+ */
+static GdkPixbufAnimation *emblem_animation = NULL;
 
-                if (((geometry_flags & WidthValue) && geometry_width == 0) ||
-                    ((geometry_flags & HeightValue) && geometry_height == 0)) {
-                        fprintf (stderr, "%s: Invalid geometry specification: %s\n",
-                                 appname, geometry);
-                        exit (1);
-                }
+/* Set if the rc files have [desktop N] sections and we are in --run mode */
+static gboolean per_desktop = FALSE;
+
+/* Set if --set decodes the emblem while rendering the background
+ * around it, so load_images() leaves it for set_root_streaming()
+ */
+static gboolean stream_emblem = FALSE;
+
+static void load_layers (BGState *state);
+static gboolean position_emblem (BGState *state,
+                                 int      image_width,
+                                 int      image_height);
+
+static void
+load_emblem_animation (BGState *state)
+{
+        GError *error = NULL;
+        GdkPixbufAnimation *animation;
+
+        animation = gdk_pixbuf_animation_new_from_file (emblem_file, &error);
+        if (!animation) {
+                fprintf (stderr, "%s: Cannot load emblem image: %s: %s\n",
+                         appname, emblem_file, error->message);
+                g_error_free (error);
+
+                return;
         }
 
-        if (scale_width) {
-                char *p;
-                double percentage = strtod (scale_width, &p);
+        state->emblem_image = bg_image_new_from_pixbuf (gdk_pixbuf_animation_get_static_image (animation),
+                                                          emboss ? 255 : emblem_alpha);
+        if (!position_emblem (state, state->emblem_image->width, state->emblem_image->height)) {
+                bg_image_unref (state->emblem_image);
+                state->emblem_image = NULL;
+                g_object_unref (animation);
 
-                if (*p || percentage < 0 || percentage > 100) {
-                        fprintf (stderr, "%s: Invalid percentage: %s\n", appname, scale_width);
-                        exit (1);
-                }
+                return;
+        }
 
-                width = 0.5 + screen_width * (percentage / 100.);
-        } else if (geometry_flags & WidthValue)
-                width = geometry_width;
+        if (gdk_pixbuf_animation_is_static_image (animation))
+                g_object_unref (animation);
         else
-                width = image_width;
+                emblem_animation = animation;
+}
 
+/* Place the emblem filename using the size from its header, then
+ * decode it at the size it is shown at, keeping only the part that
+ * is on the screen. Returns NULL if none of it is, or if it can't be
+ * placed clear of --avoid. Uncached images
+ * call rows_func as they are decoded, as for decode_image().
+ */
+static BGImage *
+load_placed_emblem (BGState        *state,
+                    const char     *filename,
+                    const char     *what,
+                    gboolean        cached,
+                    BGImageRowsFunc rows_func,
+                    gpointer        data)
+{
+        GdkRectangle screen_rect, emblem_rect, visible;
+        int image_width, image_height;
+        int alpha = emboss ? 255 : emblem_alpha;
+        BGImage *image;
 
-        if (scale_height) {
-                char *p;
-                double percentage = strtod (scale_height, &p);
+        if (bg_image_file_is_raw (filename) ||
+            !gdk_pixbuf_get_file_info (filename, &image_width, &image_height)) {
+                /* Raw images are mapped whole and scaled while
+                 * compositing. Otherwise, let the loader report the
+                 * problem, in case the header sniffing was wrong
+                 */
+                image = decode_image (filename, what, alpha, -1, -1, NULL, NULL, NULL);
+                if (!image)
+                        return NULL;
 
-                if (*p || percentage < 0 || percentage > 100) {
-                        fprintf (stderr, "%s: Invalid percentage: %s\n", appname, scale_height);
-                        exit (1);
+                if (!position_emblem (state, image->width, image->height)) {
+                        bg_image_unref (image);
+                        return NULL;
                 }
 
-                height = 0.5 + screen_height * (percentage / 100.);
-        } else if (geometry_flags & HeightValue)
-                height = geometry_height;
-        else
-                height = image_height;
+                return image;
+        }
 
-        if (center_x) {
-                x = (screen_width - width) / 2;
-                gravity_x = 0;
-        } else if (geometry_flags & XValue) {
-                if (geometry_flags & XNegative) {
-                        x = screen_width - width + geometry_x;
-                        gravity_x = 1;
-                } else {
-                        x = geometry_x;
-                        gravity_x = -1;
-                }
-        } else {
-                x = 0;
-                gravity_x = -1;
+        if (!position_emblem (state, image_width, image_height))
+                return NULL;
+
+        screen_rect.x = screen_rect.y = 0;
+        screen_rect.width = state->width;
+        screen_rect.height = state->height;
+        emblem_rect.x = state->emblem_x;
+        emblem_rect.y = state->emblem_y;
+        emblem_rect.width = state->emblem_width;
+        emblem_rect.height = state->emblem_height;
+
+        if (!gdk_rectangle_intersect (&emblem_rect, &screen_rect, &visible)) {
+                debugmsg ("%s image %s is off the screen, not loading it\n", what, filename);
+                return NULL;
         }
-        
-        if (center_y) {
-                y = (screen_height - height) / 2;
-                gravity_y = 0;
-        }  else if (geometry_flags & YValue) {
-                if (geometry_flags & YNegative) {
-                        y = screen_height - height + geometry_y;
-                        gravity_y = 1;
-                } else {
-                        y = geometry_y;
-                        gravity_y = -1;
+
+        /* Embossing and blurring look at the neighbours of each pixel */
+        if (emboss || emblem_blur > 0)
+                visible = emblem_rect;
+
+        state->emblem_x = visible.x;
+        state->emblem_y = visible.y;
+        state->emblem_width = visible.width;
+        state->emblem_height = visible.height;
+
+        visible.x -= emblem_rect.x;
+        visible.y -= emblem_rect.y;
+
+        if (cached)
+                return load_image (filename, what, alpha, emblem_rect.width, emblem_rect.height, &visible);
+        else
+                return decode_image (filename, what, alpha, emblem_rect.width, emblem_rect.height, &visible,
+                                     rows_func, data);
+}
+
+/* --text: the text, with %h replaced by the host name, %u by the
+ * user name and %% by %, rasterised with Pango and used in place of
+ * an emblem image. Rasterised text is kept in the raw image format under the
+ * user's cache directory, keyed by everything that affects how it
+ * looks, so later runs only map the file instead of loading fonts
+ * and shaping text.
+ */
+static char *
+expand_text (const char *str)
+{
+        GString *result = g_string_new (NULL);
+        const char *p;
+
+        for (p = str; *p; p++) {
+                if (*p != '%' || !p[1]) {
+                        g_string_append_c (result, *p);
+                        continue;
                 }
-        } else {
-                y = 0;
-                gravity_y = -1;
-        }
-        
-        if (avoid || keep_aspect) {
-                if (width * image_height > image_width * height) {
-                        int new_width = (height * image_width) / image_height;
-                        if (gravity_x == 0) {
-                                x += (width - new_width) / 2;
-                        } else if (gravity_x == 1) {
-                                x += (width - new_width);
-                        }
-                        width = new_width;
-                } else if (width * image_height < image_width * height) {
-                        int new_height = (width * image_height) / image_width;
-                        if (gravity_y == 0) {
-                                y += (height - new_height) / 2;
-                        } else if (gravity_y == 1) {
-                                y += (height - new_height);
-                        }
-                        height = new_height;
+
+                switch (*++p) {
+                case 'h':
+                        g_string_append (result, g_get_host_name ());
+                        break;
+                case 'u':
+                        g_string_append (result, g_get_user_name ());
+                        break;
+                case '%':
+                        g_string_append_c (result, '%');
+                        break;
+                default:
+                        g_string_append_c (result, '%');
+                        g_string_append_c (result, *p);
+                        break;
                 }
         }
 
-        if (avoid) {
-                int avoid_x, avoid_y;
-		unsigned int avoid_width, avoid_height;
-                int avoid_flags;
-                int new_width, new_height;
-                int tmp_x, tmp_y;
-                int x_space, y_space;
-                
-                avoid_flags = XParseGeometry (avoid, &avoid_x, &avoid_y,
-                                              &avoid_width, &avoid_height);
+        return g_string_free (result, FALSE);
+}
 
-                if (!(avoid_flags & WidthValue) || avoid_width == 0 ||
-                    !(avoid_flags & HeightValue) || avoid_height == 0) {
-                        fprintf (stderr, "%s: avoid geometry '%s' must have positive width, height\n", appname, avoid);
-                        exit (1);
-                }
+static cairo_surface_t *
+rasterise_text (const char           *str,
+                PangoFontDescription *font,
+                GdkColor             *color)
+{
+        PangoContext *context;
+        PangoLayout *layout;
+        PangoRectangle ink, logical;
+        cairo_surface_t *surface;
+        cairo_t *cr;
+        int x0, y0, x1, y1;
 
-                if (!(avoid_flags & XValue))
-                        avoid_x = (screen_width - avoid_width) / 2;
-                else if (avoid_flags & XNegative)
-                        avoid_x = screen_width - avoid_width + avoid_x;
-                
-                if (!(avoid_flags & YValue))
-                        avoid_y = (screen_height - avoid_height) / 2;
-                else if (avoid_flags & YNegative)
-                        avoid_y = screen_height - avoid_height + avoid_y;
+        context = pango_font_map_create_context (pango_cairo_font_map_get_default ());
+        layout = pango_layout_new (context);
+        pango_layout_set_font_description (layout, font);
+        pango_layout_set_text (layout, str, -1);
 
-                /* To avoid worrying about gravity, we flip horizontally
-                 * and/or vertically to do the following computation
-                 */
-                if (gravity_x == 1 ||
-                    (gravity_x == 0 && x + width / 2 > avoid_x + avoid_width)) {
-                        tmp_x = screen_width - width - x;
-                        avoid_x = screen_width - avoid_width - avoid_x;
-                } else
-                        tmp_x = x;
-                
-                if (gravity_y == 1 ||
-                    (gravity_y == 0 && y + height / 2 > avoid_y + avoid_height)) {
-                        tmp_y = screen_height - height - y;
-                        avoid_y = screen_height - avoid_height - avoid_y;
-                } else
-                        tmp_y = y;
+        /* Keep whatever sticks out of the logical extents too */
+        pango_layout_get_pixel_extents (layout, &ink, &logical);
+        x0 = MIN (ink.x, logical.x);
+        y0 = MIN (ink.y, logical.y);
+        x1 = MAX (ink.x + ink.width, logical.x + logical.width);
+        y1 = MAX (ink.y + ink.height, logical.y + logical.height);
 
-                debugmsg ("Now: %dx%d+%d+%d\n", width, height, tmp_x, tmp_y);
-                debugmsg ("Avoiding: %dx%d+%d+%d\n", avoid_width, avoid_height, avoid_x, avoid_y);
+        surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, MAX (x1 - x0, 1), MAX (y1 - y0, 1));
+        cr = cairo_create (surface);
+        cairo_set_source_rgb (cr, color->red / 65535., color->green / 65535., color->blue / 65535.);
+        cairo_move_to (cr, -x0, -y0);
+        pango_cairo_show_layout (cr, layout);
+        cairo_destroy (cr);
 
-                if ((tmp_x + width < avoid_x || tmp_x >= avoid_x + avoid_width ||
-                     tmp_y + height < avoid_y || tmp_y >= avoid_y + avoid_height)) {
-                        /* No need to adjust */
+        g_object_unref (layout);
+        g_object_unref (context);
 
-                        goto avoid_done;
-                } 
+        return surface;
+}
 
-                if (gravity_x == 0)
-                        x_space = 2 * (avoid_x - (tmp_x + width / 2));
-                else
-                        x_space = avoid_x - tmp_x;
-                
-                if (gravity_y == 0)
-                        y_space = 2 * (avoid_y - (tmp_y + width / 2));
-                else
-                        y_space = avoid_y - tmp_y;
+/* The newest modification time of the fontconfig configuration and of
+ * the caches fc-cache rewrites when fonts are installed. Looking at the
+ * directories is much cheaper than asking fontconfig which font a
+ * description resolves to, which means loading all of its configuration.
+ */
+static gint64
+get_font_config_time (void)
+{
+        const char *system_dirs[] = {
+                "/etc/fonts", "/etc/fonts/conf.d", "/var/cache/fontconfig",
+                "/usr/lib/fontconfig/cache", "/usr/local/share/fonts", "/usr/share/fonts"
+        };
+        char *user_dirs[4];
+        gint64 newest = 0;
+        struct stat st;
+        guint i;
 
-                if (x_space <= 0 && y_space <= 0) {
-                        /* Can't adjust */
-                        
-                        g_object_unref (bg_state.emblem_pixbuf);
-                        bg_state.emblem_pixbuf = NULL;
+        user_dirs[0] = g_build_filename (g_get_user_config_dir (), "fontconfig", NULL);
+        user_dirs[1] = g_build_filename (g_get_user_cache_dir (), "fontconfig", NULL);
+        user_dirs[2] = g_build_filename (g_get_user_data_dir (), "fonts", NULL);
+        user_dirs[3] = g_build_filename (g_get_home_dir (), ".fonts", NULL);
 
-                        return;
-                } 
+        for (i = 0; i < G_N_ELEMENTS (system_dirs); i++)
+                if (stat (system_dirs[i], &st) == 0)
+                        newest = MAX (newest, (gint64)st.st_mtime);
 
-                debugmsg ("x_space = %d, y_space = %d\n", x_space, y_space);
-                
-                if (x_space * image_height > y_space * image_width) {
+        for (i = 0; i < G_N_ELEMENTS (user_dirs); i++) {
+                if (stat (user_dirs[i], &st) == 0)
+                        newest = MAX (newest, (gint64)st.st_mtime);
+                g_free (user_dirs[i]);
+        }
+
+        return newest;
+}
+
+/* The cache file for str drawn in font and color. Only what is cheap to
+ * find out goes in the key, so that a hit costs no font loading: the
+ * font as it was asked for, the resolution, and when fonts were last
+ * installed or configured, so that new fonts aren't hidden by a stale
+ * cache.
+ */
+static char *
+get_text_cache_file (const char           *str,
+                     PangoFontDescription *font,
+                     GdkColor             *color)
+{
+        PangoFontMap *font_map = pango_cairo_font_map_get_default ();
+        GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA1);
+        char *font_name, *key, *name, *filename;
+
+        font_name = pango_font_description_to_string (font);
+
+        key = g_strdup_printf ("%s\n%s\n%g\n%" G_GINT64_FORMAT "\n%04x%04x%04x\n%s",
+                               pango_version_string (), font_name,
+                               pango_cairo_font_map_get_resolution (PANGO_CAIRO_FONT_MAP (font_map)),
+                               get_font_config_time (),
+                               color->red, color->green, color->blue, str);
+        g_checksum_update (checksum, (const guchar *)key, -1);
+        name = g_strdup_printf ("text-%s.raw", g_checksum_get_string (checksum));
+        filename = g_build_filename (g_get_user_cache_dir (), "xsri", name, NULL);
+
+        g_free (name);
+        g_free (key);
+        g_free (font_name);
+        g_checksum_free (checksum);
+
+        return filename;
+}
+
+/* Write image to filename under a name of its own first, since other
+ * logins may be doing the same at the same time.
+ */
+static void
+save_text_cache_file (BGImage    *image,
+                      const char *filename)
+{
+        GError *error = NULL;
+        char *dirname = g_path_get_dirname (filename);
+
+        if (g_mkdir_with_parents (dirname, 0700) < 0 ||
+            !bg_image_save_raw (image, filename, &error))
+                debugmsg ("Cannot cache text in %s: %s\n", filename,
+                          error ? error->message : g_strerror (errno));
+
+        if (error)
+                g_error_free (error);
+        g_free (dirname);
+}
+
+/* The text from filename if it is cached there, otherwise rasterised
+ * and cached for next time
+ */
+static BGImage *
+get_text_image (const char           *str,
+                PangoFontDescription *font,
+                GdkColor             *color,
+                int                   alpha,
+                const char           *filename,
+                const char           *what)
+{
+        cairo_surface_t *surface;
+        BGImage *image;
+
+        if (bg_image_file_is_raw (filename)) {
+                image = bg_image_new_from_raw_file (filename, alpha, NULL);
+                if (image) {
+                        debugmsg ("Using cached %s text %s\n", what, filename);
+                        return image;
+                }
+        }
+
+        surface = rasterise_text (str, font, color);
+
+        image = bg_image_new_from_surface (surface, 255);
+        save_text_cache_file (image, filename);
+        if (alpha != 255) {
+                bg_image_unref (image);
+                image = bg_image_new_from_surface (surface, alpha);
+        }
+
+        cairo_surface_destroy (surface);
+
+        return image;
+}
+
+static BGImage *
+load_text_image (const char *what,
+                 int         alpha)
+{
+        PangoFontDescription *font;
+        GdkColor color = { 0, 0xffff, 0xffff, 0xffff };
+        char *str, *filename, *key;
+        BGImage *image;
+
+        if (text_color && !gdk_color_parse (text_color, &color))
+                fprintf (stderr, "%s: Cannot parse_color: %s\n", appname, text_color);
+
+        str = expand_text (text);
+        if (!*str) {
+                fprintf (stderr, "%s: The %s text is empty\n", appname, what);
+                g_free (str);
+                return NULL;
+        }
+
+        font = pango_font_description_from_string (text_font ? text_font : DEFAULT_TEXT_FONT);
+        filename = get_text_cache_file (str, font, &color);
+
+        /* Shared between configurations like images from files */
+        if (!image_cache)
+                image_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, (GDestroyNotify)bg_image_unref);
+
+        key = g_strdup_printf ("%s\n%d", filename, alpha);
+        image = g_hash_table_lookup (image_cache, key);
+        if (image) {
+                g_free (key);
+        } else {
+                image = get_text_image (str, font, &color, alpha, filename, what);
+                g_hash_table_insert (image_cache, key, image);
+        }
+
+        g_free (filename);
+        g_free (str);
+        pango_font_description_free (font);
+
+        return bg_image_ref (image);
+}
+
+/* Place text as the emblem would be placed */
+static BGImage *
+load_placed_text (BGState    *state,
+                  const char *what)
+{
+        BGImage *image = load_text_image (what, emboss ? 255 : emblem_alpha);
+
+        if (image && !position_emblem (state, image->width, image->height)) {
+                bg_image_unref (image);
+                return NULL;
+        }
+
+        return image;
+}
+
+/* An opaque emblem or layer covering the whole screen leaves nothing
+ * of the tile to see.
+ */
+static gboolean
+tile_is_hidden (BGState *state)
+{
+        int i;
+
+        if (state->emblem_image && state->emblem_image->opaque &&
+            !emboss && !emblem_animation &&
+            state->emblem_x <= 0 && state->emblem_y <= 0 &&
+            state->emblem_x + state->emblem_width >= state->width &&
+            state->emblem_y + state->emblem_height >= state->height)
+                return TRUE;
+
+        for (i = 0; i < state->n_layers; i++) {
+                BGLayer *layer = &state->layers[i];
+
+                if (layer->image->opaque && !layer->emboss &&
+                    layer->x <= 0 && layer->y <= 0 &&
+                    layer->x + layer->width >= state->width &&
+                    layer->y + layer->height >= state->height)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+/* Needs to be called after load_emblem() and load_layers() */
+static void
+load_tile (BGState *state)
+{
+        state->tile_image = NULL;
+
+        if (tile_file && tile_is_hidden (state)) {
+                debugmsg ("Tile is hidden by the emblem, not loading it\n");
+        } else if (tile_file) {
+                state->tile_image = load_image (tile_file, "tile", tile_alpha, -1, -1, NULL);
+                if (state->tile_image) {
+                        state->tile_width = MAX (state->tile_image->width * tile_scale / 100, 1);
+                        state->tile_height = MAX (state->tile_image->height * tile_scale / 100, 1);
+                }
+        }
+}
+
+/* Loads and places the emblem */
+static void
+load_emblem (BGState *state)
+{
+        state->emblem_image = NULL;
+        
+        if (emblem_file && run_mode == RUN_MODE_RUN && !slideshow && !per_desktop &&
+            !bg_image_file_is_raw (emblem_file))
+                load_emblem_animation (state);
+        else if (emblem_file && stream_emblem)
+                debugmsg ("Decoding the emblem while rendering\n");
+        else if (emblem_file)
+                state->emblem_image = load_placed_emblem (state, emblem_file, "emblem", TRUE, NULL, NULL);
+        else if (text)
+                state->emblem_image = load_placed_text (state, "emblem");
+}
+
+/* Parse value, a number from min to max (excluding min itself if
+ * open is set), into *result; leaves *result alone and complains if
+ * it isn't one.
+ */
+static void
+parse_number (const char *value,
+              const char *what,
+              double      min,
+              double      max,
+              gboolean    open,
+              double     *result)
+{
+        char *p;
+        double number;
+
+        if (!value)
+                return;
+
+        number = strtod (value, &p);
+        if (p == value || *p || !isfinite (number) || number < min || (open && number == min) || number > max) {
+                fprintf (stderr, "%s: Invalid %s: %s\n", appname, what, value);
+                return;
+        }
+
+        *result = number;
+}
+
+static void
+parse_light (BGState *state)
+{
+        /* The light of the original embossing, from (-1, 1, 1) */
+        state->light_angle = 315;
+        state->light_elevation = asin (1 / sqrt (3)) * 180 / G_PI;
+        state->emboss_depth = 1;
+
+        parse_number (light_angle, "light angle", -360, 360, FALSE, &state->light_angle);
+        parse_number (light_elevation, "light elevation", 0, 90, TRUE, &state->light_elevation);
+        parse_number (emboss_depth, "emboss depth", 0, 100, TRUE, &state->emboss_depth);
+}
+
+static BGTileMode
+parse_tile_mode (void)
+{
+        if (!tile_mode || strcmp (tile_mode, "repeat") == 0)
+                return BG_TILE_REPEAT;
+        else if (strcmp (tile_mode, "mirror") == 0)
+                return BG_TILE_MIRROR;
+        else if (strcmp (tile_mode, "mirror-x") == 0)
+                return BG_TILE_MIRROR_X;
+        else if (strcmp (tile_mode, "mirror-y") == 0)
+                return BG_TILE_MIRROR_Y;
+        else if (strcmp (tile_mode, "offset-brick") == 0)
+                return BG_TILE_BRICK;
+
+        fprintf (stderr, "%s: --tile-mode must be repeat, mirror, mirror-x, mirror-y or offset-brick: %s\n",
+                 appname, tile_mode);
+        exit (1);
+}
+
+/* Load the images of state, skipping what won't be seen; this also
+ * places the emblem, so state->width and height must be set.
+ */
+static void
+load_images (BGState *state)
+{
+        if (tile_alpha < 0 || tile_alpha > 255) {
+                fprintf (stderr, "%s: Invalid alpha value %d\n", appname, tile_alpha);
+                exit (1);
+        }
+
+        if (emblem_alpha < 0 || emblem_alpha > 255) {
+                fprintf (stderr, "%s: Invalid emblem alpha value %d\n", appname, emblem_alpha);
+                exit (1);
+        }
+
+        if (tile_blur < 0 || emblem_blur < 0 || blur < 0) {
+                fprintf (stderr, "%s: Invalid blur radius\n", appname);
+                exit (1);
+        }
+
+        if (tile_rotate % 90 != 0) {
+                fprintf (stderr, "%s: Invalid tile rotation %d, must be a multiple of 90\n", appname, tile_rotate);
+                exit (1);
+        }
+
+        if (tile_scale <= 0) {
+                fprintf (stderr, "%s: Invalid tile scale %d\n", appname, tile_scale);
+                exit (1);
+        }
+
+        load_emblem (state);
+        load_layers (state);
+        load_tile (state);
+        
+        state->emboss = emboss;
+        parse_light (state);
+        state->tile_mode = parse_tile_mode ();
+        state->tile_rotation = (tile_rotate % 360 + 360) % 360;
+        state->tile_blur = tile_blur;
+        state->emblem_blur = emblem_blur;
+        state->blur = blur;
+}
+
+/* Parse --stops. Stops without a position are spread evenly between
+ * their neighbours, with the first at 0% and the last at 100% by
+ * default, and a position before the previous one is moved up to it.
+ */
+static gboolean
+parse_stops (BGState *state)
+{
+        char **items = g_strsplit (stops, ",", -1);
+        gboolean result = FALSE;
+        int n, i, j;
+
+        n = g_strv_length (items);
+        if (n < 2 || n > BG_MAX_GRADIENT_STOPS) {
+                fprintf (stderr, "%s: Need between 2 and %d gradient stops: %s\n",
+                         appname, BG_MAX_GRADIENT_STOPS, stops);
+                goto out;
+        }
+
+        for (i = 0; i < n; i++) {
+                char *item = g_strstrip (items[i]);
+                char *at = strchr (item, '@');
+
+                state->stops[i].offset = -1;
+
+                if (at) {
+                        char *p;
+
+                        *at = '\0';
+                        state->stops[i].offset = strtod (at + 1, &p) / 100.;
+                        if (*p == '%')
+                                p++;
+                        if (*p || state->stops[i].offset < 0 || state->stops[i].offset > 1) {
+                                fprintf (stderr, "%s: Invalid gradient stop position: %s\n", appname, at + 1);
+                                goto out;
+                        }
+                }
+
+                if (!gdk_color_parse (item, &state->stops[i].color)) {
+                        fprintf (stderr, "%s: Cannot parse_color: %s\n", appname, item);
+                        goto out;
+                }
+        }
+
+        if (state->stops[0].offset < 0)
+                state->stops[0].offset = 0;
+        if (state->stops[n - 1].offset < 0)
+                state->stops[n - 1].offset = 1;
+
+        for (i = 1; i < n; i++) {
+                if (state->stops[i].offset < 0) {
+                        for (j = i + 1; state->stops[j].offset < 0; j++)
+                                ;
+                        state->stops[i].offset = state->stops[i - 1].offset +
+                                (MAX (state->stops[j].offset, state->stops[i - 1].offset) - state->stops[i - 1].offset) / (j - i + 1);
+                }
+                
+                state->stops[i].offset = MAX (state->stops[i].offset, state->stops[i - 1].offset);
+        }
+
+        state->n_stops = n;
+        state->bgColor1 = state->stops[0].color;
+        state->bgColor2 = state->stops[n - 1].color;
+        state->grad = TRUE;
+        result = TRUE;
+
+ out:
+        g_strfreev (items);
+        return result;
+}
+
+/* --schedule is a list of TIME=COLOR[/COLOR2] items, such as
+ * 6:00=#203050/#e08040,9:00=#4080c0. The colors at any time of day
+ * are interpolated between the items before and after it, going
+ * round past midnight.
+ */
+typedef struct {
+        int      time;          /* seconds since midnight */
+        GdkColor color1;
+        GdkColor color2;
+} ScheduleItem;
+
+static GArray *schedule_items = NULL;   /* of ScheduleItem, by time */
+static gboolean schedule_grad;          /* some item has a second color */
+
+static gint
+compare_schedule_items (gconstpointer a,
+                        gconstpointer b)
+{
+        return ((const ScheduleItem *)a)->time - ((const ScheduleItem *)b)->time;
+}
+
+static gboolean
+parse_schedule (void)
+{
+        char **items = g_strsplit (schedule, ",", -1);
+        gboolean result = FALSE;
+        int i;
+
+        if (schedule_items)
+                g_array_free (schedule_items, TRUE);
+        schedule_items = g_array_new (FALSE, FALSE, sizeof (ScheduleItem));
+        schedule_grad = FALSE;
+
+        for (i = 0; items[i]; i++) {
+                char *item = g_strstrip (items[i]);
+                char *slash;
+                ScheduleItem schedule_item;
+                int hours, minutes, n = 0;
+
+                if (sscanf (item, "%d:%d=%n", &hours, &minutes, &n) != 2 || n == 0 ||
+                    hours < 0 || hours > 23 || minutes < 0 || minutes > 59) {
+                        fprintf (stderr, "%s: Invalid schedule item: %s\n", appname, item);
+                        goto out;
+                }
+                schedule_item.time = 3600 * hours + 60 * minutes;
+
+                slash = strchr (item + n, '/');
+                if (slash)
+                        *slash = '\0';
+
+                if (!gdk_color_parse (item + n, &schedule_item.color1) ||
+                    (slash && !gdk_color_parse (slash + 1, &schedule_item.color2))) {
+                        fprintf (stderr, "%s: Cannot parse_color: %s\n",
+                                 appname, slash ? slash + 1 : item + n);
+                        goto out;
+                }
+
+                if (slash)
+                        schedule_grad = TRUE;
+                else
+                        schedule_item.color2 = schedule_item.color1;
+
+                g_array_append_val (schedule_items, schedule_item);
+        }
+
+        if (schedule_items->len == 0) {
+                fprintf (stderr, "%s: Empty schedule\n", appname);
+                goto out;
+        }
+
+        g_array_sort (schedule_items, compare_schedule_items);
+        result = TRUE;
+
+ out:
+        if (!result) {
+                g_array_free (schedule_items, TRUE);
+                schedule_items = NULL;
+        }
+        g_strfreev (items);
+        return result;
+}
+
+static void
+mix_colors (GdkColor *dest,
+            GdkColor *a,
+            GdkColor *b,
+            double    t)
+{
+        dest->red = a->red + (b->red - a->red) * t + 0.5;
+        dest->green = a->green + (b->green - a->green) * t + 0.5;
+        dest->blue = a->blue + (b->blue - a->blue) * t + 0.5;
+}
+
+/* Colors only count as different if they render differently */
+static gboolean
+same_color (GdkColor *a,
+            GdkColor *b)
+{
+        return ((a->red >> 8) == (b->red >> 8) &&
+                (a->green >> 8) == (b->green >> 8) &&
+                (a->blue >> 8) == (b->blue >> 8));
+}
+
+/* Set the colors of state for the current time from the schedule.
+ * Returns whether that changes how it looks.
+ */
+static gboolean
+apply_schedule (BGState *state)
+{
+        ScheduleItem *prev, *next;
+        GdkColor color1, color2;
+        time_t now = time (NULL);
+        struct tm tm;
+        int seconds, span, elapsed;
+        guint i;
+        gboolean changed;
+
+        localtime_r (&now, &tm);
+        seconds = 3600 * tm.tm_hour + 60 * tm.tm_min + tm.tm_sec;
+
+        /* The last item at or before now, or failing that the last
+         * one of the day before
+         */
+        prev = &g_array_index (schedule_items, ScheduleItem, schedule_items->len - 1);
+        for (i = 0; i < schedule_items->len; i++) {
+                ScheduleItem *item = &g_array_index (schedule_items, ScheduleItem, i);
+
+                if (item->time > seconds)
+                        break;
+                prev = item;
+        }
+        next = &g_array_index (schedule_items, ScheduleItem, i % schedule_items->len);
+
+        span = (next->time - prev->time + 86400) % 86400;
+        if (span == 0)
+                span = 86400;
+        elapsed = (seconds - prev->time + 86400) % 86400;
+
+        mix_colors (&color1, &prev->color1, &next->color1, (double)elapsed / span);
+        mix_colors (&color2, &prev->color2, &next->color2, (double)elapsed / span);
+
+        changed = (!same_color (&color1, &state->bgColor1) ||
+                   (schedule_grad && !same_color (&color2, &state->bgColor2)) ||
+                   state->grad != schedule_grad);
+
+        state->bgColor1 = color1;
+        state->bgColor2 = color2;
+        state->grad = schedule_grad;
+
+        return changed;
+}
+
+static void
+parse_colors (BGState *state)
+{
+        state->vertical = vertical;
+        state->angle = vertical ? 180 : 90;
+        state->gradient_type = BG_GRADIENT_LINEAR;
+        
+        if (color) {
+                if (!gdk_color_parse (color, &state->bgColor1))
+                        fprintf (stderr, "%s: Cannot parse_color: %s\n", appname, color);
+        }
+        if (color2) {
+                if (!gdk_color_parse (color2, &state->bgColor2))
+                        fprintf (stderr, "%s: Cannot parse_color: %s\n", appname, color);
+                else
+                        state->grad = TRUE;
+        }
+
+        if (stops)
+                parse_stops (state);
+        else if (schedule && parse_schedule ())
+                apply_schedule (state);
+
+        parse_number (angle, "angle", -G_MAXDOUBLE, G_MAXDOUBLE, FALSE, &state->angle);
+
+        if (radial) {
+                if (strcmp (radial, "circle") == 0)
+                        state->gradient_type = BG_GRADIENT_CIRCLE;
+                else if (strcmp (radial, "ellipse") == 0)
+                        state->gradient_type = BG_GRADIENT_ELLIPSE;
+                else
+                        fprintf (stderr, "%s: --radial must be circle or ellipse: %s\n", appname, radial);
+        }
+
+        /* The following code tries to coerce colors to solid colors when close, but
+         * there is some inaccuracy somewhere along the way, and it actually doesnt
+         * quite work.
+         */
+#if 0        
+        if (!state->grad) {
+                GdkColor tmp_color;
+                gint diff;
+                
+                gulong pixel = xpixel_from_color (&state->bgColor1);
+                xpixel_to_color (pixel, &tmp_color);
+
+                diff = 0;
+                diff = MAX (diff, abs (tmp_color.red - state->bgColor1.red));
+                diff = MAX (diff, abs (tmp_color.green - state->bgColor1.green));
+                diff = MAX (diff, abs (tmp_color.blue - state->bgColor1.blue));
+
+                if (diff < 8 * 0x101)
+                        state->bgColor1 = tmp_color;
+        }
+#endif
+}
+
+/* Place an image_width by image_height emblem on state. Returns
+ * FALSE if it can't be kept clear of --avoid, in which case it isn't
+ * shown.
+ */
+static gboolean
+position_emblem (BGState *state,
+                 int      image_width,
+                 int      image_height)
+{
+        /* See README for a description of the algorithm
+         */
+        int width, height;
+        int x, y;
+        int gravity_x, gravity_y;
+        int screen_width = state->width;
+        int screen_height = state->height;
+        int geometry_flags = 0;
+        int geometry_x = 0;
+        int geometry_y = 0;
+        unsigned int geometry_width = 0;
+        unsigned int geometry_height = 0;
+
+        if (geometry) {
+                geometry_flags = XParseGeometry (geometry, &geometry_x, &geometry_y,
+                                                 &geometry_width, &geometry_height);
+
+                if (((geometry_flags & WidthValue) && geometry_width == 0) ||
+                    ((geometry_flags & HeightValue) && geometry_height == 0)) {
+                        fprintf (stderr, "%s: Invalid geometry specification: %s\n",
+                                 appname, geometry);
+                        exit (1);
+                }
+        }
+
+        if (scale_width) {
+                char *p;
+                double percentage = strtod (scale_width, &p);
+
+                if (*p || percentage < 0 || percentage > 100) {
+                        fprintf (stderr, "%s: Invalid percentage: %s\n", appname, scale_width);
+                        exit (1);
+                }
+
+                width = 0.5 + screen_width * (percentage / 100.);
+        } else if (geometry_flags & WidthValue)
+                width = geometry_width;
+        else
+                width = image_width;
+
+
+        if (scale_height) {
+                char *p;
+                double percentage = strtod (scale_height, &p);
+
+                if (*p || percentage < 0 || percentage > 100) {
+                        fprintf (stderr, "%s: Invalid percentage: %s\n", appname, scale_height);
+                        exit (1);
+                }
+
+                height = 0.5 + screen_height * (percentage / 100.);
+        } else if (geometry_flags & HeightValue)
+                height = geometry_height;
+        else
+                height = image_height;
+
+        if (center_x) {
+                x = (screen_width - width) / 2;
+                gravity_x = 0;
+        } else if (geometry_flags & XValue) {
+                if (geometry_flags & XNegative) {
+                        x = screen_width - width + geometry_x;
+                        gravity_x = 1;
+                } else {
+                        x = geometry_x;
+                        gravity_x = -1;
+                }
+        } else {
+                x = 0;
+                gravity_x = -1;
+        }
+        
+        if (center_y) {
+                y = (screen_height - height) / 2;
+                gravity_y = 0;
+        }  else if (geometry_flags & YValue) {
+                if (geometry_flags & YNegative) {
+                        y = screen_height - height + geometry_y;
+                        gravity_y = 1;
+                } else {
+                        y = geometry_y;
+                        gravity_y = -1;
+                }
+        } else {
+                y = 0;
+                gravity_y = -1;
+        }
+        
+        if (avoid || keep_aspect) {
+                if (width * image_height > image_width * height) {
+                        int new_width = (height * image_width) / image_height;
+                        if (gravity_x == 0) {
+                                x += (width - new_width) / 2;
+                        } else if (gravity_x == 1) {
+                                x += (width - new_width);
+                        }
+                        width = new_width;
+                } else if (width * image_height < image_width * height) {
+                        int new_height = (width * image_height) / image_width;
+                        if (gravity_y == 0) {
+                                y += (height - new_height) / 2;
+                        } else if (gravity_y == 1) {
+                                y += (height - new_height);
+                        }
+                        height = new_height;
+                }
+        }
+
+        if (avoid) {
+                int avoid_x, avoid_y;
+		unsigned int avoid_width, avoid_height;
+                int avoid_flags;
+                int new_width, new_height;
+                int tmp_x, tmp_y;
+                int x_space, y_space;
+                
+                avoid_flags = XParseGeometry (avoid, &avoid_x, &avoid_y,
+                                              &avoid_width, &avoid_height);
+
+                if (!(avoid_flags & WidthValue) || avoid_width == 0 ||
+                    !(avoid_flags & HeightValue) || avoid_height == 0) {
+                        fprintf (stderr, "%s: avoid geometry '%s' must have positive width, height\n", appname, avoid);
+                        exit (1);
+                }
+
+                if (!(avoid_flags & XValue))
+                        avoid_x = (screen_width - avoid_width) / 2;
+                else if (avoid_flags & XNegative)
+                        avoid_x = screen_width - avoid_width + avoid_x;
+                
+                if (!(avoid_flags & YValue))
+                        avoid_y = (screen_height - avoid_height) / 2;
+                else if (avoid_flags & YNegative)
+                        avoid_y = screen_height - avoid_height + avoid_y;
+
+                /* To avoid worrying about gravity, we flip horizontally
+                 * and/or vertically to do the following computation
+                 */
+                if (gravity_x == 1 ||
+                    (gravity_x == 0 && x + width / 2 > avoid_x + avoid_width)) {
+                        tmp_x = screen_width - width - x;
+                        avoid_x = screen_width - avoid_width - avoid_x;
+                } else
+                        tmp_x = x;
+                
+                if (gravity_y == 1 ||
+                    (gravity_y == 0 && y + height / 2 > avoid_y + avoid_height)) {
+                        tmp_y = screen_height - height - y;
+                        avoid_y = screen_height - avoid_height - avoid_y;
+                } else
+                        tmp_y = y;
+
+                debugmsg ("Now: %dx%d+%d+%d\n", width, height, tmp_x, tmp_y);
+                debugmsg ("Avoiding: %dx%d+%d+%d\n", avoid_width, avoid_height, avoid_x, avoid_y);
+
+                if ((tmp_x + width < avoid_x || tmp_x >= avoid_x + avoid_width ||
+                     tmp_y + height < avoid_y || tmp_y >= avoid_y + avoid_height)) {
+                        /* No need to adjust */
+
+                        goto avoid_done;
+                } 
+
+                if (gravity_x == 0)
+                        x_space = 2 * (avoid_x - (tmp_x + width / 2));
+                else
+                        x_space = avoid_x - tmp_x;
+                
+                if (gravity_y == 0)
+                        y_space = 2 * (avoid_y - (tmp_y + width / 2));
+                else
+                        y_space = avoid_y - tmp_y;
+
+                if (x_space <= 0 && y_space <= 0) {
+                        /* Can't adjust */
+                        debugmsg ("Can't keep the emblem clear of --avoid, not showing it\n");
+
+                        return FALSE;
+                } 
+
+                debugmsg ("x_space = %d, y_space = %d\n", x_space, y_space);
+                
+                if (x_space * image_height > y_space * image_width) {
                         new_width = x_space;
                         new_height = (image_height * x_space) / image_width;
                 } else {
-                        new_height = y_space;
-                        new_width = (image_width * y_space) / image_height;
+                        new_height = y_space;
+                        new_width = (image_width * y_space) / image_height;
+                }
+                
+                /* Now adjust width/height in our original coordinate system
+                 */
+                if (gravity_x == 0) {
+                        x += (width - new_width) / 2;
+                } else if (gravity_x == 1) {
+                        x += (width - new_width);
+                }
+
+                if (gravity_y == 0) {
+                        y += (height - new_height) / 2;
+                } else if (gravity_y == 1) {
+                        y += (height - new_height);
+                }
+
+                width = new_width;
+                height = new_height;
+        }
+        avoid_done:
+
+        debugmsg ("positioned at %dx%d+%d+%d: \n", width, height, x, y);
+        
+        state->emblem_x = x;
+        state->emblem_y = y;
+        state->emblem_width = width;
+        state->emblem_height = height;
+
+        return TRUE;
+}
+
+/* Called by worker threads in --run mode before each piece of work,
+ * so that they only get the CPU when nothing else wants it. On Linux
+ * both of these only affect the calling thread; elsewhere they would
+ * slow down the whole process, so nothing is done.
+ */
+static void
+lower_thread_priority (void)
+{
+#ifdef __linux__
+        struct sched_param param = { 0 };
+
+        /* SCHED_IDLE needs Linux 2.6.23 */
+        if (sched_setscheduler (0, SCHED_IDLE, &param) != 0)
+                setpriority (PRIO_PROCESS, 0, 19);
+#endif
+}
+
+/* Microseconds of CPU time used by the calling thread */
+static gint64
+get_thread_cpu_time (void)
+{
+        struct timespec ts;
+
+        if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+                return 0;
+
+        return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* With --max-cpu, sleep for long enough after work that started at
+ * cpu_start that the thread stays within its share of a CPU.
+ */
+static void
+throttle_thread (gint64 cpu_start)
+{
+        gint64 used;
+
+        if (max_cpu <= 0 || max_cpu >= 100)
+                return;
+
+        used = get_thread_cpu_time () - cpu_start;
+        if (used > 0)
+                g_usleep (used * (100 - max_cpu) / max_cpu);
+}
+
+/* Slideshow mode. The image after the one being shown is decoded and
+ * rendered in a worker thread, then uploaded to a second pixmap in the
+ * main loop, so when the interval is up we only have to switch the
+ * root window's background pixmap.
+ */
+typedef struct {
+        char       **files;
+        int          n_files;
+        int          next;              /* index of the next file to prepare */
+        int          failures;          /* consecutive files that didn't load */
+        GThreadPool *pool;
+        GdkPixmap   *back;              /* next slide, ready to show */
+        gboolean     swap_pending;      /* interval passed before back was ready */
+} Slideshow;
+
+typedef struct {
+        BGState     state;
+        const char *file;
+        GdkPixbuf  *pixbuf;
+} SlideJob;
+
+static Slideshow slides;
+
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+        return strcmp (*(char **)a, *(char **)b);
+}
+
+static void
+read_slideshow_files (void)
+{
+        GPtrArray *files = g_ptr_array_new ();
+        GError *error = NULL;
+
+        if (g_file_test (slideshow, G_FILE_TEST_IS_DIR)) {
+                GDir *dir = g_dir_open (slideshow, 0, &error);
+                const char *name;
+
+                if (dir) {
+                        while ((name = g_dir_read_name (dir)) != NULL) {
+                                char *filename = g_build_filename (slideshow, name, NULL);
+
+                                if (g_file_test (filename, G_FILE_TEST_IS_REGULAR) &&
+                                    gdk_pixbuf_get_file_info (filename, NULL, NULL))
+                                        g_ptr_array_add (files, filename);
+                                else
+                                        g_free (filename);
+                        }
+                        g_dir_close (dir);
+                }
+                g_ptr_array_sort (files, compare_strings);
+        } else {
+                char *contents;
+
+                if (g_file_get_contents (slideshow, &contents, NULL, &error)) {
+                        char **lines = g_strsplit (contents, "\n", -1);
+                        int i;
+
+                        for (i = 0; lines[i]; i++) {
+                                char *line = g_strstrip (lines[i]);
+
+                                if (*line && *line != '#')
+                                        g_ptr_array_add (files, g_strdup (line));
+                        }
+                        g_strfreev (lines);
+                        g_free (contents);
+                }
+        }
+
+        if (error) {
+                fprintf (stderr, "%s: Cannot read slideshow: %s\n", appname, error->message);
+                exit (1);
+        }
+
+        if (files->len == 0) {
+                fprintf (stderr, "%s: No images found for slideshow: %s\n", appname, slideshow);
+                exit (1);
+        }
+
+        slides.n_files = files->len;
+        slides.files = (char **)g_ptr_array_free (files, FALSE);
+}
+
+/* Called in the worker thread, and for the first slide, in the main
+ * thread before the worker exists. The state copy shares the tile with
+ * bg_state, which is otherwise left alone while the slideshow runs.
+ */
+static void
+render_slide (SlideJob *job)
+{
+        job->state.emblem_image = load_placed_emblem (&job->state, job->file, "slideshow", FALSE, NULL, NULL);
+        if (job->state.emblem_image) {
+                job->pixbuf = background_render_pixbuf (get_render_context (), &job->state, FALSE, 0, 0,
+                                                        job->state.width, job->state.height);
+                bg_image_unref (job->state.emblem_image);
+        }
+}
+
+static GdkPixmap *
+upload_slide (GdkPixbuf *pixbuf)
+{
+        GdkPixmap *pixmap;
+
+        pixmap = gdk_pixmap_new (get_root_gdk_window (), bg_state.width, bg_state.height, -1);
+        background_draw_pixbuf (get_render_context (), pixbuf, pixmap, 0, 0);
+
+        return pixmap;
+}
+
+static void
+show_slide (GdkPixmap *pixmap)
+{
+        gdk_window_set_back_pixmap (get_root_gdk_window (), pixmap, FALSE);
+        g_object_unref (pixmap);
+        gdk_window_clear (get_root_gdk_window ());
+        gdk_flush ();
+}
+
+static void
+queue_next_slide (void)
+{
+        SlideJob *job = g_new0 (SlideJob, 1);
+
+        job->state = bg_state;
+        job->file = slides.files[slides.next];
+        slides.next = (slides.next + 1) % slides.n_files;
+
+        g_thread_pool_push (slides.pool, job, NULL);
+}
+
+static gboolean
+slide_prepared (gpointer data)
+{
+        SlideJob *job = data;
+
+        if (job->pixbuf) {
+                slides.failures = 0;
+                slides.back = upload_slide (job->pixbuf);
+                g_object_unref (job->pixbuf);
+        } else if (++slides.failures < slides.n_files) {
+                queue_next_slide ();
+        } else {
+                fprintf (stderr, "%s: No slideshow images could be loaded\n", appname);
+        }
+
+        g_free (job);
+
+        if (slides.back && slides.swap_pending) {
+                slides.swap_pending = FALSE;
+                show_slide (slides.back);
+                slides.back = NULL;
+                queue_next_slide ();
+        }
+
+        return FALSE;
+}
+
+static void
+prepare_slide (gpointer data,
+               gpointer user_data)
+{
+        gint64 cpu_start;
+
+        lower_thread_priority ();
+
+        /* Blurring on more threads would get past throttle_thread() */
+        bg_render_context_set_max_threads (get_render_context (), 1);
+
+        cpu_start = get_thread_cpu_time ();
+        render_slide (data);
+        throttle_thread (cpu_start);
+
+        g_idle_add (slide_prepared, data);
+}
+
+static gboolean
+next_slide (gpointer data)
+{
+        if (slides.back) {
+                show_slide (slides.back);
+                slides.back = NULL;
+                queue_next_slide ();
+        } else {
+                slides.swap_pending = TRUE;
+        }
+
+        return TRUE;
+}
+
+static void
+start_slideshow (void)
+{
+        SlideJob job = { { 0 } };
+
+        read_slideshow_files ();
+
+        job.state = bg_state;
+        for (slides.next = 0; slides.next < slides.n_files && !job.pixbuf; slides.next++) {
+                job.file = slides.files[slides.next];
+                render_slide (&job);
+        }
+
+        if (!job.pixbuf) {
+                fprintf (stderr, "%s: No slideshow images could be loaded\n", appname);
+                exit (1);
+        }
+
+        show_slide (upload_slide (job.pixbuf));
+        g_object_unref (job.pixbuf);
+
+        if (slides.n_files == 1)
+                return;
+
+        slides.next %= slides.n_files;
+        slides.pool = g_thread_pool_new (prepare_slide, NULL, 1, TRUE, NULL);
+        queue_next_slide ();
+
+        g_timeout_add_seconds (slideshow_interval, next_slide, NULL);
+}
+
+/* Animated emblems. Each frame is composited over a copy of the
+ * background under the emblem, which is rendered once, and shown by
+ * switching the background of the emblem window, so the cost of a
+ * frame depends only on the size of the emblem. Composited frames are
+ * kept as pixmaps, up to a memory budget, so that looping animations
+ * settle down to just the switching.
+ */
+#define ANIMATION_CACHE_BYTES (16 * 1024 * 1024)
+#define ANIMATION_CACHE_MAX_FRAMES 64
+
+typedef struct {
+        GdkPixbuf *source;      /* frame from the iterator, used as the key */
+        GdkPixmap *pixmap;
+} AnimationFrame;
+
+typedef struct {
+        GdkPixbufAnimationIter *iter;
+        GdkWindow              *window;
+        GdkPixbuf              *base;
+        GList                  *frames;         /* most recently used first */
+        guint                   n_frames;
+        guint                   max_frames;
+        GdkPixbuf              *last_source;
+        guint                   timeout_id;
+} EmblemAnimation;
+
+static void
+free_animation_frame (AnimationFrame *frame)
+{
+        g_object_unref (frame->source);
+        g_object_unref (frame->pixmap);
+        g_free (frame);
+}
+
+static void
+flush_animation_frames (EmblemAnimation *anim)
+{
+        g_list_foreach (anim->frames, (GFunc)free_animation_frame, NULL);
+        g_list_free (anim->frames);
+        anim->frames = NULL;
+        anim->n_frames = 0;
+}
+
+static GdkPixmap *
+compose_animation_frame (EmblemAnimation *anim,
+                         GdkPixbuf       *source)
+{
+        BGRenderContext *context = get_render_context ();
+        BGState frame_state = bg_state;
+        GdkPixbuf *pixbuf;
+        GdkPixmap *pixmap;
+
+        frame_state.emblem_image = bg_image_new_from_pixbuf (source, emboss ? 255 : emblem_alpha);
+
+        pixbuf = gdk_pixbuf_copy (anim->base);
+        background_render_emblem (context, &frame_state, pixbuf, bg_state.emblem_x, bg_state.emblem_y);
+        bg_image_unref (frame_state.emblem_image);
+
+        pixmap = gdk_pixmap_new (anim->window, bg_state.emblem_width, bg_state.emblem_height, -1);
+        background_draw_pixbuf (context, pixbuf, pixmap, bg_state.emblem_x, bg_state.emblem_y);
+        g_object_unref (pixbuf);
+
+        return pixmap;
+}
+
+static GdkPixmap *
+get_animation_frame (EmblemAnimation *anim)
+{
+        GdkPixbuf *source = gdk_pixbuf_animation_iter_get_pixbuf (anim->iter);
+        AnimationFrame *frame;
+        GList *tmp_list;
+
+        /* Loaders are free to draw every frame into the same pixbuf;
+         * if one does, the pixbuf can't identify the frame.
+         */
+        if (source == anim->last_source && anim->max_frames > 0) {
+                debugmsg ("Animation reuses its frame buffer, not caching frames\n");
+                flush_animation_frames (anim);
+                anim->max_frames = 0;
+        }
+        anim->last_source = source;
+
+        for (tmp_list = anim->frames; tmp_list; tmp_list = tmp_list->next) {
+                frame = tmp_list->data;
+                if (frame->source == source) {
+                        anim->frames = g_list_remove_link (anim->frames, tmp_list);
+                        anim->frames = g_list_concat (tmp_list, anim->frames);
+
+                        return g_object_ref (frame->pixmap);
+                }
+        }
+
+        frame = g_new (AnimationFrame, 1);
+        frame->source = g_object_ref (source);
+        frame->pixmap = compose_animation_frame (anim, source);
+
+        if (anim->max_frames == 0) {
+                GdkPixmap *pixmap = g_object_ref (frame->pixmap);
+
+                free_animation_frame (frame);
+                return pixmap;
+        }
+
+        if (anim->n_frames == anim->max_frames) {
+                GList *last = g_list_last (anim->frames);
+
+                free_animation_frame (last->data);
+                anim->frames = g_list_delete_link (anim->frames, last);
+                anim->n_frames--;
+        }
+
+        anim->frames = g_list_prepend (anim->frames, frame);
+        anim->n_frames++;
+
+        return g_object_ref (frame->pixmap);
+}
+
+static gboolean advance_animation (gpointer data);
+
+static void
+show_animation_frame (EmblemAnimation *anim)
+{
+        GdkPixmap *pixmap = get_animation_frame (anim);
+        int delay;
+
+        gdk_window_set_back_pixmap (anim->window, pixmap, FALSE);
+        g_object_unref (pixmap);
+        gdk_window_clear (anim->window);
+
+        /* -1 means the animation has finished */
+        delay = gdk_pixbuf_animation_iter_get_delay_time (anim->iter);
+        if (delay >= 0)
+                anim->timeout_id = g_timeout_add (MAX (delay, 20), advance_animation, anim);
+}
+
+static gboolean
+advance_animation (gpointer data)
+{
+        EmblemAnimation *anim = data;
+
+        anim->timeout_id = 0;
+
+        if (gdk_pixbuf_animation_iter_advance (anim->iter, NULL))
+                show_animation_frame (anim);
+        else
+                anim->timeout_id = g_timeout_add (MAX (gdk_pixbuf_animation_iter_get_delay_time (anim->iter), 20),
+                                                  advance_animation, anim);
+
+        return FALSE;
+}
+
+static void
+stop_emblem_animation (EmblemAnimation *anim)
+{
+        if (anim->timeout_id)
+                g_source_remove (anim->timeout_id);
+        flush_animation_frames (anim);
+        g_object_unref (anim->iter);
+        g_object_unref (anim->base);
+        g_free (anim);
+}
+
+static EmblemAnimation *
+start_emblem_animation (GdkWindow *window)
+{
+        EmblemAnimation *anim = g_new0 (EmblemAnimation, 1);
+        guint frame_bytes = 4 * bg_state.emblem_width * MAX (bg_state.emblem_height, 1);
+
+        anim->window = window;
+        anim->iter = gdk_pixbuf_animation_get_iter (emblem_animation, NULL);
+        anim->base = background_render_pixbuf (get_render_context (), &bg_state, TRUE,
+                                               bg_state.emblem_x, bg_state.emblem_y,
+                                               bg_state.emblem_width, bg_state.emblem_height);
+        anim->max_frames = CLAMP (ANIMATION_CACHE_BYTES / MAX (frame_bytes, 1),
+                                  1, ANIMATION_CACHE_MAX_FRAMES);
+
+        show_animation_frame (anim);
+
+        return anim;
+}
+
+/* The --run mode display: a pixmap for the root window background,
+ * which is either the whole screen or one period of the tiling, and
+ * if useful, separate windows for the emblem and for each layer, each
+ * showing everything under it.
+ */
+static GdkPixmap *root_pixmap = NULL;
+static int root_pixmap_width, root_pixmap_height;
+static gboolean overlay_windows = FALSE;
+static GdkWindow *emblem_window = NULL;
+static EmblemAnimation *emblem_window_animation = NULL;
+static GdkWindow *layer_windows[BG_MAX_LAYERS];
+static int n_layer_windows = 0;
+
+/* Ways of showing bg_state with --run, and what each costs the X
+ * server: the root pixmap, which is 1x1 for a solid color and then
+ * isn't allocated at all, and, if the emblem and layers have windows
+ * of their own, their background pixmaps and the windows themselves.
+ * Everything in a pixmap is also sent to the server once.
+ */
+typedef struct {
+        const char *name;
+        int         width;              /* of the root pixmap */
+        int         height;
+        gboolean    windows;
+        int         n_windows;
+        gsize       server_bytes;
+        gsize       upload_bytes;
+} RunLayout;
+
+/* Rough server memory for a window, besides its background pixmap */
+#define WINDOW_COST_BYTES 4096
+
+/* Bytes per pixel of pixmaps at the depth of the screen */
+static int
+get_bytes_per_pixel (void)
+{
+        int depth = gdk_visual_get_system ()->depth;
+
+        return depth > 16 ? 4 : depth > 8 ? 2 : 1;
+}
+
+/* Bytes of pixmaps the server holds for this client according to
+ * the X-Resource extension, or -1 if it can't tell us.
+ */
+static gint64
+measure_server_pixmap_bytes (void)
+{
+#ifdef HAVE_XRES
+        GdkDisplay *display = gdk_display_get_default ();
+        Display *xdisplay = GDK_DISPLAY_XDISPLAY (display);
+        unsigned long bytes;
+        int event_base, error_base;
+
+        if (XResQueryExtension (xdisplay, &event_base, &error_base) &&
+            XResQueryClientPixmapBytes (xdisplay,
+                                        GDK_WINDOW_XID (gdk_display_get_default_group (display)),
+                                        &bytes))
+                return bytes;
+#endif
+
+        return -1;
+}
+
+static void
+cost_run_layout (RunLayout  *layout,
+                 const char *name,
+                 int         width,
+                 int         height,
+                 gboolean    windows)
+{
+        gsize bpp = get_bytes_per_pixel ();
+        gsize overlay_bytes = 0;
+        int i;
+
+        layout->name = name;
+        layout->width = width;
+        layout->height = height;
+        layout->windows = windows;
+        layout->n_windows = 0;
+
+        if (windows && bg_state.emblem_image) {
+                gsize frame_bytes = bpp * bg_state.emblem_width * bg_state.emblem_height;
+
+                /* Animation frames are kept up to a budget */
+                if (emblem_animation)
+                        frame_bytes = MAX (frame_bytes, ANIMATION_CACHE_BYTES);
+
+                overlay_bytes += frame_bytes;
+                layout->n_windows++;
+        }
+
+        for (i = 0; windows && i < bg_state.n_layers; i++) {
+                overlay_bytes += bpp * bg_state.layers[i].width * bg_state.layers[i].height;
+                layout->n_windows++;
+        }
+
+        layout->upload_bytes = overlay_bytes;
+        if (width > 1 || height > 1)
+                layout->upload_bytes += bpp * width * height;
+
+        layout->server_bytes = layout->upload_bytes + layout->n_windows * WINDOW_COST_BYTES;
+}
+
+/* Whether layout a is a better choice than b: fitting in budget, if
+ * there is one, comes first, then the total cost.
+ */
+static gboolean
+better_run_layout (RunLayout *a,
+                   RunLayout *b,
+                   gsize      budget)
+{
+        gboolean a_fits = !budget || a->server_bytes <= budget;
+        gboolean b_fits = !budget || b->server_bytes <= budget;
+
+        if (a_fits != b_fits)
+                return a_fits;
+
+        return a->server_bytes + a->upload_bytes < b->server_bytes + b->upload_bytes;
+}
+
+/* Decide how to display bg_state: the cheapest layout that fits in
+ * --max-server-memory, if any does. Returns whether the emblem and
+ * layers should get their own windows, and the size of the root
+ * pixmap. With report, says what was chosen and why.
+ */
+static gboolean
+choose_run_layout (int     *tile_width,
+                   int     *tile_height,
+                   gboolean report)
+{
+        gsize budget = (gsize)max_server_memory * 1024;
+        gboolean overlays = bg_state.emblem_image || bg_state.n_layers > 0;
+        RunLayout layouts[2];
+        RunLayout *best;
+        const char *reason;
+        int n_layouts = 0;
+        int width, height;
+        int i;
+
+        if (background_get_tile_size (&bg_state, gdk_visual_get_system (), &width, &height))
+                cost_run_layout (&layouts[n_layouts++],
+                                 width == 1 && height == 1 ? "solid color" : "tiled",
+                                 width, height, overlays);
+
+        /* An animated emblem always gets its own window, so that
+         * frames don't touch the rest of the screen
+         */
+        cost_run_layout (&layouts[n_layouts++], "full screen",
+                         bg_state.width, bg_state.height, overlays && emblem_animation);
+
+        best = &layouts[0];
+        for (i = 1; i < n_layouts; i++)
+                if (better_run_layout (&layouts[i], best, budget))
+                        best = &layouts[i];
+
+        if (report) {
+                for (i = 0; i < n_layouts; i++)
+                        debugmsg ("Layout %s: %lu KB on the server, %lu KB to upload, %d window(s)\n",
+                                  layouts[i].name,
+                                  (gulong)(layouts[i].server_bytes / 1024),
+                                  (gulong)(layouts[i].upload_bytes / 1024),
+                                  layouts[i].n_windows);
+
+                if (budget && best->server_bytes > budget)
+                        fprintf (stderr, "%s: The background needs %lu KB on the X server, more than --max-server-memory\n",
+                                 appname, (gulong)(best->server_bytes / 1024));
+
+                if (n_layouts == 1)
+                        reason = "the only one possible";
+                else if (budget && best->server_bytes <= budget &&
+                         layouts[best == &layouts[0] ? 1 : 0].server_bytes > budget)
+                        reason = "the only one within --max-server-memory";
+                else
+                        reason = "the cheapest";
+
+                debugmsg ("Chose the %s layout, as %s\n", best->name, reason);
+        }
+
+        *tile_width = best->width;
+        *tile_height = best->height;
+
+        return best->windows;
+}
+
+/* With --debug, compare what the server says our pixmaps take with
+ * what we expected
+ */
+static void
+report_server_memory (void)
+{
+        gint64 bytes;
+
+        if (!debug)
+                return;
+
+        gdk_flush ();
+        bytes = measure_server_pixmap_bytes ();
+        if (bytes >= 0)
+                debugmsg ("The X server holds %lu KB of pixmaps for us\n", (gulong)(bytes / 1024));
+}
+
+/* Create window, or move and resize it if it exists */
+static GdkWindow *
+place_overlay_window (GdkWindow *window,
+                      int        x,
+                      int        y,
+                      int        width,
+                      int        height)
+{
+        GdkWindowAttr attributes;
+
+        if (window) {
+                gdk_window_move_resize (window, x, y, width, height);
+                return window;
+        }
+
+        attributes.x = x;
+        attributes.y = y;
+        attributes.width = width;
+        attributes.height = height;
+
+        attributes.window_type = GDK_WINDOW_TEMP;
+        attributes.wclass = GDK_INPUT_OUTPUT;
+        attributes.visual = gdk_visual_get_system ();
+        attributes.colormap = gdk_colormap_get_system ();
+        attributes.event_mask = 0;
+                        
+        return gdk_window_new (get_root_gdk_window (), &attributes,
+                               GDK_WA_X | GDK_WA_Y | GDK_WA_VISUAL | GDK_WA_COLORMAP);
+}
+
+/* Set the background of window, at x, y on the screen, to what is
+ * there, and show it under everything else.
+ */
+static void
+render_overlay_window (GdkWindow *window,
+                       int        x,
+                       int        y,
+                       int        width,
+                       int        height)
+{
+        GdkPixmap *pixmap;
+
+        pixmap = gdk_pixmap_new (window, width, height, -1);
+        background_render (get_render_context (), &bg_state, pixmap, FALSE,
+                           x, y, width, height);
+
+        gdk_window_set_back_pixmap (window, pixmap, FALSE);
+        g_object_unref (pixmap);
+        gdk_window_clear (window);
+
+        gdk_window_show (window);
+        gdk_window_lower (window);
+}
+
+static void
+render_emblem_window (void)
+{
+        if (emblem_window_animation) {
+                stop_emblem_animation (emblem_window_animation);
+                emblem_window_animation = NULL;
+        }
+
+        emblem_window = place_overlay_window (emblem_window,
+                                              bg_state.emblem_x, bg_state.emblem_y,
+                                              bg_state.emblem_width, bg_state.emblem_height);
+
+        if (emblem_animation) {
+                emblem_window_animation = start_emblem_animation (emblem_window);
+                gdk_window_show (emblem_window);
+                gdk_window_lower (emblem_window);
+        } else {
+                render_overlay_window (emblem_window,
+                                       bg_state.emblem_x, bg_state.emblem_y,
+                                       bg_state.emblem_width, bg_state.emblem_height);
+        }
+}
+
+static void
+destroy_emblem_window (void)
+{
+        if (emblem_window_animation) {
+                stop_emblem_animation (emblem_window_animation);
+                emblem_window_animation = NULL;
+        }
+
+        if (emblem_window) {
+                gdk_window_destroy (emblem_window);
+                emblem_window = NULL;
+        }
+}
+
+/* Give each layer a window of its own, just its size. If
+ * only_translucent, skip those where nothing under the layer shows.
+ */
+static void
+render_layer_windows (gboolean only_translucent)
+{
+        int i;
+
+        for (i = 0; i < bg_state.n_layers; i++) {
+                BGLayer *layer = &bg_state.layers[i];
+
+                if (only_translucent && layer_windows[i] &&
+                    layer->image->opaque && !layer->emboss)
+                        continue;
+
+                layer_windows[i] = place_overlay_window (layer_windows[i],
+                                                         layer->x, layer->y,
+                                                         layer->width, layer->height);
+                render_overlay_window (layer_windows[i],
+                                       layer->x, layer->y, layer->width, layer->height);
+        }
+
+        for (; i < n_layer_windows; i++) {
+                gdk_window_destroy (layer_windows[i]);
+                layer_windows[i] = NULL;
+        }
+
+        n_layer_windows = bg_state.n_layers;
+}
+
+static void
+destroy_layer_windows (void)
+{
+        int i;
+
+        for (i = 0; i < n_layer_windows; i++) {
+                gdk_window_destroy (layer_windows[i]);
+                layer_windows[i] = NULL;
+        }
+
+        n_layer_windows = 0;
+}
+
+static void schedule_trim (void);
+
+/* Put up what was rendered for bg_state: pixmap as the root window
+ * background, or the solid color if it is NULL, and the emblem and
+ * layer windows if use_emblem_window.
+ */
+static void
+show_run_render (GdkPixmap *pixmap,
+                 int        width,
+                 int        height,
+                 gboolean   use_emblem_window)
+{
+        if (root_pixmap) {
+                g_object_unref (root_pixmap);
+                root_pixmap = NULL;
+        }
+
+        if (!pixmap) {
+                XSetWindowBackground (GDK_DISPLAY(), get_root_xwindow(),
+                                      xpixel_from_color (&bg_state.bgColor1));
+                XClearWindow (GDK_DISPLAY (), get_root_xwindow ());
+        } else {
+                root_pixmap = pixmap;
+                root_pixmap_width = width;
+                root_pixmap_height = height;
+
+                gdk_window_set_back_pixmap (get_root_gdk_window (), root_pixmap, FALSE);
+                gdk_window_clear (get_root_gdk_window ());
+        }
+
+        if (use_emblem_window) {
+                if (bg_state.emblem_image)
+                        render_emblem_window ();
+                else
+                        destroy_emblem_window ();
+                render_layer_windows (FALSE);
+        } else {
+                destroy_emblem_window ();
+                destroy_layer_windows ();
+        }
+
+        overlay_windows = use_emblem_window;
+
+        report_server_memory ();
+        schedule_trim ();
+}
+
+/* Put up pixmap, rendered for new colors in the same layout as the
+ * root pixmap, and the emblem and layer windows only if the colors
+ * show through; the tile and emblem come from the images' caches.
+ */
+static void
+show_run_colors (GdkPixmap *pixmap,
+                 gboolean   use_emblem_window)
+{
+        g_object_unref (root_pixmap);
+        root_pixmap = pixmap;
+
+        /* The server may have copied the pixmap when it was set */
+        gdk_window_set_back_pixmap (get_root_gdk_window (), root_pixmap, FALSE);
+        gdk_window_clear (get_root_gdk_window ());
+
+        if (use_emblem_window && bg_state.emblem_image &&
+            (emblem_animation || bg_state.emboss || !bg_state.emblem_image->opaque))
+                render_emblem_window ();
+        if (use_emblem_window)
+                render_layer_windows (TRUE);
+
+        schedule_trim ();
+}
+
+/* Rendering again in --run mode, when the --schedule colors or the
+ * watched files change. So that this doesn't compete with what the
+ * user is doing, the root pixmap is rendered in bands of
+ * RUN_BAND_HEIGHT rows by a worker thread at idle priority, using at
+ * most --max-cpu of a CPU, and each band is sent to the server from
+ * the main loop no faster than --max-upload-rate. The bands go into
+ * a new pixmap, which replaces the one shown when it is complete.
+ *
+ * A request waits until the main loop is idle, and is merged into one
+ * already waiting (coalesced); one that comes while a render is under
+ * way cancels it, since what that is rendering is out of date.
+ */
+#define RUN_BAND_HEIGHT 64
+
+typedef struct {
+        BGState    state;               /* a copy of bg_state, with its own references */
+        gboolean   colors_only;
+        gboolean   use_emblem_window;
+        int        width;
+        int        height;
+        GdkPixmap *pixmap;
+        int        y;                   /* of the band being rendered */
+        GdkPixbuf *band;
+        gboolean   busy;                /* the worker has the job */
+        gint       cancelled;           /* set while busy, read by the worker */
+        guint      upload_id;
+        gint64     start;
+} RunJob;
+
+static struct {
+        GThreadPool *pool;
+        guint        queued_id;         /* idle to start a waiting request */
+        gboolean     colors_only;       /* of the waiting request */
+        RunJob      *job;               /* the render under way */
+        gint64       next_upload;       /* when --max-upload-rate allows another band */
+        guint        n_queued;
+        guint        n_coalesced;
+        guint        n_cancelled;
+        guint        n_done;
+        guint64      bytes_uploaded;
+} rerender;
+
+static void
+ref_state_images (BGState *state)
+{
+        int i;
+
+        if (state->tile_image)
+                bg_image_ref (state->tile_image);
+        if (state->emblem_image)
+                bg_image_ref (state->emblem_image);
+        for (i = 0; i < state->n_layers; i++)
+                bg_image_ref (state->layers[i].image);
+}
+
+static void
+unref_state_images (BGState *state)
+{
+        int i;
+
+        bg_image_unref (state->tile_image);
+        bg_image_unref (state->emblem_image);
+        for (i = 0; i < state->n_layers; i++)
+                bg_image_unref (state->layers[i].image);
+}
+
+static void
+free_run_job (RunJob *job)
+{
+        if (job->upload_id)
+                g_source_remove (job->upload_id);
+        if (job->band)
+                g_object_unref (job->band);
+        if (job->pixmap)
+                g_object_unref (job->pixmap);
+        unref_state_images (&job->state);
+        g_free (job);
+}
+
+static void
+report_rerender_stats (void)
+{
+        debugmsg ("Renders again: %u requested, %u coalesced, %u cancelled, %u done; %lu KB uploaded\n",
+                  rerender.n_queued, rerender.n_coalesced, rerender.n_cancelled, rerender.n_done,
+                  (gulong)(rerender.bytes_uploaded / 1024));
+}
+
+/* Drop the waiting request and the render under way, if any */
+static void
+cancel_rerender (void)
+{
+        RunJob *job = rerender.job;
+
+        if (rerender.queued_id) {
+                g_source_remove (rerender.queued_id);
+                rerender.queued_id = 0;
+        }
+
+        if (!job)
+                return;
+
+        debugmsg ("Cancelling the render under way\n");
+        rerender.job = NULL;
+        rerender.n_cancelled++;
+
+        /* Freed when the worker gives it back */
+        if (job->busy)
+                g_atomic_int_set (&job->cancelled, TRUE);
+        else
+                free_run_job (job);
+}
+
+static void
+render_band (gpointer data,
+             gpointer user_data);
+
+static void
+render_next_band (RunJob *job)
+{
+        if (!rerender.pool)
+                rerender.pool = g_thread_pool_new (render_band, NULL, 1, TRUE, NULL);
+
+        job->busy = TRUE;
+        g_thread_pool_push (rerender.pool, job, NULL);
+}
+
+static gboolean
+upload_band (gpointer data)
+{
+        RunJob *job = data;
+        int height = gdk_pixbuf_get_height (job->band);
+        gsize bytes = (gsize)job->width * height * get_bytes_per_pixel ();
+
+        job->upload_id = 0;
+
+        gdk_pixbuf_render_to_drawable (job->band, job->pixmap,
+                                       bg_render_context_get_gc (get_render_context (), job->pixmap),
+                                       0, 0, 0, job->y, job->width, height,
+                                       GDK_RGB_DITHER_MAX, 0, 0);
+        g_object_unref (job->band);
+        job->band = NULL;
+
+        /* Flushed now, so the rate limit applies to what is sent */
+        gdk_flush ();
+
+        rerender.bytes_uploaded += bytes;
+        if (max_upload_rate > 0)
+                rerender.next_upload = (MAX (rerender.next_upload, g_get_monotonic_time ()) +
+                                        (gint64)bytes * G_USEC_PER_SEC / ((gint64)max_upload_rate * 1024));
+
+        job->y += height;
+        if (job->y < job->height) {
+                render_next_band (job);
+                return FALSE;
+        }
+
+        debugmsg ("Rendered %dx%d in the background in %.1f ms\n", job->width, job->height,
+                  (g_get_monotonic_time () - job->start) / 1000.);
+
+        rerender.job = NULL;
+        if (job->colors_only)
+                show_run_colors (job->pixmap, job->use_emblem_window);
+        else
+                show_run_render (job->pixmap, job->width, job->height, job->use_emblem_window);
+        job->pixmap = NULL;
+        free_run_job (job);
+
+        rerender.n_done++;
+        report_rerender_stats ();
+
+        return FALSE;
+}
+
+static gboolean
+band_rendered (gpointer data)
+{
+        RunJob *job = data;
+        gint64 now = g_get_monotonic_time ();
+
+        job->busy = FALSE;
+
+        if (g_atomic_int_get (&job->cancelled)) {
+                free_run_job (job);
+                return FALSE;
+        }
+
+        if (rerender.next_upload > now)
+                job->upload_id = g_timeout_add ((rerender.next_upload - now + 999) / 1000, upload_band, job);
+        else
+                upload_band (job);
+
+        return FALSE;
+}
+
+/* Called in the worker thread */
+static void
+render_band (gpointer data,
+             gpointer user_data)
+{
+        RunJob *job = data;
+        gint64 cpu_start;
+
+        lower_thread_priority ();
+
+        /* Blurring on more threads would get past throttle_thread() */
+        bg_render_context_set_max_threads (get_render_context (), 1);
+
+        if (!g_atomic_int_get (&job->cancelled)) {
+                cpu_start = get_thread_cpu_time ();
+                job->band = background_render_pixbuf (get_render_context (), &job->state,
+                                                      job->use_emblem_window, 0, job->y, job->width,
+                                                      MIN (RUN_BAND_HEIGHT, job->height - job->y));
+                throttle_thread (cpu_start);
+        }
+
+        g_idle_add (band_rendered, job);
+}
+
+static gboolean
+start_rerender (gpointer data)
+{
+        int width, height;
+        gboolean use_emblem_window;
+        RunJob *job;
+
+        rerender.queued_id = 0;
+
+        use_emblem_window = choose_run_layout (&width, &height, !rerender.colors_only);
+
+        /* When the layout changes, everything has to be rendered */
+        if (!root_pixmap || use_emblem_window != overlay_windows ||
+            width != root_pixmap_width || height != root_pixmap_height)
+                rerender.colors_only = FALSE;
+
+        /* A solid color costs nothing to render */
+        if (width == 1 && height == 1) {
+                show_run_render (NULL, width, height, use_emblem_window);
+                rerender.n_done++;
+                report_rerender_stats ();
+                return FALSE;
+        }
+
+        debugmsg ("Rendering %dx%d in the background%s\n", width, height,
+                  rerender.colors_only ? " for the new colors" : "");
+
+        job = g_new0 (RunJob, 1);
+        job->state = bg_state;
+        ref_state_images (&job->state);
+        job->colors_only = rerender.colors_only;
+        job->use_emblem_window = use_emblem_window;
+        job->width = width;
+        job->height = height;
+        job->pixmap = gdk_pixmap_new (get_root_gdk_window (), width, height, -1);
+        job->start = g_get_monotonic_time ();
+
+        rerender.job = job;
+        render_next_band (job);
+
+        return FALSE;
+}
+
+/* Ask for bg_state to be rendered again; colors_only if only its
+ * colors changed.
+ */
+static void
+queue_rerender (gboolean colors_only)
+{
+        rerender.n_queued++;
+
+        if (rerender.queued_id) {
+                rerender.colors_only = rerender.colors_only && colors_only;
+                rerender.n_coalesced++;
+                return;
+        }
+
+        /* What the cancelled render was for never showed, so this
+         * one has to cover it too
+         */
+        if (rerender.job) {
+                colors_only = colors_only && rerender.job->colors_only;
+                cancel_rerender ();
+        }
+
+        rerender.colors_only = colors_only;
+        rerender.queued_id = g_idle_add_full (G_PRIORITY_LOW, start_rerender, NULL, NULL);
+}
+
+/* Render bg_state and put it up straight away, as when starting */
+static void
+run_render (void)
+{
+        int tile_width, tile_height;
+        gboolean use_emblem_window;
+        GdkPixmap *pixmap = NULL;
+        gint64 start;
+
+        cancel_rerender ();
+
+        use_emblem_window = choose_run_layout (&tile_width, &tile_height, TRUE);
+
+        if (root_pixmap) {
+                g_object_unref (root_pixmap);
+                root_pixmap = NULL;
+        }
+
+        if (tile_width != 1 || tile_height != 1) {
+                pixmap = gdk_pixmap_new (get_root_gdk_window (), tile_width, tile_height, -1);
+                start = g_get_monotonic_time ();
+                background_render (get_render_context (), &bg_state, pixmap, use_emblem_window,
+                                   0, 0, tile_width, tile_height);
+                debugmsg ("Rendered %dx%d in %.1f ms\n", tile_width, tile_height,
+                          (g_get_monotonic_time () - start) / 1000.);
+        }
+
+        show_run_render (pixmap, tile_width, tile_height, use_emblem_window);
+}
+
+/* Update the display after the emblem changed from being at old_rect
+ * (which may be empty). When the layout stays the same, only the
+ * emblem and layer windows, or the part of the root pixmap covered by
+ * the old and new emblems, is rendered again.
+ */
+static void
+run_render_emblem (GdkRectangle *old_rect)
+{
+        int tile_width, tile_height;
+        gboolean use_emblem_window;
+        GdkRectangle rect;
+
+        /* What is being rendered has the old emblem */
+        if (rerender.queued_id || rerender.job) {
+                queue_rerender (FALSE);
+                return;
+        }
+
+        use_emblem_window = choose_run_layout (&tile_width, &tile_height, FALSE);
+
+        if (use_emblem_window && overlay_windows && bg_state.emblem_image && root_pixmap &&
+            tile_width == root_pixmap_width && tile_height == root_pixmap_height) {
+                render_emblem_window ();
+                render_layer_windows (FALSE);
+        } else if (!use_emblem_window && !overlay_windows && root_pixmap &&
+                   root_pixmap_width == bg_state.width && root_pixmap_height == bg_state.height) {
+                GdkPixbuf *pixbuf;
+
+                if (!bg_state.emblem_image) {
+                        rect = *old_rect;
+                } else {
+                        rect.x = bg_state.emblem_x;
+                        rect.y = bg_state.emblem_y;
+                        rect.width = bg_state.emblem_width;
+                        rect.height = bg_state.emblem_height;
+                        if (old_rect->width > 0 && old_rect->height > 0)
+                                gdk_rectangle_union (&rect, old_rect, &rect);
+                }
+
+                old_rect->x = old_rect->y = 0;
+                old_rect->width = bg_state.width;
+                old_rect->height = bg_state.height;
+                if (!gdk_rectangle_intersect (&rect, old_rect, &rect))
+                        return;
+
+                pixbuf = background_render_pixbuf (get_render_context (), &bg_state, FALSE,
+                                                   rect.x, rect.y, rect.width, rect.height);
+                gdk_pixbuf_render_to_drawable (pixbuf, root_pixmap,
+                                               bg_render_context_get_gc (get_render_context (), root_pixmap),
+                                               0, 0, rect.x, rect.y, rect.width, rect.height,
+                                               GDK_RGB_DITHER_MAX, 0, 0);
+                g_object_unref (pixbuf);
+
+                gdk_window_clear_area (get_root_gdk_window (),
+                                       rect.x, rect.y, rect.width, rect.height);
+                schedule_trim ();
+        } else {
+                queue_rerender (FALSE);
+        }
+}
+
+static guint schedule_timeout_id = 0;
+
+static gboolean
+update_schedule (gpointer data)
+{
+        if (apply_schedule (&bg_state))
+                queue_rerender (TRUE);
+
+        return TRUE;
+}
+
+/* (Re)start the periodic updates of a --schedule */
+static void
+start_schedule (void)
+{
+        if (schedule_timeout_id) {
+                g_source_remove (schedule_timeout_id);
+                schedule_timeout_id = 0;
+        }
+
+        /* Nothing to update if the colors can't be seen */
+        if (!schedule || !schedule_items || stops || tile_is_hidden (&bg_state) ||
+            (bg_state.tile_image && bg_state.tile_image->opaque))
+                return;
+
+        /* In whole seconds, so the wakeups of the xsri processes of
+         * all the sessions on a host are grouped together
+         */
+        schedule_timeout_id = g_timeout_add_seconds (schedule_interval, update_schedule, NULL);
+}
+
+/* Per-desktop backgrounds. In --run mode, the rc files can have
+ * sections giving extra options for particular desktops (counting
+ * from 1):
+ *
+ *   [desktop 2]
+ *   --color=#202040 --emblem=/usr/share/pixmaps/logo.png
+ *
+ * popt skips these lines since they don't start with the program
+ * name. Each desktop's pixmap is rendered the first time it is needed
+ * and kept, so switching desktops only switches the root window's
+ * background pixmap.
+ */
+typedef struct {
+        GString   *args;
+        BGState   *state;
+        GdkPixmap *pixmap;
+        gsize      pixmap_bytes;
+} Desktop;
+
+typedef union {
+        const char *string;
+        int         integer;
+} OptionValue;
+
+static GPtrArray *desktops = NULL;      /* Desktop *, NULL for the default */
+static Desktop default_desktop;
+static Desktop *current_desktop = NULL;
+static OptionValue *cmdline_options = NULL;
+
+/* Before any options were parsed */
+static OptionValue *default_options = NULL;
+
+/* The values of the option variables from the command line (and rc
+ * file aliases) are kept, so that they can be put back after applying
+ * a desktop's options.
+ */
+static OptionValue *
+save_options (void)
+{
+        OptionValue *values = g_new0 (OptionValue, G_N_ELEMENTS (options_table) + 1);
+        guint i;
+
+        for (i = 0; i < G_N_ELEMENTS (options_table); i++) {
+                const struct poptOption *option = &options_table[i];
+
+                if (!option->arg)
+                        continue;
+
+                switch (option->argInfo & POPT_ARG_MASK) {
+                case POPT_ARG_STRING:
+                        values[i].string = *(const char **)option->arg;
+                        break;
+                case POPT_ARG_NONE:
+                case POPT_ARG_INT:
+                case POPT_ARG_VAL:
+                        values[i].integer = *(int *)option->arg;
+                        break;
+                }
+        }
+
+        /* And the --layer options added up */
+        values[i].string = layers;
+
+        return values;
+}
+
+static void
+restore_options (OptionValue *values)
+{
+        guint i;
+
+        for (i = 0; i < G_N_ELEMENTS (options_table); i++) {
+                const struct poptOption *option = &options_table[i];
+
+                if (!option->arg)
+                        continue;
+
+                switch (option->argInfo & POPT_ARG_MASK) {
+                case POPT_ARG_STRING:
+                        *(const char **)option->arg = values[i].string;
+                        break;
+                case POPT_ARG_NONE:
+                case POPT_ARG_INT:
+                case POPT_ARG_VAL:
+                        *(int *)option->arg = values[i].integer;
+                        break;
+                }
+        }
+
+        layers = values[i].string;
+}
+
+/* poptGetNextOpt() through all of context's options, adding up the
+ * --layer ones.
+ */
+static int
+get_options (poptContext context)
+{
+        int result;
+
+        while ((result = poptGetNextOpt (context)) == OPTION_LAYER)
+                layers = layers ? g_strconcat (layers, "\n", layer_arg, NULL) : g_strdup (layer_arg);
+
+        return result;
+}
+
+/* Apply a string of options, such as a line from the rc file, on top
+ * of the current values of the option variables.
+ */
+static gboolean
+parse_option_string (const char *args)
+{
+        char *command_line = g_strconcat (appname, " ", args, NULL);
+        poptContext context;
+        const char **argv;
+        int argc;
+        int result;
+
+        result = poptParseArgvString (command_line, &argc, &argv);
+        g_free (command_line);
+        if (result < 0) {
+                fprintf (stderr, "%s: %s: %s\n", appname, args, poptStrerror (result));
+                return FALSE;
+        }
+
+        context = poptGetContext (appname, argc, argv, options_table, 0);
+        result = get_options (context);
+        if (result != -1)
+                fprintf (stderr, "%s: %s: %s\n",
+                         appname,
+                         poptBadOption (context, POPT_BADOPTION_NOALIAS),
+                         poptStrerror (result));
+        else if (poptGetArg (context))
+                fprintf (stderr, "%s: Unexpected argument in: %s\n", appname, args);
+
+        poptFreeContext (context);
+        free (argv);
+
+        return result == -1;
+}
+
+/* Layers. Each --layer is a string of emblem options, such as
+ * "--emblem=badge.png --geometry=-8-8 --emblem-alpha=200", placing
+ * one more image over the emblem, later ones on top.
+ */
+typedef void (*LayerFunc) (int n, gpointer data);
+
+/* Call func for each layer, with the option variables set to their
+ * defaults plus that layer's options; afterwards, they are put back.
+ */
+static void
+foreach_layer (LayerFunc func,
+               gpointer  data)
+{
+        OptionValue *current;
+        char **items;
+        int i;
+
+        if (!layers)
+                return;
+
+        current = save_options ();
+        items = g_strsplit (layers, "\n", -1);
+
+        for (i = 0; items[i]; i++) {
+                restore_options (default_options);
+                if (parse_option_string (items[i]))
+                        func (i, data);
+        }
+
+        restore_options (current);
+        g_strfreev (items);
+        g_free (current);
+}
+
+static void
+load_layer (int      n,
+            gpointer data)
+{
+        BGState *state = data;
+        BGState layer_state = *state;
+        BGLayer *layer;
+        BGImage *image;
+
+        if (!emblem_file == !text) {
+                fprintf (stderr, "%s: Layer %d needs one of --emblem or --text\n", appname, n + 1);
+                return;
+        }
+
+        if (emblem_alpha < 0 || emblem_alpha > 255 || emblem_blur < 0) {
+                fprintf (stderr, "%s: Invalid alpha or blur for layer %d\n", appname, n + 1);
+                return;
+        }
+
+        if (state->n_layers == BG_MAX_LAYERS) {
+                fprintf (stderr, "%s: Too many layers, ignoring %s\n", appname, emblem_file ? emblem_file : text);
+                return;
+        }
+
+        /* Placing the layer works on a copy of the state, as if it
+         * were the emblem
+         */
+        layer_state.emblem_image = NULL;
+        if (emblem_file)
+                image = load_placed_emblem (&layer_state, emblem_file, "layer", TRUE, NULL, NULL);
+        else
+                image = load_placed_text (&layer_state, "layer");
+        if (!image)
+                return;
+
+        layer = &state->layers[state->n_layers++];
+        layer->image = image;
+        layer->x = layer_state.emblem_x;
+        layer->y = layer_state.emblem_y;
+        layer->width = layer_state.emblem_width;
+        layer->height = layer_state.emblem_height;
+        layer->emboss = emboss;
+        layer->blur = emblem_blur;
+}
+
+/* Load and place the layers of state; state->width and height must be
+ * set.
+ */
+static void
+load_layers (BGState *state)
+{
+        state->n_layers = 0;
+        foreach_layer (load_layer, state);
+        background_index_layers (state);
+}
+
+static void
+free_layers (BGState *state)
+{
+        int i;
+
+        for (i = 0; i < state->n_layers; i++)
+                bg_image_unref (state->layers[i].image);
+        state->n_layers = 0;
+        background_index_layers (state);
+}
+
+static void
+add_layer_file (int      n,
+                gpointer data)
+{
+        if (emblem_file)
+                g_ptr_array_add (data, (gpointer)emblem_file);
+}
+
+/* The image files of the layers, in a new array */
+static GPtrArray *
+get_layer_files (void)
+{
+        GPtrArray *files = g_ptr_array_new ();
+
+        foreach_layer (add_layer_file, files);
+
+        return files;
+}
+
+static void
+read_desktop_section_file (const char *filename,
+                           GPtrArray  *sections)
+{
+        GString *section = NULL;
+        char *contents;
+        char **lines;
+        int i;
+
+        if (!g_file_get_contents (filename, &contents, NULL, NULL))
+                return;
+
+        lines = g_strsplit (contents, "\n", -1);
+        for (i = 0; lines[i]; i++) {
+                char *line = g_strstrip (lines[i]);
+                int n;
+
+                if (sscanf (line, "[desktop %d]", &n) == 1) {
+                        if (n < 1) {
+                                fprintf (stderr, "%s: %s: Invalid desktop number %d\n",
+                                         appname, filename, n);
+                                section = NULL;
+                                continue;
+                        }
+                        if (sections->len < (guint)n)
+                                g_ptr_array_set_size (sections, n);
+
+                        section = g_ptr_array_index (sections, n - 1);
+                        if (!section) {
+                                section = g_string_new (NULL);
+                                g_ptr_array_index (sections, n - 1) = section;
+                        }
+                } else if (*line == '[') {
+                        section = NULL;
+                } else if (section && *line == '-') {
+                        g_string_append_c (section, ' ');
+                        g_string_append (section, line);
+                }
+        }
+
+        g_strfreev (lines);
+        g_free (contents);
+}
+
+static void
+read_desktop_sections (const char *userrc)
+{
+        GPtrArray *user_sections = g_ptr_array_new ();
+        GPtrArray *system_sections = g_ptr_array_new ();
+        guint i;
+
+        read_desktop_section_file (userrc, user_sections);
+        read_desktop_section_file (SYSCONFDIR "/X11/xsrirc", system_sections);
+
+        /* Like the aliases, the user's sections come first */
+        for (i = 0; i < MAX (user_sections->len, system_sections->len); i++) {
+                GString *args = i < user_sections->len ? g_ptr_array_index (user_sections, i) : NULL;
+                Desktop *desktop;
+
+                if (i < system_sections->len && g_ptr_array_index (system_sections, i)) {
+                        if (args)
+                                g_string_free (g_ptr_array_index (system_sections, i), TRUE);
+                        else
+                                args = g_ptr_array_index (system_sections, i);
+                }
+
+                if (!desktops)
+                        desktops = g_ptr_array_new ();
+
+                desktop = NULL;
+                if (args) {
+                        desktop = g_new0 (Desktop, 1);
+                        desktop->args = args;
+                }
+                g_ptr_array_add (desktops, desktop);
+        }
+
+        g_ptr_array_free (user_sections, TRUE);
+        g_ptr_array_free (system_sections, TRUE);
+
+        per_desktop = desktops != NULL;
+}
+
+static Desktop *
+get_desktop (int n)
+{
+        Desktop *desktop = NULL;
+
+        if (n >= 0 && (guint)n < desktops->len)
+                desktop = g_ptr_array_index (desktops, n);
+
+        return desktop ? desktop : &default_desktop;
+}
+
+static int
+get_current_desktop (void)
+{
+        Atom type;
+        int format;
+        gulong nitems, bytes_after;
+        guchar *data;
+        int desktop = 0;
+
+        if (XGetWindowProperty (GDK_DISPLAY (), GDK_ROOT_WINDOW (),
+                                gdk_x11_get_xatom_by_name ("_NET_CURRENT_DESKTOP"),
+                                0L, 1L, False, XA_CARDINAL,
+                                &type, &format, &nitems, &bytes_after,
+                                &data) == Success && data) {
+                if (type == XA_CARDINAL && format == 32 && nitems == 1)
+                        desktop = *(long *)data;
+                XFree (data);
+        }
+
+        return desktop;
+}
+
+static void
+report_desktop_memory (int n)
+{
+        gsize image_bytes = 0;
+        gsize pixmap_bytes = default_desktop.pixmap_bytes;
+        guint i;
+
+        if (!debug)
+                return;
+
+        if (image_cache) {
+                GHashTableIter iter;
+                gpointer image;
+
+                g_hash_table_iter_init (&iter, image_cache);
+                while (g_hash_table_iter_next (&iter, NULL, &image))
+                        image_bytes += bg_image_get_memory (image);
+        }
+
+        for (i = 0; i < desktops->len; i++) {
+                Desktop *desktop = g_ptr_array_index (desktops, i);
+                if (desktop)
+                        pixmap_bytes += desktop->pixmap_bytes;
+        }
+
+        debugmsg ("Rendered desktop %d: %lu KB of pixmaps on the server, %lu KB of decoded images\n",
+                  n + 1, (gulong)(pixmap_bytes / 1024), (gulong)(image_bytes / 1024));
+}
+
+/* Bytes of pixmaps we hold for desktops; what the server measures,
+ * if it can, since that includes anything it added.
+ */
+static gsize
+get_desktop_pixmap_bytes (void)
+{
+        gint64 measured = measure_server_pixmap_bytes ();
+        gsize bytes = default_desktop.pixmap_bytes;
+        guint i;
+
+        if (measured >= 0)
+                return measured;
+
+        for (i = 0; i < desktops->len; i++) {
+                Desktop *desktop = g_ptr_array_index (desktops, i);
+                if (desktop)
+                        bytes += desktop->pixmap_bytes;
+        }
+
+        return bytes;
+}
+
+/* Free the pixmaps of desktops other than the one shown until we are
+ * back within --max-server-memory; they are rendered again when they
+ * are next shown.
+ */
+static void
+trim_desktop_pixmaps (Desktop *keep)
+{
+        gsize budget = (gsize)max_server_memory * 1024;
+        guint i;
+
+        if (!budget)
+                return;
+
+        for (i = 0; i <= desktops->len && get_desktop_pixmap_bytes () > budget; i++) {
+                Desktop *desktop = i < desktops->len ? g_ptr_array_index (desktops, i) : &default_desktop;
+
+                if (!desktop || desktop == keep || desktop == current_desktop || !desktop->pixmap)
+                        continue;
+
+                debugmsg ("Freeing a desktop pixmap to stay within --max-server-memory\n");
+                g_object_unref (desktop->pixmap);
+                desktop->pixmap = NULL;
+                desktop->pixmap_bytes = 0;
+                gdk_flush ();
+        }
+}
+
+static void
+render_desktop (Desktop *desktop)
+{
+        int tile_width, tile_height;
+        int depth;
+
+        if (!desktop->state) {
+                BGState *state = g_new0 (BGState, 1);
+
+                restore_options (cmdline_options);
+                parse_option_string (desktop->args->str);
+
+                state->width = bg_state.width;
+                state->height = bg_state.height;
+                parse_colors (state);
+                load_images (state);
+
+                restore_options (cmdline_options);
+                desktop->state = state;
+        }
+
+        /* As for --set, the emblem can't go in its own window since
+         * the whole background has to change at once.
+         */
+        if (desktop->state->emblem_image || desktop->state->n_layers > 0 ||
+            !background_get_tile_size (desktop->state, gdk_visual_get_system (),
+                                       &tile_width, &tile_height)) {
+                tile_width = desktop->state->width;
+                tile_height = desktop->state->height;
+        }
+
+        desktop->pixmap = gdk_pixmap_new (get_root_gdk_window (), tile_width, tile_height, -1);
+        background_render (get_render_context (), desktop->state, desktop->pixmap, FALSE,
+                           0, 0, tile_width, tile_height);
+
+        depth = gdk_drawable_get_depth (desktop->pixmap);
+        desktop->pixmap_bytes = (gsize)tile_width * tile_height * (depth > 16 ? 4 : depth > 8 ? 2 : 1);
+
+        schedule_trim ();
+}
+
+static void
+show_desktop (int n)
+{
+        Desktop *desktop = get_desktop (n);
+
+        if (desktop == current_desktop)
+                return;
+
+        if (!desktop->pixmap) {
+                render_desktop (desktop);
+                report_desktop_memory (n);
+        }
+
+        gdk_window_set_back_pixmap (get_root_gdk_window (), desktop->pixmap, FALSE);
+        gdk_window_clear (get_root_gdk_window ());
+        gdk_flush ();
+
+        current_desktop = desktop;
+
+        trim_desktop_pixmaps (desktop);
+}
+
+static gboolean
+prerender_desktops (gpointer data)
+{
+        guint i;
+
+        for (i = 0; i < desktops->len; i++) {
+                Desktop *desktop = g_ptr_array_index (desktops, i);
+
+                if (desktop && !desktop->pixmap) {
+                        gsize budget = (gsize)max_server_memory * 1024;
+                        int width, height;
+
+                        /* Only render ahead what fits; the rest waits
+                         * until it is shown
+                         */
+                        if (budget && desktop->state) {
+                                if (!background_get_tile_size (desktop->state, gdk_visual_get_system (),
+                                                               &width, &height) ||
+                                    desktop->state->emblem_image || desktop->state->n_layers > 0) {
+                                        width = desktop->state->width;
+                                        height = desktop->state->height;
+                                }
+                        } else {
+                                width = bg_state.width;
+                                height = bg_state.height;
+                        }
+
+                        if (budget &&
+                            get_desktop_pixmap_bytes () + (gsize)width * height * get_bytes_per_pixel () > budget) {
+                                debugmsg ("Not rendering the other desktops ahead, to stay within --max-server-memory\n");
+                                return FALSE;
+                        }
+
+                        render_desktop (desktop);
+                        report_desktop_memory (i);
+
+                        return TRUE;
+                }
+        }
+
+        return FALSE;
+}
+
+static GdkFilterReturn
+root_property_filter (GdkXEvent *xevent,
+                      GdkEvent  *event,
+                      gpointer   data)
+{
+        XEvent *xev = xevent;
+
+        if (xev->type == PropertyNotify &&
+            xev->xproperty.atom == gdk_x11_get_xatom_by_name ("_NET_CURRENT_DESKTOP"))
+                show_desktop (get_current_desktop ());
+
+        return GDK_FILTER_CONTINUE;
+}
+
+static void
+start_desktops (void)
+{
+        GdkWindow *root = gdk_get_default_root_window ();
+
+        cmdline_options = save_options ();
+        default_desktop.state = &bg_state;
+
+        gdk_window_set_events (root, gdk_window_get_events (root) | GDK_PROPERTY_CHANGE_MASK);
+        gdk_window_add_filter (root, root_property_filter, NULL);
+
+        show_desktop (get_current_desktop ());
+
+        /* Render the rest ahead of time, when there's nothing else to do */
+        g_idle_add_full (G_PRIORITY_LOW, prerender_desktops, NULL, NULL);
+}
+
+/* Idle memory trimming in --run mode. Once nothing has been rendered
+ * for --idle-trim seconds, the decoded images are kept only in a
+ * form the kernel can drop and read back as needed, a mapping of a
+ * file under the user's cache directory, their scaled and blurred
+ * copies are freed, and so are the scratch buffers of rendering.
+ * Rendering again brings back what it touches. Slideshows are left
+ * alone, since they render all the time.
+ */
+static guint trim_timeout_id = 0;
+static guint n_trims = 0;
+
+/* Resident memory of the process, or 0 if unknown */
+static gsize
+get_resident_bytes (void)
+{
+        unsigned long size, resident = 0;
+        FILE *f;
+
+        f = fopen ("/proc/self/statm", "r");
+        if (f) {
+                if (fscanf (f, "%lu %lu", &size, &resident) != 2)
+                        resident = 0;
+                fclose (f);
+        }
+
+        return (gsize)resident * sysconf (_SC_PAGESIZE);
+}
+
+/* Whether state draws image, so that its scaled, blurred and other
+ * copies are what the next render, say for --schedule, draws from.
+ */
+static gboolean
+state_draws_image (BGState *state,
+                   BGImage *image)
+{
+        int i;
+
+        if (image == state->tile_image || image == state->emblem_image)
+                return TRUE;
+
+        for (i = 0; i < state->n_layers; i++)
+                if (image == state->layers[i].image)
+                        return TRUE;
+
+        return FALSE;
+}
+
+/* Images being written out by a page-out thread, to be switched over
+ * to their files back in the main loop.
+ */
+typedef struct {
+        GPtrArray *images;              /* BGImage *, referenced */
+        int       *fds;
+        char      *dir;
+        gsize      before;
+} PageOut;
+
+static PageOut *page_out = NULL;
+
+static void
+finish_trim (gsize before)
+{
+        gsize after;
+
+#ifdef __GLIBC__
+        malloc_trim (0);
+#endif
+
+        after = get_resident_bytes ();
+        n_trims++;
+
+        debugmsg ("Trimmed idle memory (%u times): %lu KB resident before, %lu KB after\n",
+                  n_trims, (gulong)(before / 1024), (gulong)(after / 1024));
+}
+
+static void
+free_page_out (void)
+{
+        g_ptr_array_free (page_out->images, TRUE);
+        g_free (page_out->fds);
+        g_free (page_out->dir);
+        g_free (page_out);
+        page_out = NULL;
+}
+
+static gboolean
+pages_written (gpointer data)
+{
+        /* A render started meanwhile may be reading the pixels */
+        gboolean busy = rerender.queued_id || rerender.job;
+        guint i;
+
+        for (i = 0; i < page_out->images->len; i++) {
+                BGImage *image = g_ptr_array_index (page_out->images, i);
+                int fd = page_out->fds[i];
+                GError *error = NULL;
+
+                if (fd < 0)
+                        continue;
+
+                if (busy)
+                        close (fd);
+                else if (!bg_image_page_out (image, fd, &error)) {
+                        debugmsg ("Cannot page out an image: %s\n", error->message);
+                        g_error_free (error);
+                }
+        }
+
+        if (!busy)
+                finish_trim (page_out->before);
+
+        free_page_out ();
+
+        return FALSE;
+}
+
+/* Called in the page-out thread; writing the files can take a while,
+ * with the cache directory on a network file system.
+ */
+static gpointer
+write_page_files (gpointer data)
+{
+        guint i;
+
+        lower_thread_priority ();
+
+        for (i = 0; i < page_out->images->len; i++) {
+                GError *error = NULL;
+
+                page_out->fds[i] = bg_image_write_page_file (g_ptr_array_index (page_out->images, i),
+                                                             page_out->dir, &error);
+                if (page_out->fds[i] < 0) {
+                        debugmsg ("Cannot page out an image: %s\n", error->message);
+                        g_error_free (error);
+                }
+        }
+
+        g_idle_add (pages_written, NULL);
+
+        return NULL;
+}
+
+/* Drop what the next render doesn't need and queue image to be paged
+ * out, unless it already is, when its pages are just dropped.
+ */
+static void
+trim_image (BGImage *image)
+{
+        guint i;
+
+        if (!state_draws_image (&bg_state, image))
+                bg_image_drop_caches (image);
+
+        if (image->mapping) {
+                bg_image_page_out (image, -1, NULL);
+                return;
+        }
+
+        for (i = 0; i < page_out->images->len; i++)
+                if (g_ptr_array_index (page_out->images, i) == image)
+                        return;
+
+        g_ptr_array_add (page_out->images, bg_image_ref (image));
+}
+
+static gboolean
+trim_memory (gpointer data)
+{
+        trim_timeout_id = 0;
+
+        /* The render will ask again when it is done, and a page-out
+         * still going will do
+         */
+        if (rerender.queued_id || rerender.job || page_out)
+                return FALSE;
+
+        page_out = g_new0 (PageOut, 1);
+        page_out->images = g_ptr_array_new_with_free_func ((GDestroyNotify)bg_image_unref);
+        page_out->dir = g_build_filename (g_get_user_cache_dir (), "xsri", NULL);
+        page_out->before = get_resident_bytes ();
+
+        /* Everything decoded from files is in the cache; the first
+         * frame of an animated emblem isn't
+         */
+        if (image_cache) {
+                GHashTableIter iter;
+                gpointer image;
+
+                g_hash_table_iter_init (&iter, image_cache);
+                while (g_hash_table_iter_next (&iter, NULL, &image))
+                        trim_image (image);
+        }
+        if (bg_state.emblem_image)
+                trim_image (bg_state.emblem_image);
+
+        trim_render_contexts ();
+
+        if (page_out->images->len == 0) {
+                finish_trim (page_out->before);
+                free_page_out ();
+        } else if (g_mkdir_with_parents (page_out->dir, 0700) < 0) {
+                debugmsg ("Cannot page out images to %s: %s\n", page_out->dir, g_strerror (errno));
+                finish_trim (page_out->before);
+                free_page_out ();
+        } else {
+                page_out->fds = g_new (int, page_out->images->len);
+                g_thread_unref (g_thread_new ("page-out", write_page_files, NULL));
+        }
+
+        return FALSE;
+}
+
+/* Trim memory once --idle-trim seconds pass without this being called
+ * again; called after each render in --run mode.
+ */
+static void
+schedule_trim (void)
+{
+        if (run_mode != RUN_MODE_RUN || slideshow || idle_trim == 0)
+                return;
+
+        if (trim_timeout_id)
+                g_source_remove (trim_timeout_id);
+
+        trim_timeout_id = g_timeout_add_seconds (idle_trim, trim_memory, NULL);
+}
+
+static char *userrc;
+static int saved_argc;
+static char **saved_argv;
+
+/* Parse the command line and rc files into the option variables.
+ * Prints a message and returns FALSE if they are bad.
+ */
+static gboolean
+parse_options (int    argc,
+               char **argv)
+{
+        poptContext opt_context;
+        int result;
+        const char *arg;
+
+        opt_context = poptGetContext (appname, argc, (const char **)argv,
+                                      options_table, 0);
+
+        poptReadConfigFile (opt_context, userrc);
+        poptReadConfigFile (opt_context, SYSCONFDIR "/X11/xsrirc");
+                            
+        result = get_options (opt_context);
+        if (result != -1) {
+                fprintf(stderr, "%s: %s: %s\n",
+                        appname,
+                        poptBadOption(opt_context, POPT_BADOPTION_NOALIAS),
+                        poptStrerror(result));
+                return FALSE;
+        }
+
+        arg = poptGetArg (opt_context);
+        if (arg) {
+                if (!emblem_file) {
+                        emblem_file = arg;
+                        arg = poptGetArg (opt_context);
+                }
+        }
+
+        if (arg) {
+                poptPrintUsage (opt_context, stderr, 0);
+                return FALSE;
+        }
+
+        /* The context isn't freed, since the option variables may
+         * point into it.
+         */
+        return TRUE;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* --watch. When an image changes, only it is decoded again, and if
+ * possible only the emblem is rendered again; when an rc file changes
+ * the options are parsed again and everything is redone.
+ */
+enum {
+        WATCH_TILE   = 1 << 0,
+        WATCH_EMBLEM = 1 << 1,
+        WATCH_RC     = 1 << 2,
+        WATCH_LAYERS = 1 << 3
+};
+
+#define WATCH_DELAY 300         /* milliseconds */
+
+static FileWatch *file_watch = NULL;
+
+static void
+add_watched_files (void)
+{
+        GPtrArray *files;
+        guint i;
+
+        if (tile_file)
+                file_watch_add (file_watch, tile_file, WATCH_TILE);
+        if (emblem_file)
+                file_watch_add (file_watch, emblem_file, WATCH_EMBLEM);
+        file_watch_add (file_watch, userrc, WATCH_RC);
+        file_watch_add (file_watch, SYSCONFDIR "/X11/xsrirc", WATCH_RC);
+
+        files = get_layer_files ();
+        for (i = 0; i < files->len; i++)
+                file_watch_add (file_watch, g_ptr_array_index (files, i), WATCH_LAYERS);
+        g_ptr_array_free (files, TRUE);
+}
+
+static gboolean
+reparse_options (void)
+{
+        OptionValue *current = save_options ();
+        gboolean result;
+
+        restore_options (default_options);
+        result = parse_options (saved_argc, saved_argv);
+        if (!result)
+                restore_options (current);
+
+        g_free (current);
+
+        return result;
+}
+
+static void
+unload_emblem (void)
+{
+        bg_image_unref (bg_state.emblem_image);
+        bg_state.emblem_image = NULL;
+
+        if (emblem_window_animation) {
+                stop_emblem_animation (emblem_window_animation);
+                emblem_window_animation = NULL;
+        }
+
+        if (emblem_animation) {
+                g_object_unref (emblem_animation);
+                emblem_animation = NULL;
+        }
+}
+
+static void
+files_changed (guint    changes,
+               gpointer data)
+{
+        if (changes & WATCH_TILE)
+                forget_image (tile_file);
+        if (changes & WATCH_EMBLEM)
+                forget_image (emblem_file);
+        if (changes & WATCH_LAYERS) {
+                GPtrArray *files = get_layer_files ();
+                guint i;
+
+                for (i = 0; i < files->len; i++)
+                        forget_image (g_ptr_array_index (files, i));
+                g_ptr_array_free (files, TRUE);
+        }
+
+        if ((changes & WATCH_RC) && reparse_options ()) {
+                int width = bg_state.width;
+                int height = bg_state.height;
+
+                debugmsg ("Configuration changed, rendering everything again\n");
+
+                bg_image_unref (bg_state.tile_image);
+                unload_emblem ();
+                free_layers (&bg_state);
+
+                memset (&bg_state, 0, sizeof (bg_state));
+                bg_state.width = width;
+                bg_state.height = height;
+
+                parse_colors (&bg_state);
+                load_images (&bg_state);
+
+                queue_rerender (FALSE);
+                start_schedule ();
+
+                file_watch_clear (file_watch);
+                add_watched_files ();
+
+                return;
+        }
+
+        /* Everything under a layer shows in its window, so this
+         * is handled like the tile changing
+         */
+        if (changes & WATCH_LAYERS) {
+                debugmsg ("Layers changed\n");
+
+                free_layers (&bg_state);
+                load_layers (&bg_state);
+                changes |= WATCH_TILE;
+        }
+
+        if (changes & WATCH_EMBLEM) {
+                GdkRectangle old_rect = { 0, 0, 0, 0 };
+
+                if (bg_state.emblem_image) {
+                        old_rect.x = bg_state.emblem_x;
+                        old_rect.y = bg_state.emblem_y;
+                        old_rect.width = bg_state.emblem_width;
+                        old_rect.height = bg_state.emblem_height;
+                }
+
+                unload_emblem ();
+                load_emblem (&bg_state);
+
+                /* The tile may have become visible, or hidden */
+                if (tile_file && (bg_state.tile_image == NULL) != tile_is_hidden (&bg_state))
+                        changes |= WATCH_TILE;
+
+                if (!(changes & WATCH_TILE)) {
+                        debugmsg ("Emblem changed\n");
+                        run_render_emblem (&old_rect);
+                }
+        }
+
+        if (changes & WATCH_TILE) {
+                debugmsg ("Tile changed\n");
+
+                bg_image_unref (bg_state.tile_image);
+                load_tile (&bg_state);
+                queue_rerender (FALSE);
+        }
+}
+
+static void
+start_watching (void)
+{
+        file_watch = file_watch_new (WATCH_DELAY, files_changed, NULL);
+        if (!file_watch) {
+                fprintf (stderr, "%s: Cannot watch files: %s\n", appname, g_strerror (errno));
+                return;
+        }
+
+        add_watched_files ();
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/* Pick the size of pixmap to set as the root background of a screen
+ * with visual: one period of the tiling when there is no emblem or
+ * layer, otherwise the whole screen.
+ */
+static void
+get_root_pixmap_size (BGState   *state,
+                      GdkVisual *visual,
+                      int       *width,
+                      int       *height)
+{
+        if (state->emblem_image || state->n_layers > 0 ||
+            !background_get_tile_size (state, visual, width, height)) {
+                *width = state->width;
+                *height = state->height;
+        }
+}
+
+/* Make pixmap, holding what pixbuf does, the background of screen */
+static void
+publish_root (GdkScreen *screen,
+              GdkPixmap *pixmap,
+              GdkPixbuf *pixbuf)
+{
+        set_root_pixmap (screen, pixmap);
+
+        /* The shared memory object is only any use to clients on this
+         * machine
+         */
+        if (gdk_screen_get_display (screen) == gdk_display_get_default ())
+                set_root_buffer (screen, pixmap, pixbuf);
+
+        dispose_root_pixmap (pixmap);
+}
+
+/* Set pixbuf, rendered for state at the size from
+ * get_root_pixmap_size(), as the background of screen
+ */
+static void
+set_root_from_pixbuf (GdkScreen *screen,
+                      GdkPixbuf *pixbuf)
+{
+        GdkPixmap *pixmap;
+
+        /* We could set_root_color if tile_width == 1 && tile_height == 1),
+         * but transparent-terminal apps need the pixmap. Could
+         * use set_root_color and set the pixmap...
+         */
+        pixmap = make_root_pixmap (screen,
+                                   gdk_pixbuf_get_width (pixbuf),
+                                   gdk_pixbuf_get_height (pixbuf));
+        background_draw_pixbuf (get_render_context (), pixbuf, pixmap, 0, 0);
+        publish_root (screen, pixmap, pixbuf);
+}
+
+/* --set with stream_emblem: the rows of the screen down to the bottom
+ * of what has been decoded of the emblem are rendered and sent to the
+ * server as they become complete, so that decoding, rendering and
+ * uploading overlap.
+ */
+typedef struct {
+        BGState   *state;
+        GdkPixbuf *pixbuf;
+        GdkPixmap *pixmap;
+        int        rows;        /* top rows of the screen sent */
+} RootStream;
+
+/* Fewest rows sent at a time, except at the end */
+#define ROOT_STREAM_ROWS 32
+
+static void
+send_root_rows (RootStream *stream,
+                int         y,
+                int         height)
+{
+        int width = gdk_pixbuf_get_width (stream->pixbuf);
+        GdkPixbuf *band;
+
+        if (height <= 0)
+                return;
+
+        band = gdk_pixbuf_new_subpixbuf (stream->pixbuf, 0, y, width, height);
+        background_render_to_pixbuf (get_render_context (), stream->state, band, FALSE, 0, y);
+        g_object_unref (band);
+
+        gdk_draw_pixbuf (stream->pixmap, NULL, stream->pixbuf, 0, y, 0, y, width, height,
+                         GDK_RGB_DITHER_MAX, 0, 0);
+        gdk_flush ();
+}
+
+static void
+emblem_rows_decoded (BGImage *image,
+                     int      y,
+                     int      height,
+                     gpointer data)
+{
+        RootStream *stream = data;
+        int top = stream->state->emblem_y + y;
+        int bottom = MIN (top + height, stream->state->height);
+
+        stream->state->emblem_image = image;
+
+        /* Rows decoded again have to be sent again; new ones wait
+         * until there are enough of them
+         */
+        if (top >= stream->rows && bottom - stream->rows < ROOT_STREAM_ROWS)
+                return;
+
+        top = MIN (top, stream->rows);
+        send_root_rows (stream, top, bottom - top);
+        stream->rows = MAX (stream->rows, bottom);
+}
+
+static void
+set_root_streaming (GdkScreen *screen,
+                    BGState   *state)
+{
+        RootStream stream;
+
+        stream.state = state;
+        stream.pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, state->width, state->height);
+        stream.pixmap = make_root_pixmap (screen, state->width, state->height);
+        stream.rows = 0;
+
+        state->emblem_image = load_placed_emblem (state, emblem_file, "emblem", FALSE,
+                                                  emblem_rows_decoded, &stream);
+
+        /* If it failed part way, what was sent has some of it */
+        if (!state->emblem_image)
+                stream.rows = 0;
+
+        send_root_rows (&stream, stream.rows, state->height - stream.rows);
+
+        publish_root (screen, stream.pixmap, stream.pixbuf);
+        g_object_unref (stream.pixbuf);
+}
+
+static gboolean
+parse_size (const char *str,
+            int        *width,
+            int        *height)
+{
+        char c;
+
+        return (sscanf (str, "%dx%d%c", width, height, &c) == 2 &&
+                *width > 0 && *height > 0);
+}
+
+/* Save pixbuf as PNG, or JPEG if filename ends in .jpg or .jpeg */
+static gboolean
+save_pixbuf (GdkPixbuf  *pixbuf,
+             const char *filename,
+             GError    **error)
+{
+        const char *type = "png";
+        const char *extension = strrchr (filename, '.');
+
+        if (extension &&
+            (g_ascii_strcasecmp (extension, ".jpg") == 0 ||
+             g_ascii_strcasecmp (extension, ".jpeg") == 0))
+                type = "jpeg";
+
+        return gdk_pixbuf_save (pixbuf, filename, type, error, NULL);
+}
+
+/* Render state and save it to filename. The type of file is picked
+ * from the extension, PNG if it isn't recognized.
+ */
+static gboolean
+write_output_file (BGState    *state,
+                   const char *filename,
+                   GError    **error)
+{
+        GdkPixbuf *pixbuf;
+        gboolean result;
+        gint64 start = g_get_monotonic_time ();
+
+        pixbuf = background_render_pixbuf (get_render_context (), state, FALSE, 0, 0, state->width, state->height);
+        debugmsg ("Rendered %dx%d in %.1f ms\n", state->width, state->height,
+                  (g_get_monotonic_time () - start) / 1000.);
+
+        result = save_pixbuf (pixbuf, filename, error);
+        g_object_unref (pixbuf);
+
+        return result;
+}
+
+/* --dump-root: what was set, read back from the server, to compare
+ * against what was expected
+ */
+static gboolean
+write_root_file (const char *filename)
+{
+        GError *error = NULL;
+        GdkPixbuf *pixbuf = get_root_pixbuf (gdk_screen_get_default ());
+
+        if (!pixbuf) {
+                fprintf (stderr, "%s: Cannot read the background of the screen\n", appname);
+                return FALSE;
+        }
+
+        if (!save_pixbuf (pixbuf, filename, &error)) {
+                fprintf (stderr, "%s: Cannot write %s: %s\n", appname, filename, error->message);
+                g_error_free (error);
+                g_object_unref (pixbuf);
+                return FALSE;
+        }
+
+        g_object_unref (pixbuf);
+        return TRUE;
+}
+
+/* --batch and --all-screens. For --batch each line of the file is a
+ * set of options, applied on top of those from the command line, with
+ * either --output or --output-display saying where the result goes;
+ * for --all-screens there is a job for each different screen size.
+ * The jobs are all set up first, so that we know how many use each
+ * image; images are loaded through the image cache on the main thread,
+ * then dropped once the last job using them is done, so a tile shared
+ * by every job is only decoded once, along with its scaled copies.
+ * Rendering, and writing files, happens on a thread pool; setting the
+ * background of a screen happens back on the main thread.
+ */
+typedef struct {
+        char        *name;              /* for messages */
+        OptionValue *options;
+        const char  *tile_file;
+        const char  *emblem_file;
+        GPtrArray   *layer_files;
+        const char  *output;
+        GSList      *screens;           /* if not writing a file */
+        GdkVisual   *visual;            /* of the screens, looked up on the main thread */
+        BGState      state;
+        GdkPixbuf   *pixbuf;            /* rendered for screens */
+        GError      *error;
+} BatchJob;
+
+static GAsyncQueue *batch_done = NULL;
+static GHashTable *batch_file_uses = NULL;     /* filename => number of jobs */
+static GHashTable *batch_displays = NULL;      /* name => GdkDisplay */
+
+static void
+use_batch_file (const char *filename)
+{
+        if (!batch_file_uses)
+                batch_file_uses = g_hash_table_new (g_str_hash, g_str_equal);
+
+        if (filename)
+                g_hash_table_insert (batch_file_uses, (gpointer)filename,
+                                     GINT_TO_POINTER (GPOINTER_TO_INT (g_hash_table_lookup (batch_file_uses, filename)) + 1));
+}
+
+static void
+unuse_batch_file (const char *filename)
+{
+        int uses;
+
+        if (!filename)
+                return;
+
+        uses = GPOINTER_TO_INT (g_hash_table_lookup (batch_file_uses, filename)) - 1;
+        if (uses > 0) {
+                g_hash_table_insert (batch_file_uses, (gpointer)filename, GINT_TO_POINTER (uses));
+        } else {
+                g_hash_table_remove (batch_file_uses, filename);
+                forget_image (filename);
+        }
+}
+
+/* Make a job from the current values of the option variables */
+static BatchJob *
+new_batch_job (char *name)
+{
+        BatchJob *job = g_new0 (BatchJob, 1);
+        guint i;
+
+        job->name = name;
+        job->options = save_options ();
+        job->tile_file = tile_file;
+        job->emblem_file = emblem_file;
+        job->layer_files = get_layer_files ();
+        job->output = output;
+
+        use_batch_file (tile_file);
+        use_batch_file (emblem_file);
+        for (i = 0; i < job->layer_files->len; i++)
+                use_batch_file (g_ptr_array_index (job->layer_files, i));
+
+        return job;
+}
+
+static BatchJob *
+parse_batch_line (const char *filename,
+                  int         line_number,
+                  const char *line)
+{
+        char *name = g_strdup_printf ("%s:%d", filename, line_number);
+        int width, height;
+
+        if (!parse_option_string (line))
+                goto bad;
+
+        if (!output == !output_display) {
+                fprintf (stderr, "%s: %s: Need one of --output or --output-display\n",
+                         appname, name);
+                goto bad;
+        }
+
+        if (output && !size && !gdk_display_get_default ()) {
+                fprintf (stderr, "%s: %s: Need --size when there is no display\n",
+                         appname, name);
+                goto bad;
+        }
+
+        if (size && !parse_size (size, &width, &height)) {
+                fprintf (stderr, "%s: %s: Invalid size: %s\n",
+                         appname, name, size);
+                goto bad;
+        }
+
+        return new_batch_job (name);
+
+ bad:
+        g_free (name);
+        return NULL;
+}
+
+static GdkScreen *
+open_batch_screen (const char *name)
+{
+        GdkDisplay *display;
+
+        if (!batch_displays)
+                batch_displays = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+        display = g_hash_table_lookup (batch_displays, name);
+        if (!display) {
+                display = gdk_display_open (name);
+                if (!display)
+                        return NULL;
+                
+                g_hash_table_insert (batch_displays, g_strdup (name), display);
+        }
+
+        return gdk_display_get_default_screen (display);
+}
+
+/* Set up job->state from the option variables */
+static gboolean
+prepare_batch_job (BatchJob *job)
+{
+        BGState *state = &job->state;
+
+        if (!job->screens && output_display) {
+                GdkScreen *screen = open_batch_screen (output_display);
+
+                if (!screen) {
+                        fprintf (stderr, "%s: %s: Cannot open display %s\n",
+                                 appname, job->name, output_display);
+                        return FALSE;
+                }
+
+                job->screens = g_slist_prepend (NULL, screen);
+        }
+
+        if (job->screens) {
+                job->visual = gdk_screen_get_system_visual (job->screens->data);
+                state->width = gdk_screen_get_width (job->screens->data);
+                state->height = gdk_screen_get_height (job->screens->data);
+        } else if (size) {
+                parse_size (size, &state->width, &state->height);
+        } else {
+                state->width = gdk_screen_width ();
+                state->height = gdk_screen_height ();
+        }
+
+        /* Options such as --run in the file don't apply */
+        run_mode = RUN_MODE_SET;
+
+        parse_colors (state);
+        load_images (state);
+
+        return TRUE;
+}
+
+static void
+render_batch_job (gpointer data,
+                  gpointer user_data)
+{
+        BatchJob *job = data;
+
+        if (job->screens) {
+                int width, height;
+
+                get_root_pixmap_size (&job->state, job->visual, &width, &height);
+                job->pixbuf = background_render_pixbuf (get_render_context (), &job->state, FALSE, 0, 0, width, height);
+        } else {
+                write_output_file (&job->state, job->output, &job->error);
+        }
+
+        g_async_queue_push (batch_done, job);
+}
+
+static gboolean
+finish_batch_job (BatchJob *job)
+{
+        gboolean result = TRUE;
+        GSList *tmp_list;
+        guint i;
+
+        if (job->error) {
+                fprintf (stderr, "%s: %s: Cannot write %s: %s\n",
+                         appname, job->name, job->output, job->error->message);
+                g_error_free (job->error);
+                result = FALSE;
+        } else if (job->pixbuf) {
+                for (tmp_list = job->screens; tmp_list; tmp_list = tmp_list->next)
+                        set_root_from_pixbuf (tmp_list->data, job->pixbuf);
+                g_object_unref (job->pixbuf);
+        }
+
+        debugmsg ("%s: Done\n", job->name);
+
+        bg_image_unref (job->state.tile_image);
+        bg_image_unref (job->state.emblem_image);
+        free_layers (&job->state);
+        unuse_batch_file (job->tile_file);
+        unuse_batch_file (job->emblem_file);
+        for (i = 0; i < job->layer_files->len; i++)
+                unuse_batch_file (g_ptr_array_index (job->layer_files, i));
+        g_ptr_array_free (job->layer_files, TRUE);
+
+        g_slist_free (job->screens);
+        g_free (job->options);
+        g_free (job->name);
+        g_free (job);
+
+        return result;
+}
+
+/* Run jobs, which are freed. Returns FALSE if any failed. */
+static gboolean
+run_batch_jobs (GPtrArray *jobs)
+{
+        GThreadPool *pool;
+        gboolean result = TRUE;
+        int n_threads, max_pending, n_pending;
+        guint i;
+
+        n_threads = CLAMP (sysconf (_SC_NPROCESSORS_ONLN), 1, (long)MAX (jobs->len, 1));
+        max_pending = 2 * n_threads;
+        n_pending = 0;
+
+        batch_done = g_async_queue_new ();
+        pool = g_thread_pool_new (render_batch_job, NULL, n_threads, FALSE, NULL);
+
+        for (i = 0; i < jobs->len; i++) {
+                BatchJob *job = g_ptr_array_index (jobs, i);
+                BatchJob *done;
+
+                restore_options (job->options);
+
+                if (!prepare_batch_job (job)) {
+                        finish_batch_job (job);
+                        result = FALSE;
+                        continue;
                 }
-                
-                /* Now adjust width/height in our original coordinate system
+
+                g_thread_pool_push (pool, job, NULL);
+                n_pending++;
+
+                /* Keep the threads busy without piling up rendered
+                 * backgrounds waiting to be sent to the X server.
                  */
-                if (gravity_x == 0) {
-                        x += (width - new_width) / 2;
-                } else if (gravity_x == 1) {
-                        x += (width - new_width);
+                while (n_pending > 0) {
+                        if (n_pending >= max_pending)
+                                done = g_async_queue_pop (batch_done);
+                        else
+                                done = g_async_queue_try_pop (batch_done);
+                        if (!done)
+                                break;
+                        
+                        result = finish_batch_job (done) && result;
+                        n_pending--;
                 }
+        }
 
-                if (gravity_y == 0) {
-                        y += (height - new_height) / 2;
-                } else if (gravity_y == 1) {
-                        y += (height - new_height);
+        while (n_pending > 0) {
+                result = finish_batch_job (g_async_queue_pop (batch_done)) && result;
+                n_pending--;
+        }
+
+        g_thread_pool_free (pool, FALSE, TRUE);
+        g_async_queue_unref (batch_done);
+        batch_done = NULL;
+
+        return result;
+}
+
+static gboolean
+run_batch (const char *filename)
+{
+        GError *error = NULL;
+        OptionValue *base_options;
+        GPtrArray *jobs;
+        char *contents;
+        char **lines;
+        gboolean result = TRUE;
+        guint i;
+
+        if (!g_file_get_contents (filename, &contents, NULL, &error)) {
+                fprintf (stderr, "%s: Cannot read batch file: %s\n", appname, error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        base_options = save_options ();
+        jobs = g_ptr_array_new ();
+
+        lines = g_strsplit (contents, "\n", -1);
+        for (i = 0; lines[i]; i++) {
+                char *line = g_strstrip (lines[i]);
+                BatchJob *job;
+
+                if (*line == '\0' || *line == '#')
+                        continue;
+
+                restore_options (base_options);
+                
+                job = parse_batch_line (filename, i + 1, line);
+                if (job)
+                        g_ptr_array_add (jobs, job);
+                else
+                        result = FALSE;
+        }
+        g_strfreev (lines);
+        g_free (contents);
+
+        result = run_batch_jobs (jobs) && result;
+
+        g_ptr_array_free (jobs, TRUE);
+        g_free (base_options);
+
+        return result;
+}
+
+/* Whether pixels for screens with visuals a and b are the same */
+static gboolean
+same_visual (GdkVisual *a,
+             GdkVisual *b)
+{
+        return (a->type == b->type && a->depth == b->depth &&
+                a->red_mask == b->red_mask && a->green_mask == b->green_mask &&
+                a->blue_mask == b->blue_mask);
+}
+
+/* --all-screens: screens of the same size and visual get the same
+ * background, so there is one job for each kind of screen.
+ */
+static gboolean
+set_all_screens (void)
+{
+        GdkDisplay *display = gdk_display_get_default ();
+        GPtrArray *jobs = g_ptr_array_new ();
+        gboolean result;
+        int n_screens = gdk_display_get_n_screens (display);
+        int i;
+        guint j;
+
+        for (i = 0; i < n_screens; i++) {
+                GdkScreen *screen = gdk_display_get_screen (display, i);
+                BatchJob *job = NULL;
+
+                for (j = 0; j < jobs->len; j++) {
+                        BatchJob *other = g_ptr_array_index (jobs, j);
+                        GdkScreen *other_screen = other->screens->data;
+
+                        if (gdk_screen_get_width (screen) == gdk_screen_get_width (other_screen) &&
+                            gdk_screen_get_height (screen) == gdk_screen_get_height (other_screen) &&
+                            same_visual (gdk_screen_get_system_visual (screen),
+                                         gdk_screen_get_system_visual (other_screen))) {
+                                job = other;
+                                break;
+                        }
                 }
 
-                width = new_width;
-                height = new_height;
+                if (!job) {
+                        job = new_batch_job (g_strdup_printf ("screen %d", i));
+                        g_ptr_array_add (jobs, job);
+                }
+
+                job->screens = g_slist_append (job->screens, screen);
         }
-        avoid_done:
 
-        debugmsg ("positioned at %dx%d+%d+%d: \n", width, height, x, y);
-        
-        bg_state.emblem_x = x;
-        bg_state.emblem_y = y;
-        bg_state.emblem_width = width;
-        bg_state.emblem_height = height;
+        result = run_batch_jobs (jobs);
+        g_ptr_array_free (jobs, TRUE);
+
+        return result;
+}
+
+/* --convert */
+static gboolean
+convert_to_raw (const char *input,
+                const char *output)
+{
+        GError *error = NULL;
+        BGImage *image;
+
+        if (!input) {
+                fprintf (stderr, "%s: --convert needs an image to convert\n", appname);
+                return FALSE;
+        }
+
+        image = decode_image (input, "input", 255, -1, -1, NULL, NULL, NULL);
+        if (!image)
+                return FALSE;
+
+        if (!bg_image_save_raw (image, output, &error)) {
+                fprintf (stderr, "%s: Cannot write raw image: %s\n", appname, error->message);
+                g_error_free (error);
+                bg_image_unref (image);
+                return FALSE;
+        }
+
+        bg_image_unref (image);
+
+        return TRUE;
+}
+
+/* --test shows the background scaled to a window that can be resized.
+ * test_state is always scaled from bg_state, so repeated resizes don't
+ * lose precision; the images keep the sizes they were recently drawn
+ * at, so going back and forth between sizes doesn't scale them again.
+ * test_pixmap holds what has been rendered at the current size and
+ * test_pending what hasn't. Only the exposed part of test_pending is
+ * rendered, a band at a time from an idle handler, so that a resize
+ * arriving in the middle starts over at the new size instead of
+ * finishing at the old one.
+ */
+static BGState test_state;
+static GdkPixmap *test_pixmap = NULL;
+static GdkRegion *test_pending = NULL;
+static GdkRegion *test_wanted = NULL;   /* exposed and pending */
+static guint test_idle = 0;
+static gint64 test_start;
+
+#define TEST_BAND_HEIGHT 64
+
+static int
+scale_test_size (int value,
+                 int new_size,
+                 int old_size)
+{
+        int scaled = ((gint64)value * new_size) / old_size;
+
+        return value > 0 ? MAX (scaled, 1) : scaled;
+}
+
+static void
+scale_test_state (int width,
+                  int height)
+{
+        int old_width = bg_state.width;
+        int old_height = bg_state.height;
+        int radius_size, radius_old_size;
+        int i;
+
+        /* Blur radii shrink with the direction that shrinks most */
+        if ((gint64)width * old_height < (gint64)height * old_width) {
+                radius_size = width;
+                radius_old_size = old_width;
+        } else {
+                radius_size = height;
+                radius_old_size = old_height;
+        }
+
+        test_state = bg_state;
+        test_state.width = width;
+        test_state.height = height;
+
+        test_state.emblem_x = ((gint64)bg_state.emblem_x * width) / old_width;
+        test_state.emblem_y = ((gint64)bg_state.emblem_y * height) / old_height;
+        test_state.emblem_width = scale_test_size (bg_state.emblem_width, width, old_width);
+        test_state.emblem_height = scale_test_size (bg_state.emblem_height, height, old_height);
+        test_state.tile_width = scale_test_size (bg_state.tile_width, width, old_width);
+        test_state.tile_height = scale_test_size (bg_state.tile_height, height, old_height);
+
+        test_state.tile_blur = scale_test_size (bg_state.tile_blur, radius_size, radius_old_size);
+        test_state.emblem_blur = scale_test_size (bg_state.emblem_blur, radius_size, radius_old_size);
+        test_state.blur = scale_test_size (bg_state.blur, radius_size, radius_old_size);
+
+        for (i = 0; i < bg_state.n_layers; i++) {
+                BGLayer *layer = &test_state.layers[i];
+
+                layer->x = ((gint64)bg_state.layers[i].x * width) / old_width;
+                layer->y = ((gint64)bg_state.layers[i].y * height) / old_height;
+                layer->width = scale_test_size (bg_state.layers[i].width, width, old_width);
+                layer->height = scale_test_size (bg_state.layers[i].height, height, old_height);
+                layer->blur = scale_test_size (bg_state.layers[i].blur, radius_size, radius_old_size);
+        }
+
+        background_index_layers (&test_state);
+}
+
+/* Render the next band of test_wanted into test_pixmap and show it */
+static gboolean
+render_test_band (gpointer data)
+{
+        GtkWidget *widget = data;
+        GdkRectangle *rects;
+        GdkRectangle band;
+        GdkRegion *region;
+        GdkPixbuf *pixbuf;
+        int n_rects;
+
+        gdk_region_get_rectangles (test_wanted, &rects, &n_rects);
+        if (n_rects == 0) {
+                g_free (rects);
+                debugmsg ("Rendered the visible part of %dx%d in %.1f ms\n",
+                          test_state.width, test_state.height,
+                          (g_get_monotonic_time () - test_start) / 1000.);
+                test_idle = 0;
+                return FALSE;
+        }
+
+        band = rects[0];
+        band.height = MIN (band.height, TEST_BAND_HEIGHT);
+        g_free (rects);
+
+        pixbuf = background_render_pixbuf (get_render_context (), &test_state, FALSE,
+                                           band.x, band.y, band.width, band.height);
+        gdk_draw_pixbuf (test_pixmap, NULL, pixbuf, 0, 0, band.x, band.y,
+                         band.width, band.height, GDK_RGB_DITHER_MAX, 0, 0);
+        g_object_unref (pixbuf);
+
+        gdk_draw_drawable (widget->window, widget->style->fg_gc[GTK_STATE_NORMAL], test_pixmap,
+                           band.x, band.y, band.x, band.y, band.width, band.height);
+
+        region = gdk_region_rectangle (&band);
+        gdk_region_subtract (test_pending, region);
+        gdk_region_subtract (test_wanted, region);
+        gdk_region_destroy (region);
+
+        return TRUE;
+}
+
+static void
+resize_test (GtkWidget *widget,
+             int        width,
+             int        height)
+{
+        GdkRectangle all = { 0, 0, width, height };
+
+        /* Drop whatever was being rendered at the old size */
+        if (test_idle) {
+                g_source_remove (test_idle);
+                test_idle = 0;
+        }
+
+        if (test_pixmap)
+                g_object_unref (test_pixmap);
+        if (test_pending)
+                gdk_region_destroy (test_pending);
+        if (test_wanted)
+                gdk_region_destroy (test_wanted);
+
+        test_pixmap = gdk_pixmap_new (widget->window, width, height, -1);
+        test_pending = gdk_region_rectangle (&all);
+        test_wanted = gdk_region_new ();
+
+        scale_test_state (width, height);
+
+        gdk_window_invalidate_rect (widget->window, NULL, FALSE);
+}
+
+static gboolean
+test_configure_event (GtkWidget         *widget,
+                      GdkEventConfigure *event,
+                      gpointer           data)
+{
+        if (event->width != test_state.width || event->height != test_state.height)
+                resize_test (widget, event->width, event->height);
+
+        return FALSE;
+}
+
+static gboolean
+test_expose_event (GtkWidget      *widget,
+                   GdkEventExpose *event,
+                   gpointer        data)
+{
+        GdkRegion *done = gdk_region_copy (event->region);
+        GdkRegion *wanted = gdk_region_copy (event->region);
+        GdkRectangle *rects;
+        int n_rects;
+        int i;
+
+        gdk_region_subtract (done, test_pending);
+        gdk_region_get_rectangles (done, &rects, &n_rects);
+        for (i = 0; i < n_rects; i++)
+                gdk_draw_drawable (widget->window, widget->style->fg_gc[GTK_STATE_NORMAL], test_pixmap,
+                                   rects[i].x, rects[i].y, rects[i].x, rects[i].y,
+                                   rects[i].width, rects[i].height);
+        g_free (rects);
+        gdk_region_destroy (done);
+
+        gdk_region_intersect (wanted, test_pending);
+        gdk_region_union (test_wanted, wanted);
+        gdk_region_destroy (wanted);
+
+        if (!test_idle && !gdk_region_empty (test_wanted)) {
+                test_start = g_get_monotonic_time ();
+                test_idle = g_idle_add (render_test_band, widget);
+        }
+
+        return TRUE;
+}
+
+static void
+start_test (void)
+{
+        GtkWidget *window;
+
+        window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+        gtk_widget_set_app_paintable (window, TRUE);
+        gtk_widget_set_double_buffered (window, FALSE);
+        gtk_window_set_default_size (GTK_WINDOW (window), bg_state.width / 2, bg_state.height / 2);
+        g_signal_connect (window, "destroy",
+                          G_CALLBACK (gtk_main_quit), NULL);
+        g_signal_connect (window, "configure-event",
+                          G_CALLBACK (test_configure_event), NULL);
+        g_signal_connect (window, "expose-event",
+                          G_CALLBACK (test_expose_event), NULL);
+
+        gtk_widget_realize (window);
+        resize_test (window, bg_state.width / 2, bg_state.height / 2);
+
+        gtk_widget_show (window);
 }
 
 int
 main (int argc, char **argv)
 {
-        poptContext opt_context;
-        int result;
-        const char *arg;
+        gboolean have_display;
         int i;
-        gchar *userrc;
 
         appname = g_path_get_basename (argv[0]);
   
@@ -454,176 +4616,217 @@ main (int argc, char **argv)
                 }
         }
 
-        gtk_init (&argc, &argv);
-  
-        opt_context = poptGetContext (appname, argc, (const char **)argv,
-                                      options_table, 0);
+        /* Without a display we can still write files */
+        have_display = gtk_init_check (&argc, &argv);
 
         userrc = g_strconcat (g_get_home_dir (), "/.xsrirc", NULL);
-        poptReadConfigFile (opt_context, userrc);
-        poptReadConfigFile (opt_context, SYSCONFDIR "/X11/xsrirc");
-                            
-        result = poptGetNextOpt (opt_context);
-        if (result != -1) {
-                fprintf(stderr, "%s: %s: %s\n",
-                        appname,
-                        poptBadOption(opt_context, POPT_BADOPTION_NOALIAS),
-                        poptStrerror(result));
+        saved_argc = argc;
+        saved_argv = argv;
+        default_options = save_options ();
+
+        if (!parse_options (argc, argv))
+                return 1;
+
+        if (want_my_version) {
+                printf ("xsri version %s\n", VERSION);
+                return 0;
+        }
+
+        if (output_display) {
+                fprintf (stderr, "%s: --output-display can only be used in --batch files\n", appname);
                 return 1;
         }
 
-        arg = poptGetArg (opt_context);
-        if (arg) {
-                if (!emblem_file) {
-                        emblem_file = arg;
-                        arg = poptGetArg (opt_context);
+        if (batch)
+                return run_batch (batch) ? 0 : 1;
+
+        if (convert)
+                return convert_to_raw (emblem_file, convert) ? 0 : 1;
+
+        if (!have_display && !(output && size)) {
+                fprintf (stderr, "%s: Cannot open display\n", appname);
+                return 1;
+        }
+
+        if (dump_root)
+                return write_root_file (dump_root) ? 0 : 1;
+
+        if (all_screens) {
+                if (run_mode != RUN_MODE_SET || output) {
+                        fprintf (stderr, "%s: --all-screens can only be used with --set\n", appname);
+                        return 1;
                 }
+
+                return set_all_screens () ? 0 : 1;
         }
 
-        if (arg) {
-                poptPrintUsage (opt_context, stderr, 0);
+        if (slideshow) {
+                if (run_mode != RUN_MODE_RUN) {
+                        fprintf (stderr, "%s: --slideshow can only be used with --run\n", appname);
+                        return 1;
+                }
+                if (emblem_file || text) {
+                        fprintf (stderr, "%s: --slideshow images take the place of the emblem\n", appname);
+                        return 1;
+                }
+                if (slideshow_interval <= 0) {
+                        fprintf (stderr, "%s: Invalid slideshow interval %d\n", appname, slideshow_interval);
+                        return 1;
+                }
+        }
+
+        if (run_mode == RUN_MODE_RUN && !slideshow)
+                read_desktop_sections (userrc);
+
+        if (emblem_file && text) {
+                fprintf (stderr, "%s: --text takes the place of the emblem image, so it can't be used with --emblem\n", appname);
                 return 1;
         }
 
-        if (want_my_version) {
-                printf ("xsri version %s\n", VERSION);
-                return 0;
+        if (schedule && stops) {
+                fprintf (stderr, "%s: --schedule gives the colors, so it can't be used with --stops\n", appname);
+                return 1;
         }
 
-        parse_colors ();
-        load_images ();
-        
-        if (bg_state.emblem_pixbuf)
-                position_emblem ();
+        if (schedule_interval <= 0) {
+                fprintf (stderr, "%s: Invalid schedule interval %d\n", appname, schedule_interval);
+                return 1;
+        }
+
+        if (max_server_memory < 0) {
+                fprintf (stderr, "%s: Invalid server memory limit %d\n", appname, max_server_memory);
+                return 1;
+        }
 
-        bg_state.width =  gdk_screen_width();
-        bg_state.height = gdk_screen_height();
+        if (max_cpu < 0 || max_cpu > 100) {
+                fprintf (stderr, "%s: Invalid CPU limit %d\n", appname, max_cpu);
+                return 1;
+        }
 
-        if (run_mode == RUN_MODE_SET) {
-                int tile_width, tile_height;
-                GdkPixmap *pixmap;
+        if (max_upload_rate < 0) {
+                fprintf (stderr, "%s: Invalid upload rate %d\n", appname, max_upload_rate);
+                return 1;
+        }
 
-                if (bg_state.emblem_pixbuf ||
-                    !background_get_tile_size (&bg_state, &tile_width, &tile_height)) {
-                        tile_width = bg_state.width;
-                        tile_height = bg_state.height;
+        if (idle_trim < 0) {
+                fprintf (stderr, "%s: Invalid idle trim delay %d\n", appname, idle_trim);
+                return 1;
+        }
+
+#ifndef HAVE_SYS_INOTIFY_H
+        if (watch) {
+                fprintf (stderr, "%s: --watch is not supported on this system\n", appname);
+                return 1;
+        }
+#endif
+
+        if (watch && (run_mode != RUN_MODE_RUN || slideshow || per_desktop)) {
+                fprintf (stderr, "%s: --watch can only be used with --run, without a slideshow or per-desktop backgrounds\n", appname);
+                return 1;
+        }
+
+        if (size) {
+                if (!parse_size (size, &bg_state.width, &bg_state.height)) {
+                        fprintf (stderr, "%s: Invalid size: %s\n", appname, size);
+                        return 1;
                 }
+        } else {
+                bg_state.width =  gdk_screen_width();
+                bg_state.height = gdk_screen_height();
+        }
 
-                /* We could set_root_color if tile_width == 1 && tile_height == 1),
-                 * but transparent-terminal apps need the pixmap. Could
-                 * use set_root_color and set the pixmap...
-                 */
-                pixmap = make_root_pixmap (tile_width, tile_height);
-                background_render (&bg_state, pixmap, FALSE,
-                                   0, 0, tile_width, tile_height);
-                set_root_pixmap (pixmap);
-                dispose_root_pixmap (pixmap);
+        if (output)
+                run_mode = RUN_MODE_SET;
+
+        /* Unless it has to be seen whole, to emboss or blur it */
+        stream_emblem = (run_mode == RUN_MODE_SET && !output && emblem_file &&
+                         !emboss && emblem_blur == 0 && blur == 0 &&
+                         !bg_image_file_is_raw (emblem_file));
+
+        parse_colors (&bg_state);
+        load_images (&bg_state);
+
+        if (output) {
+                GError *error = NULL;
+
+                if (!write_output_file (&bg_state, output, &error)) {
+                        fprintf (stderr, "%s: Cannot write %s: %s\n", appname, output, error->message);
+                        g_error_free (error);
+                        return 1;
+                }
+
+                return 0;
         }
 
-        if (run_mode == RUN_MODE_RUN) {
+        if (run_mode == RUN_MODE_SET) {
                 int tile_width, tile_height;
-                gboolean tiles_useful = FALSE;
-                GdkPixmap *pixmap;
-
-                if (background_get_tile_size (&bg_state, &tile_width, &tile_height)) {
-                        guint tile_pixels = tile_width * tile_height;
-                        guint emblem_pixels = bg_state.emblem_width * bg_state.emblem_height;
-                        guint all_pixels = bg_state.width * bg_state.height;
-
-                        if (tile_pixels + emblem_pixels < all_pixels) {
-                                tiles_useful = TRUE;
-                                debugmsg ("Saved %d/%d (%2.0f%%) pixels by tiling\n",
-                                          all_pixels - (tile_pixels + emblem_pixels), all_pixels,
-                                          100 * (double)(all_pixels - (tile_pixels + emblem_pixels)) /all_pixels);
-                        }
-                }
-                
-                if (!tiles_useful) {
+                GdkPixbuf *pixbuf;
+                gsize pixmap_bytes;
+                gint64 start = g_get_monotonic_time ();
+
+                if (stream_emblem) {
                         tile_width = bg_state.width;
                         tile_height = bg_state.height;
-                }
-
-                if (tile_width == 1 && tile_height == 1) {
-                        XSetWindowBackground (GDK_DISPLAY(), get_root_xwindow(),
-                                              xpixel_from_color (&bg_state.bgColor1));
-                        XClearWindow (GDK_DISPLAY (), get_root_xwindow ());
+                        set_root_streaming (gdk_screen_get_default (), &bg_state);
+                        debugmsg ("Decoded and rendered %dx%d in %.1f ms\n", tile_width, tile_height,
+                                  (g_get_monotonic_time () - start) / 1000.);
                 } else {
-                        pixmap = gdk_pixmap_new (get_root_gdk_window (), tile_width, tile_height, -1);
-                        background_render (&bg_state, pixmap, tiles_useful,
-                                           0, 0, tile_width, tile_height);
-                        
-                        gdk_window_set_back_pixmap (get_root_gdk_window (), pixmap, FALSE);
-                        g_object_unref (pixmap);
-                        gdk_window_clear (get_root_gdk_window ());
-                }
-                
-                if (tiles_useful && bg_state.emblem_pixbuf) {
-                        GdkWindow *window;
-                        
-                        GdkWindowAttr attributes;
-                            
-                        attributes.x = bg_state.emblem_x;
-                        attributes.y = bg_state.emblem_y;
-                        attributes.width = bg_state.emblem_width;
-                        attributes.height = bg_state.emblem_height;
-
-                        attributes.window_type = GDK_WINDOW_TEMP;
-                        attributes.wclass = GDK_INPUT_OUTPUT;
-                        attributes.visual = gdk_visual_get_system ();
-                        attributes.colormap = gdk_colormap_get_system ();
-                        attributes.event_mask = 0;
-                        
-                        window = gdk_window_new (get_root_gdk_window (), &attributes,
-                                                 GDK_WA_X | GDK_WA_Y | GDK_WA_VISUAL | GDK_WA_COLORMAP);
-                        pixmap = gdk_pixmap_new (window, bg_state.emblem_width, bg_state.emblem_height, -1);
-                        background_render (&bg_state, pixmap, FALSE,
-                                           bg_state.emblem_x, bg_state.emblem_y, bg_state.emblem_width, bg_state.emblem_height);
-
-                        gdk_window_set_back_pixmap (window, pixmap, FALSE);
-                        g_object_unref (pixmap);
-                        
-                        gdk_window_show (window);
-                        gdk_window_lower (window);
+                        get_root_pixmap_size (&bg_state, gdk_visual_get_system (), &tile_width, &tile_height);
+                        pixbuf = background_render_pixbuf (get_render_context (), &bg_state, FALSE,
+                                                           0, 0, tile_width, tile_height);
+                        debugmsg ("Rendered %dx%d in %.1f ms\n", tile_width, tile_height,
+                                  (g_get_monotonic_time () - start) / 1000.);
+                        set_root_from_pixbuf (gdk_screen_get_default (), pixbuf);
+                        g_object_unref (pixbuf);
                 }
 
-                /* Wait forever */
-                gtk_main ();
+                /* The pixmap has to stay on the server after we exit,
+                 * so there is no cheaper way to show it; just say so.
+                 */
+                pixmap_bytes = (gsize)tile_width * tile_height * get_bytes_per_pixel ();
+                debugmsg ("The background takes %lu KB on the X server\n", (gulong)(pixmap_bytes / 1024));
+                if (max_server_memory && pixmap_bytes > (gsize)max_server_memory * 1024)
+                        fprintf (stderr, "%s: The background needs %lu KB on the X server, more than --max-server-memory\n",
+                                 appname, (gulong)(pixmap_bytes / 1024));
         }
 
-        if (run_mode == RUN_MODE_TEST) {
-                GtkWidget *window;
-                GdkPixmap *pixmap;
-
-                int old_width = bg_state.width;
-                int old_height = bg_state.height;
+        /* What is shown from now on isn't published as a buffer, nor
+         * as a root pixmap that outlives us, so drop any that --set
+         * left behind; --dump-root then reads what the screen shows.
+         */
+        if (run_mode == RUN_MODE_RUN) {
+                unset_root_buffer (gdk_screen_get_default ());
+                set_root_pixmap (gdk_screen_get_default (), NULL);
+        }
 
-                bg_state.width /= 2;
-                bg_state.height /= 2;
+        if (run_mode == RUN_MODE_RUN && slideshow) {
+                start_slideshow ();
 
-                window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
-                gtk_widget_set_app_paintable (window, TRUE);
-                gtk_widget_set_size_request (window, bg_state.width, bg_state.height);
-                gtk_window_set_resizable (GTK_WINDOW (window), FALSE);
-                g_signal_connect (window, "destroy",
-                                  G_CALLBACK (gtk_main_quit), NULL);
+                /* Wait forever */
+                gtk_main ();
+        } else if (run_mode == RUN_MODE_RUN && per_desktop) {
+                start_desktops ();
 
-                gtk_widget_realize (window);
+                /* Wait forever */
+                gtk_main ();
+        } else if (run_mode == RUN_MODE_RUN) {
+                run_render ();
 
-                pixmap = gdk_pixmap_new (window->window, bg_state.width, bg_state.height, -1);
+#ifdef HAVE_SYS_INOTIFY_H
+                if (watch)
+                        start_watching ();
+#endif
+                if (schedule)
+                        start_schedule ();
 
-                bg_state.emblem_x = (bg_state.emblem_x * bg_state.width) / old_width;
-                bg_state.emblem_y = (bg_state.emblem_y * bg_state.height) / old_height;
-                bg_state.emblem_width = (bg_state.emblem_width * bg_state.width) / old_width;
-                bg_state.emblem_height = (bg_state.emblem_height * bg_state.height) / old_height;
-                bg_state.tile_width = (bg_state.tile_width * bg_state.width) / old_width;
-                bg_state.tile_height = (bg_state.tile_height * bg_state.height) / old_height;
+                /* Wait forever */
+                gtk_main ();
+        }
 
-                background_render (&bg_state, pixmap, FALSE, 0, 0, bg_state.width, bg_state.height);
-                
-                gdk_window_set_back_pixmap (window->window, pixmap, FALSE);
-                g_object_unref (pixmap);
+        if (run_mode == RUN_MODE_TEST) {
+                start_test ();
 
-                gtk_widget_show (window);
+                /* Wait until the window is closed */
                 gtk_main ();
         }
   